@@ -0,0 +1,444 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include <omp.h>
+#include "waspscan.h"
+
+/* maximum number of fixture files */
+#define BENCH_MAX_FILES    256
+
+/* maximum number of benchmark results */
+#define BENCH_MAX_RESULTS  64
+
+/* light curve length used when benchmarking folds */
+#define BENCH_CURVE_LENGTH 128
+
+/* number of seconds in a day */
+#define BENCH_DAY          (60.0f*60.0f*24.0f)
+
+struct bench_result {
+    char name[128];
+    char unit[32];
+    double rate;
+    double samples_per_second;
+    double seconds;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int no_of_results = 0;
+
+/* keeps results which are otherwise unused from being optimised away */
+static volatile int bench_sink = 0;
+
+/* detection thresholds, the same as those used by test/test */
+static struct detect_params params = {
+    .min_dipped_density = 0.38f,
+    .max_dipped_percent = 20.0f,
+    .min_intermediate_percent = 5.0f,
+    .max_intermediate_percent = 30.0f,
+    .expected_dip_radius_percent = 2.0f,
+    .peak_threshold = 0.6f,
+    .max_vacancy_density = 0.008f,
+    .dip_threshold = 0.2f
+};
+static float increment_days = 0.864f / BENCH_DAY;
+
+/**
+ * @brief Returns the monotonic time in seconds
+ * @returns Time in seconds
+ */
+static double bench_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1.0e-9);
+}
+
+/**
+ * @brief Stores and prints a benchmark result
+ * @param name Name of the benchmark
+ * @param unit Unit of the rate
+ * @param operations Number of operations performed
+ * @param samples Number of samples processed
+ * @param seconds Elapsed time
+ */
+static void bench_add(char * name, char * unit,
+                      double operations, double samples, double seconds)
+{
+    struct bench_result * result;
+
+    if (no_of_results >= BENCH_MAX_RESULTS) return;
+    if (seconds <= 0) seconds = 1.0e-9;
+
+    result = &results[no_of_results++];
+    sprintf(result->name, "%s", name);
+    sprintf(result->unit, "%s", unit);
+    result->rate = operations / seconds;
+    result->samples_per_second = samples / seconds;
+    result->seconds = seconds;
+
+    printf("%-40s %14.1f %-20s %14.0f samples/s\n",
+           name, result->rate, unit, result->samples_per_second);
+}
+
+/**
+ * @brief Creates a synthetic series resembling SuperWASP cadence,
+ *        with nightly observing sections, noise and a transit
+ * @param timestamp Returned times in seconds
+ * @param series Returned flux values
+ * @param series_length Number of samples to create
+ */
+static void bench_synthetic(float timestamp[], float series[],
+                            int series_length)
+{
+    unsigned int seed = 4827;
+    double t = 1.0e8, phase, noise;
+    double period = 1.7 * BENCH_DAY;
+    int i, j;
+
+    for (i = 0; i < series_length; i++) {
+        /* a sample every 40 seconds through an 8 hour night */
+        t += 40;
+        if (fmod(t, BENCH_DAY) > 8*60*60) t += 16*60*60;
+
+        noise = 0;
+        for (j = 0; j < 4; j++)
+            noise += (rand_r(&seed) / (double)RAND_MAX) - 0.5;
+
+        phase = fmod(t, period) / period;
+        timestamp[i] = (float)t;
+        series[i] = 15.0f + (float)(noise * 0.4);
+        if (phase < 0.02) series[i] -= 0.3f;
+    }
+}
+
+/**
+ * @brief Times logfile_load over a set of fixtures
+ * @param filenames Fixture files
+ * @param no_of_files Number of fixture files
+ * @param timestamp Buffer for times
+ * @param series Buffer for flux values
+ */
+static void bench_load(char filenames[][MAX_FILENAME_LENGTH],
+                       int no_of_files,
+                       float timestamp[], float series[])
+{
+    double start, samples = 0;
+    int i, n;
+
+    start = bench_clock();
+    for (i = 0; i < no_of_files; i++) {
+        n = logfile_load(filenames[i], timestamp, series,
+                         MAX_SERIES_LENGTH, 0, 3);
+        if (n > 0) samples += n;
+    }
+    bench_add("logfile_load/fixtures", "files/s", no_of_files, samples,
+              bench_clock() - start);
+}
+
+/**
+ * @brief Times light_curve and detect_phase_offset on a series
+ * @param label Label for the series
+ * @param timestamp Times in seconds
+ * @param series Flux values
+ * @param series_length Number of samples
+ * @param folds Number of trial periods to fold
+ */
+static void bench_fold(char * label, float timestamp[], float series[],
+                       int series_length, int folds)
+{
+    char name[128];
+    float curve[BENCH_CURVE_LENGTH], density[BENCH_CURVE_LENGTH];
+    double start, seconds;
+    int i, offset = 0;
+
+    start = bench_clock();
+    for (i = 0; i < folds; i++) {
+        light_curve(timestamp, series, series_length,
+                    1.0f + (i * 0.001f), curve, density,
+                    BENCH_CURVE_LENGTH);
+    }
+    seconds = bench_clock() - start;
+    sprintf(name, "light_curve/%s", label);
+    bench_add(name, "folds/s", folds, (double)folds * series_length,
+              seconds);
+
+    start = bench_clock();
+    for (i = 0; i < folds*100; i++) {
+        curve[i % BENCH_CURVE_LENGTH] += 0.001f;
+        offset += detect_phase_offset(curve, BENCH_CURVE_LENGTH);
+    }
+    seconds = bench_clock() - start;
+    bench_sink = offset;
+    sprintf(name, "detect_phase_offset/%s", label);
+    bench_add(name, "calls/s", folds*100, 0, seconds);
+}
+
+/**
+ * @brief Times detect_orbital_period on a series
+ * @param label Label for the series
+ * @param timestamp Times in seconds
+ * @param series Flux values
+ * @param series_length Number of samples
+ * @param trials Number of trial periods to search
+ * @param seconds_total Running total of elapsed time
+ * @param trials_total Running total of trial periods
+ * @param samples_total Running total of samples folded
+ */
+static void bench_detect(char * label, float timestamp[], float series[],
+                         int series_length, int trials,
+                         double * seconds_total, double * trials_total,
+                         double * samples_total)
+{
+    char name[128];
+    double start, seconds;
+    float min_period_days = 1.0f;
+
+    start = bench_clock();
+    detect_orbital_period(timestamp, series, series_length,
+                          min_period_days,
+                          min_period_days + (trials * increment_days),
+                          increment_days, &params, NULL);
+    seconds = bench_clock() - start;
+
+    if (label != NULL) {
+        sprintf(name, "detect_orbital_period/%s", label);
+        bench_add(name, "trial periods/s", trials,
+                  (double)trials * series_length, seconds);
+    }
+    *seconds_total += seconds;
+    *trials_total += trials;
+    *samples_total += (double)trials * series_length;
+}
+
+/**
+ * @brief Saves results as JSON, with one result per line
+ * @param filename File to save as
+ * @returns zero on success
+ */
+static int bench_save(char * filename)
+{
+    FILE * fp;
+    int i;
+
+    fp = fopen(filename, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "{\n  \"version\": %.2f,\n", VERSION);
+    fprintf(fp, "  \"threads\": %d,\n", omp_get_max_threads());
+    fprintf(fp, "  \"results\": [\n");
+    for (i = 0; i < no_of_results; i++) {
+        fprintf(fp, "    {\"name\": \"%s\", \"unit\": \"%s\", "
+                "\"rate\": %.3f, \"samples_per_second\": %.1f, "
+                "\"seconds\": %.6f}%s\n",
+                results[i].name, results[i].unit, results[i].rate,
+                results[i].samples_per_second, results[i].seconds,
+                (i < no_of_results-1) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @brief Compares results against a baseline saved by bench_save
+ * @param filename The baseline file
+ * @param threshold_percent Slowdown beyond which a result is
+ *        considered to be a regression
+ * @returns The number of regressions, or -1 if there is no baseline
+ */
+static int bench_compare(char * filename, float threshold_percent)
+{
+    FILE * fp;
+    char linestr[512], name[128];
+    char * name_start, * name_end, * rate_start;
+    double rate, change;
+    int i, regressions = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    printf("\nComparison with %s (threshold %.1f%%)\n",
+           filename, threshold_percent);
+    while (fgets(linestr, 511, fp) != NULL) {
+        name_start = strstr(linestr, "\"name\": \"");
+        rate_start = strstr(linestr, "\"rate\": ");
+        if ((name_start == NULL) || (rate_start == NULL)) continue;
+        name_start += strlen("\"name\": \"");
+        name_end = strchr(name_start, '"');
+        if ((name_end == NULL) || (name_end - name_start >= 128)) continue;
+        memcpy(name, name_start, name_end - name_start);
+        name[name_end - name_start] = 0;
+        rate = atof(rate_start + strlen("\"rate\": "));
+        if (rate <= 0) continue;
+
+        for (i = 0; i < no_of_results; i++) {
+            if (strcmp(results[i].name, name) != 0) continue;
+            change = (results[i].rate - rate) * 100.0 / rate;
+            printf("%-40s %+8.1f%%%s\n", name, change,
+                   (change < -threshold_percent) ? "  REGRESSION" : "");
+            if (change < -threshold_percent) regressions++;
+            break;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+void show_help()
+{
+    printf("WASPscan benchmarks\n\n");
+    printf(" -d  --dir                   Fixtures directory\n");
+    printf(" -o  --output                Results filename (JSON)\n");
+    printf(" -b  --baseline              Baseline results to compare against\n");
+    printf("     --threshold             Regression threshold percent\n");
+    printf("     --trials                Trial periods per fixture\n");
+    printf("     --maxsynthetic          Largest synthetic series length\n");
+    printf(" -h  --help                  Show help\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int i, j, no_of_files = 0, n, trials = 1000, folds;
+    int max_synthetic = 10000000, synthetic_length;
+    char fixtures_dir[256], output_filename[256], baseline_filename[256];
+    char subdir[256*2], label[64];
+    char (*filenames)[MAX_FILENAME_LENGTH];
+    float * timestamp, * series;
+    float threshold_percent = 10.0f;
+    double seconds = 0, trials_total = 0, samples_total = 0;
+    int regressions;
+
+    sprintf(fixtures_dir, "%s", "test");
+    sprintf(output_filename, "%s", "bench_results.json");
+    baseline_filename[0] = 0;
+
+    for (i = 1; i < argc; i++) {
+        if ((strcmp(argv[i],"-d")==0) ||
+            (strcmp(argv[i],"--dir")==0)) {
+            i++;
+            if (i < argc) sprintf(fixtures_dir, "%s", argv[i]);
+        }
+        if ((strcmp(argv[i],"-o")==0) ||
+            (strcmp(argv[i],"--output")==0)) {
+            i++;
+            if (i < argc) sprintf(output_filename, "%s", argv[i]);
+        }
+        if ((strcmp(argv[i],"-b")==0) ||
+            (strcmp(argv[i],"--baseline")==0)) {
+            i++;
+            if (i < argc) sprintf(baseline_filename, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--threshold")==0) {
+            i++;
+            if (i < argc) threshold_percent = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--trials")==0) {
+            i++;
+            if (i < argc) trials = atoi(argv[i]);
+        }
+        if (strcmp(argv[i],"--maxsynthetic")==0) {
+            i++;
+            if (i < argc) max_synthetic = atoi(argv[i]);
+        }
+        if ((strcmp(argv[i],"-h")==0) ||
+            (strcmp(argv[i],"--help")==0)) {
+            show_help();
+            return 0;
+        }
+    }
+
+    filenames = malloc(BENCH_MAX_FILES * MAX_FILENAME_LENGTH);
+    n = max_synthetic;
+    if (n < MAX_SERIES_LENGTH) n = MAX_SERIES_LENGTH;
+    timestamp = (float*)malloc(n * sizeof(float));
+    series = (float*)malloc(n * sizeof(float));
+    if ((filenames == NULL) || (timestamp == NULL) || (series == NULL)) {
+        printf("Unable to allocate memory\n");
+        return 1;
+    }
+
+    /* fixtures */
+    for (j = 0; j < 2; j++) {
+        sprintf(subdir, "%s/%s", fixtures_dir,
+                (j == 0) ? "positive" : "negative");
+        n = scan_directory(subdir, ".tbl", &filenames[no_of_files],
+                           BENCH_MAX_FILES - no_of_files);
+        if (n > 0) no_of_files += n;
+    }
+    printf("%d fixtures, %d threads\n\n", no_of_files, omp_get_max_threads());
+
+    if (no_of_files > 0) {
+        bench_load(filenames, no_of_files, timestamp, series);
+
+        n = logfile_load(filenames[0], timestamp, series,
+                         MAX_SERIES_LENGTH, 0, 3);
+        if (n > 0) bench_fold("fixture", timestamp, series, n, 1000);
+
+        for (i = 0; i < no_of_files; i++) {
+            n = logfile_load(filenames[i], timestamp, series,
+                             MAX_SERIES_LENGTH, 0, 3);
+            if (n <= 0) continue;
+            bench_detect(NULL, timestamp, series, n, trials,
+                         &seconds, &trials_total, &samples_total);
+        }
+        bench_add("detect_orbital_period/fixtures", "trial periods/s",
+                  trials_total, samples_total, seconds);
+    }
+
+    /* synthetic series of increasing length, keeping the number
+       of samples folded roughly constant */
+    for (synthetic_length = 1000; synthetic_length <= max_synthetic;
+         synthetic_length *= 10) {
+        bench_synthetic(timestamp, series, synthetic_length);
+        folds = 20000000 / synthetic_length;
+        if (folds < 4) folds = 4;
+        if (folds > 2000) folds = 2000;
+        sprintf(label, "synthetic_%d", synthetic_length);
+        bench_fold(label, timestamp, series, synthetic_length, folds);
+        seconds = trials_total = samples_total = 0;
+        bench_detect(label, timestamp, series, synthetic_length, folds,
+                     &seconds, &trials_total, &samples_total);
+    }
+
+    if (bench_save(output_filename) != 0) {
+        printf("Unable to save %s\n", output_filename);
+        return 2;
+    }
+    printf("\nResults saved to %s\n", output_filename);
+
+    regressions = 0;
+    if (baseline_filename[0] != 0) {
+        regressions = bench_compare(baseline_filename, threshold_percent);
+        if (regressions < 0) {
+            printf("\nNo baseline found at %s\n", baseline_filename);
+            regressions = 0;
+        }
+        else if (regressions > 0) {
+            printf("%d regressions\n", regressions);
+        }
+    }
+
+    free(filenames);
+    free(timestamp);
+    free(series);
+    return (regressions > 0) ? 3 : 0;
+}
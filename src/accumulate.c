@@ -0,0 +1,268 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* An accumulator store holds the count, sum and sum of squares of the
+   samples within each bucket for every trial period of one star's
+   search. When further observations are appended to the log file only
+   the new samples need to be folded into these sums before the trial
+   periods are scored again, so the cost of keeping a search up to date
+   scales with the new data rather than with the whole series.
+
+   The samples already added are identified by their number and a hash
+   of their values, so if the earlier part of the log file changes the
+   sums are started again from nothing. The store is updated in place,
+   and is marked as incomplete while that happens so that an interrupted
+   update is never read. */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "waspscan.h"
+
+/* identifies an accumulator store file */
+#define ACCUMULATE_MAGIC        "WASPACCU"
+#define ACCUMULATE_VERSION      1
+
+/* records begin after the header, on a page boundary */
+#define ACCUMULATE_HEADER_BYTES 4096
+
+struct accumulator_header {
+    char magic[8];
+    int version;
+    int complete;
+    int record_bytes;
+    int steps;
+    int folded;
+    unsigned int series_hash;
+    float min_period_days;
+    float max_period_days;
+    float increment_days;
+    float clip_min;
+    float clip_max;
+};
+
+/**
+ * @brief Returns a hash of the start of a series
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param length Number of samples from the start to be hashed
+ * @returns The hash
+ */
+static unsigned int accumulate_series_hash(float timestamp[], float series[],
+                                           int length)
+{
+    unsigned int hash;
+
+    hash = fnv1a_hash(timestamp, length*sizeof(float), FNV1A_OFFSET);
+    return fnv1a_hash(series, length*sizeof(float), hash);
+}
+
+/**
+ * @brief Checks whether an existing store was made for the same search
+ *        grid from the start of the same series
+ * @param existing Header of the existing store
+ * @param header The header expected
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @returns Non-zero if the sums within the store may be added to
+ */
+static int accumulate_valid(struct accumulator_header * existing,
+                            struct accumulator_header * header,
+                            float timestamp[], float series[],
+                            int series_length)
+{
+    if ((memcmp(existing->magic, header->magic, 8) != 0) ||
+        (existing->version != header->version) ||
+        (!existing->complete) ||
+        (existing->record_bytes != header->record_bytes) ||
+        (existing->steps != header->steps) ||
+        (existing->min_period_days != header->min_period_days) ||
+        (existing->max_period_days != header->max_period_days) ||
+        (existing->increment_days != header->increment_days) ||
+        (existing->folded < 0) ||
+        (existing->folded > series_length))
+        return 0;
+
+    /* samples may only have been appended */
+    return (existing->series_hash ==
+            accumulate_series_hash(timestamp, series, existing->folded));
+}
+
+/**
+ * @brief Opens the accumulator store for a star and search grid. If the
+ *        store was made from the start of the same series then the
+ *        samples already added to it are kept, otherwise its sums are
+ *        started again from nothing. Either way the samples from
+ *        store->folded onwards remain to be added.
+ * @param directory Directory in which stores are kept
+ * @param name Name of the star
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param store Returned store
+ * @returns zero on success
+ */
+int accumulate_open(char * directory, char * name,
+                    float timestamp[], float series[], int series_length,
+                    float min_period_days, float max_period_days,
+                    float increment_days,
+                    struct accumulator_store * store)
+{
+    struct accumulator_header header, * existing;
+    struct stat st;
+    unsigned int grid_hash;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+
+    memset(store, 0, sizeof(struct accumulator_store));
+    store->fd = -1;
+    if ((steps < 1) || (steps > MAX_SEARCH_STEPS)) return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ACCUMULATE_MAGIC, 8);
+    header.version = ACCUMULATE_VERSION;
+    header.record_bytes = (int)sizeof(struct accumulator_record);
+    header.steps = steps;
+    header.min_period_days = min_period_days;
+    header.max_period_days = max_period_days;
+    header.increment_days = increment_days;
+
+    /* the filename is keyed by the search grid, so that stores for
+       several grids may be kept for the same star */
+    grid_hash = fnv1a_hash(&header.record_bytes, sizeof(int), FNV1A_OFFSET);
+    grid_hash = fnv1a_hash(&header.min_period_days, sizeof(float)*3,
+                           grid_hash);
+    if (strlen(directory) + strlen(name) + 16 >= MAX_FILENAME_LENGTH*2)
+        return -2;
+    sprintf(store->filename, "%s/%s_%08x.acc", directory, name, grid_hash);
+
+    store->steps = steps;
+    store->length = ACCUMULATE_HEADER_BYTES +
+        ((size_t)steps * sizeof(struct accumulator_record));
+
+    /* the store is updated in place, so only one search may use it */
+    store->fd = open(store->filename, O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0) return -3;
+    if ((flock(store->fd, LOCK_EX) != 0) || (fstat(store->fd, &st) != 0)) {
+        close(store->fd);
+        store->fd = -1;
+        return -4;
+    }
+
+    if ((size_t)st.st_size == store->length) {
+        store->map = (unsigned char*)mmap(NULL, store->length,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED, store->fd, 0);
+        if (store->map == MAP_FAILED) store->map = NULL;
+    }
+
+    if ((store->map != NULL) &&
+        accumulate_valid((struct accumulator_header*)store->map, &header,
+                         timestamp, series, series_length)) {
+        existing = (struct accumulator_header*)store->map;
+        store->folded = existing->folded;
+        store->clip_min = existing->clip_min;
+        store->clip_max = existing->clip_max;
+    }
+    else {
+        /* start again, with every sum zero */
+        if (store->map != NULL) munmap(store->map, store->length);
+        store->map = NULL;
+        if ((ftruncate(store->fd, 0) != 0) ||
+            (ftruncate(store->fd, (off_t)store->length) != 0)) {
+            close(store->fd);
+            store->fd = -1;
+            return -5;
+        }
+        store->map = (unsigned char*)mmap(NULL, store->length,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED, store->fd, 0);
+        if (store->map == MAP_FAILED) {
+            store->map = NULL;
+            close(store->fd);
+            store->fd = -1;
+            return -6;
+        }
+        memcpy(store->map, &header, sizeof(struct accumulator_header));
+    }
+
+    /* until the update is finished the sums are not to be trusted */
+    ((struct accumulator_header*)store->map)->complete = 0;
+    if (msync(store->map, ACCUMULATE_HEADER_BYTES, MS_SYNC) != 0) {
+        munmap(store->map, store->length);
+        store->map = NULL;
+        close(store->fd);
+        store->fd = -1;
+        return -7;
+    }
+    store->records = (struct accumulator_record*)
+        (store->map + ACCUMULATE_HEADER_BYTES);
+    return 0;
+}
+
+/**
+ * @brief Closes a store, recording which samples have been added to it
+ *        and marking it as complete
+ * @param store The store
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @returns zero on success
+ */
+int accumulate_close(struct accumulator_store * store,
+                     float timestamp[], float series[], int series_length)
+{
+    struct accumulator_header * header;
+    int retval = 0;
+
+    if (store->map == NULL) return 0;
+
+    header = (struct accumulator_header*)store->map;
+    if (store->folded == series_length) {
+        header->folded = store->folded;
+        header->series_hash =
+            accumulate_series_hash(timestamp, series, store->folded);
+        header->clip_min = store->clip_min;
+        header->clip_max = store->clip_max;
+
+        /* the sums are written before the store is marked complete */
+        if (msync(store->map, store->length, MS_SYNC) != 0) retval = -1;
+        if (retval == 0) {
+            header->complete = 1;
+            if (msync(store->map, ACCUMULATE_HEADER_BYTES, MS_SYNC) != 0)
+                retval = -2;
+        }
+    }
+    else {
+        /* the search did not finish adding the new samples */
+        retval = -3;
+    }
+
+    munmap(store->map, store->length);
+    close(store->fd);
+    store->map = NULL;
+    store->records = NULL;
+    store->fd = -1;
+    return retval;
+}
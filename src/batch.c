@@ -0,0 +1,578 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Searches a list of stars, grouping those which were imaged in the
+   same exposures so that each group can be folded together. Stars
+   within the same field of one camera share most of their imaging
+   times, although each star has some exposures missing and the times
+   recorded for the same exposure may differ by a second or so. Times
+   within BATCH_TIME_TOLERANCE of each other are treated as the same
+   exposure, and each group is searched over the union of its times,
+   with stars having zero weight at the times they were not imaged.
+   Trends common to a whole group may be removed before searching, and
+   then the group is folded BATCH_MAX_STARS at a time. */
+
+#include "waspscan.h"
+
+/* seconds within which the times of two samples are the same exposure */
+#define BATCH_TIME_TOLERANCE  2.0f
+
+/* fraction of exposures which a star must share with the first star
+   of a group in order to join it. Groups may have any number of stars,
+   and are folded BATCH_MAX_STARS at a time. */
+#define BATCH_MIN_OVERLAP     0.9f
+
+struct batch_star {
+    char filename[MAX_FILENAME_LENGTH];
+    float * timestamp;
+    float * series;
+    int length;
+    int group;
+
+    /* identifies the contents of the log file within the manifest */
+    unsigned long long content_hash;
+    long content_length;
+};
+
+/**
+ * @brief Returns the fraction of the samples of two stars which were
+ *        taken in the same exposures
+ * @param a The first star
+ * @param b The second star
+ * @returns Fraction of the samples of the star having the most
+ */
+static float batch_overlap(struct batch_star * a, struct batch_star * b)
+{
+    int i = 0, j = 0, shared = 0;
+
+    while ((i < a->length) && (j < b->length)) {
+        if (a->timestamp[i] < b->timestamp[j] - BATCH_TIME_TOLERANCE) {
+            i++;
+        }
+        else if (b->timestamp[j] < a->timestamp[i] - BATCH_TIME_TOLERANCE) {
+            j++;
+        }
+        else {
+            shared++;
+            i++;
+            j++;
+        }
+    }
+    if (a->length > b->length) return shared / (float)a->length;
+    return shared / (float)b->length;
+}
+
+/**
+ * @brief Returns non-zero if the times of a star are in ascending order,
+ *        which is needed to match them with those of other stars
+ * @param star The star
+ * @returns Non-zero if in ascending order
+ */
+static int batch_sorted(struct batch_star * star)
+{
+    int i;
+
+    for (i = 1; i < star->length; i++)
+        if (star->timestamp[i] < star->timestamp[i-1]) return 0;
+    return 1;
+}
+
+/**
+ * @brief Merges the times of a group of stars into one set of shared
+ *        times, and arranges their magnitudes star-minor
+ * @param stars Array of stars
+ * @param members Indexes of the stars within the group
+ * @param no_of_members Number of stars within the group
+ * @param timestamp Returned shared times
+ * @param series Returned magnitudes, star-minor
+ * @param weight Returned presence of each star at each time, star-minor
+ * @returns Number of shared times
+ */
+static int batch_merge(struct batch_star stars[],
+                       int members[], int no_of_members,
+                       float timestamp[], float series[], float weight[])
+{
+    int s, length = 0, remaining;
+    int * next = (int*)calloc(no_of_members, sizeof(int));
+    float t;
+    struct batch_star * star;
+
+    if (next == NULL) return 0;
+    for (;;) {
+        /* the earliest time not yet merged */
+        remaining = 0;
+        t = 0;
+        for (s = 0; s < no_of_members; s++) {
+            star = &stars[members[s]];
+            if (next[s] >= star->length) continue;
+            if ((!remaining) || (star->timestamp[next[s]] < t))
+                t = star->timestamp[next[s]];
+            remaining = 1;
+        }
+        if (!remaining) break;
+
+        /* every star imaged in the same exposure */
+        timestamp[length] = t;
+        for (s = 0; s < no_of_members; s++) {
+            star = &stars[members[s]];
+            series[length*no_of_members + s] = 0;
+            weight[length*no_of_members + s] = 0;
+            if (next[s] >= star->length) continue;
+            if (star->timestamp[next[s]] > t + BATCH_TIME_TOLERANCE)
+                continue;
+            series[length*no_of_members + s] = star->series[next[s]];
+            weight[length*no_of_members + s] = 1;
+            next[s]++;
+        }
+        length++;
+    }
+    free(next);
+    return length;
+}
+
+/**
+ * @brief Searches a slice of the stars within a group. Only the
+ *        exposures in which at least one star of the slice was imaged
+ *        are folded.
+ * @param timestamp Shared times of the group
+ * @param series Magnitudes of the group, star-minor
+ * @param weight Presence of each star of the group, star-minor
+ * @param length Number of shared times
+ * @param no_of_members Number of stars within the group
+ * @param first Index of the first star of the slice within the group
+ * @param width Number of stars within the slice
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param period_days Returned orbital period for each star of the slice
+ * @returns zero on success
+ */
+static int batch_search_slice(float timestamp[], float series[],
+                              float weight[], int length,
+                              int no_of_members, int first, int width,
+                              float min_period_days, float max_period_days,
+                              float increment_days,
+                              struct detect_params * params,
+                              float period_days[])
+{
+    int i, s, present, slice_length = 0, retval;
+    float * slice_timestamp, * slice_series, * slice_weight;
+
+    slice_timestamp = (float*)malloc(length*sizeof(float));
+    slice_series = (float*)malloc((size_t)length*width*sizeof(float));
+    slice_weight = (float*)malloc((size_t)length*width*sizeof(float));
+    if ((slice_timestamp == NULL) || (slice_series == NULL) ||
+        (slice_weight == NULL)) {
+        free(slice_timestamp);
+        free(slice_series);
+        free(slice_weight);
+        memset(period_days, 0, width*sizeof(float));
+        return -1;
+    }
+
+    for (i = 0; i < length; i++) {
+        present = 0;
+        for (s = 0; s < width; s++)
+            if (weight[i*no_of_members + first + s] != 0) present = 1;
+        if (!present) continue;
+
+        slice_timestamp[slice_length] = timestamp[i];
+        for (s = 0; s < width; s++) {
+            slice_series[slice_length*width + s] =
+                series[i*no_of_members + first + s];
+            slice_weight[slice_length*width + s] =
+                weight[i*no_of_members + first + s];
+        }
+        slice_length++;
+    }
+
+    retval = detect_orbital_period_batch(slice_timestamp, slice_series,
+                                         slice_weight, slice_length, width,
+                                         min_period_days, max_period_days,
+                                         increment_days, params,
+                                         period_days);
+    free(slice_timestamp);
+    free(slice_series);
+    free(slice_weight);
+    return retval;
+}
+
+/* log files being read by the ingest layer */
+struct batch_list {
+    int time_field_index;
+    int flux_field_index;
+
+    /* one entry for each log file listed, in the order listed */
+    struct batch_star * stars;
+
+    /* non-zero where the result was found within the manifest */
+    unsigned char * unchanged;
+    float * unchanged_period_days;
+};
+
+/**
+ * @brief Reads the samples from the contents of one log file, which may
+ *        be called from several threads at once
+ * @param file Index of the log file within the list
+ * @param contents Contents of the log file, or NULL if it was not read
+ * @param length Length of the contents in bytes
+ * @param context The list being loaded
+ */
+static void batch_ingest(int file, char * contents, long length,
+                         void * context)
+{
+    struct batch_list * list = (struct batch_list*)context;
+    struct batch_star * star = &list->stars[file];
+    long i;
+    int max_length = 1;
+
+    star->length = -1;
+    if (contents == NULL) return;
+
+    /* stars unchanged since they were last searched */
+    if (manifest_enabled) {
+        star->content_hash = fnv1a_hash64(contents, length, FNV1A64_OFFSET);
+        star->content_length = length;
+        if (manifest_lookup(star->content_hash, star->content_length,
+                            &list->unchanged_period_days[file])) {
+            list->unchanged[file] = 1;
+            return;
+        }
+    }
+
+    /* there are no more samples than lines */
+    for (i = 0; i < length; i++)
+        if (contents[i] == '\n') max_length++;
+    if (max_length > MAX_SERIES_LENGTH) max_length = MAX_SERIES_LENGTH;
+
+    star->timestamp = (float*)malloc(max_length*sizeof(float));
+    star->series = (float*)malloc(max_length*sizeof(float));
+    if ((star->timestamp == NULL) || (star->series == NULL)) {
+        free(star->timestamp);
+        free(star->series);
+        star->timestamp = NULL;
+        star->series = NULL;
+        return;
+    }
+    star->length = logfile_parse(contents, length,
+                                 star->timestamp, star->series, max_length,
+                                 list->time_field_index,
+                                 list->flux_field_index);
+}
+
+/**
+ * @brief Loads the stars within a list of log files, one per line. The
+ *        log files are read with many in flight at once.
+ * @param list_filename File containing the list
+ * @param time_field_index Field containing the time
+ * @param flux_field_index Field containing the magnitude
+ * @param minimum_data_samples Stars with fewer samples are skipped
+ * @param no_of_stars Returned number of stars, or -1 on failure
+ * @param no_of_unchanged Returned number of stars whose results were
+ *        found within the manifest, which are printed and not loaded
+ * @param no_of_triaged Returned number of stars skipped by triage
+ * @returns Array of stars, which may be NULL if there are none
+ */
+static struct batch_star * batch_load(char * list_filename,
+                                      int time_field_index,
+                                      int flux_field_index,
+                                      int minimum_data_samples,
+                                      int * no_of_stars,
+                                      int * no_of_unchanged,
+                                      int * no_of_triaged)
+{
+    FILE * fp;
+    char linestr[MAX_FILENAME_LENGTH];
+    char reason[256], name[MAX_FILENAME_LENGTH];
+    char ** filenames;
+    int * endpoints;
+    int i, len, sections, triaged, no_of_files = 0, max_files = 0;
+    double stage_start, star_start;
+    struct batch_list list;
+    struct batch_star * grown;
+
+    *no_of_stars = -1;
+    *no_of_unchanged = 0;
+    *no_of_triaged = 0;
+    fp = fopen(list_filename, "r");
+    if (!fp) return NULL;
+
+    memset(&list, 0, sizeof(list));
+    list.time_field_index = time_field_index;
+    list.flux_field_index = flux_field_index;
+    while (fgets(linestr, MAX_FILENAME_LENGTH-1, fp) != NULL) {
+        len = strlen(linestr);
+        while ((len > 0) &&
+               ((linestr[len-1] == '\n') || (linestr[len-1] == '\r') ||
+                (linestr[len-1] == ' ')))
+            linestr[--len] = 0;
+        if ((len == 0) || (linestr[0] == '#')) continue;
+
+        if (no_of_files >= max_files) {
+            max_files = (max_files == 0) ? 64 : max_files*2;
+            grown = (struct batch_star*)
+                realloc(list.stars, max_files*sizeof(struct batch_star));
+            if (grown == NULL) break;
+            list.stars = grown;
+        }
+        memset(&list.stars[no_of_files], 0, sizeof(struct batch_star));
+        sprintf(list.stars[no_of_files].filename, "%s", linestr);
+        list.stars[no_of_files].group = -1;
+        no_of_files++;
+    }
+    fclose(fp);
+
+    filenames = (char**)malloc((no_of_files+1)*sizeof(char*));
+    list.unchanged = (unsigned char*)calloc(no_of_files+1, 1);
+    list.unchanged_period_days =
+        (float*)calloc(no_of_files+1, sizeof(float));
+    if ((filenames == NULL) || (list.unchanged == NULL) ||
+        (list.unchanged_period_days == NULL)) {
+        free(filenames);
+        free(list.unchanged);
+        free(list.unchanged_period_days);
+        free(list.stars);
+        return NULL;
+    }
+    for (i = 0; i < no_of_files; i++) filenames[i] = list.stars[i].filename;
+
+    stage_start = trace_begin();
+    profile_start(PROFILE_STAGE_LOAD);
+    ingest_files(filenames, no_of_files, batch_ingest, &list);
+    profile_stop(PROFILE_STAGE_LOAD);
+    trace_end("ingest", "io", stage_start, no_of_files, NULL);
+
+    /* keep the stars which are to be searched, in the order listed.
+       Those which are not searched have their span here. */
+    *no_of_stars = 0;
+    for (i = 0; i < no_of_files; i++) {
+        star_start = trace_begin();
+        scan_name(list.stars[i].filename, name);
+        if (list.unchanged[i]) {
+            if (list.unchanged_period_days[i] == 0)
+                printf("%s No transits detected\n", list.stars[i].filename);
+            else
+                printf("%s orbital_period_days %.6f\n",
+                       list.stars[i].filename,
+                       list.unchanged_period_days[i]);
+            (*no_of_unchanged)++;
+            trace_end("star", "scan", star_start, i, name);
+            continue;
+        }
+        if (list.stars[i].length < minimum_data_samples) {
+            printf("%s Number of data samples too small: %d\n",
+                   list.stars[i].filename, list.stars[i].length);
+            free(list.stars[i].timestamp);
+            free(list.stars[i].series);
+            trace_end("star", "scan", star_start, i, name);
+            continue;
+        }
+        /* stars with no plausible transit are not folded at all */
+        if (triage_mode == TRIAGE_SKIP) {
+            endpoints = (int*)malloc((list.stars[i].length+1)*2*sizeof(int));
+            if (endpoints != NULL) {
+                profile_start(PROFILE_STAGE_TRIAGE);
+                sections = detect_endpoints(list.stars[i].timestamp,
+                                            list.stars[i].length, endpoints);
+                triaged = triage_star(list.stars[i].timestamp,
+                                      list.stars[i].series,
+                                      list.stars[i].length,
+                                      endpoints, sections, reason);
+                profile_stop(PROFILE_STAGE_TRIAGE);
+                trace_end("triage", "scan", star_start, triaged, name);
+                if (triaged) {
+                    printf("%s Triage: %s\n", list.stars[i].filename, reason);
+                    printf("%s No transits detected\n",
+                           list.stars[i].filename);
+                    if (manifest_enabled)
+                        manifest_record(list.stars[i].filename,
+                                        list.stars[i].content_hash,
+                                        list.stars[i].content_length, 0);
+                    free(endpoints);
+                    free(list.stars[i].timestamp);
+                    free(list.stars[i].series);
+                    (*no_of_triaged)++;
+                    trace_end("star", "scan", star_start, i, name);
+                    continue;
+                }
+                free(endpoints);
+            }
+        }
+        list.stars[(*no_of_stars)++] = list.stars[i];
+    }
+
+    free(filenames);
+    free(list.unchanged);
+    free(list.unchanged_period_days);
+    return list.stars;
+}
+
+/**
+ * @brief Searches every star within a list of log files for transits,
+ *        folding stars which share their imaging times together, and
+ *        prints the orbital period found for each
+ * @param list_filename File containing one log filename per line
+ * @param time_field_index Field containing the time
+ * @param flux_field_index Field containing the magnitude
+ * @param minimum_data_samples Stars with fewer samples are skipped
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @returns zero on success
+ */
+int batch_search(char * list_filename,
+                 int time_field_index, int flux_field_index,
+                 int minimum_data_samples,
+                 float min_period_days, float max_period_days,
+                 float increment_days,
+                 struct detect_params * params)
+{
+    int i, j, s, no_of_stars, no_of_groups = 0, no_of_members, length;
+    int first, width, * members, no_of_unchanged, no_of_triaged, retval;
+    float period_days[BATCH_MAX_STARS];
+    char name[MAX_FILENAME_LENGTH];
+    double group_start, stage_start;
+    float * timestamp, * series, * weight;
+    struct batch_star * stars;
+
+    stars = batch_load(list_filename, time_field_index, flux_field_index,
+                       minimum_data_samples, &no_of_stars, &no_of_unchanged,
+                       &no_of_triaged);
+    if (no_of_stars < 0) {
+        printf("Unable to load stars from %s\n", list_filename);
+        return -1;
+    }
+    members = (int*)malloc((no_of_stars+1)*sizeof(int));
+    if (members == NULL) {
+        for (i = 0; i < no_of_stars; i++) {
+            free(stars[i].timestamp);
+            free(stars[i].series);
+        }
+        free(stars);
+        return -2;
+    }
+
+    for (i = 0; i < no_of_stars; i++) {
+        if (stars[i].group != -1) continue;
+
+        /* stars whose times are out of order are searched alone */
+        members[0] = i;
+        no_of_members = 1;
+        stars[i].group = no_of_groups;
+        if (batch_sorted(&stars[i])) {
+            for (j = i+1; j < no_of_stars; j++) {
+                if (stars[j].group != -1) continue;
+                if (!batch_sorted(&stars[j])) continue;
+                if (batch_overlap(&stars[i], &stars[j]) < BATCH_MIN_OVERLAP)
+                    continue;
+                members[no_of_members++] = j;
+                stars[j].group = no_of_groups;
+            }
+        }
+        no_of_groups++;
+        group_start = trace_begin();
+
+        length = 0;
+        for (s = 0; s < no_of_members; s++)
+            length += stars[members[s]].length;
+        timestamp = (float*)malloc(length*sizeof(float));
+        series = (float*)malloc((size_t)length*no_of_members*sizeof(float));
+        weight = (float*)malloc((size_t)length*no_of_members*sizeof(float));
+        if ((timestamp == NULL) || (series == NULL) || (weight == NULL)) {
+            free(timestamp);
+            free(series);
+            free(weight);
+            printf("Unable to allocate memory for a group of stars\n");
+            break;
+        }
+
+        length = batch_merge(stars, members, no_of_members,
+                             timestamp, series, weight);
+
+        /* trends are found once for the whole group, if there are
+           enough stars within it for them to be told apart from the
+           variations of any one star */
+        if ((sysrem_trends > 0) && (no_of_members >= SYSREM_MIN_STARS) &&
+            (sysrem_detrend(series, weight, length, no_of_members,
+                            sysrem_trends) != 0))
+            printf("Trends were not removed from a group of %d stars\n",
+                   no_of_members);
+
+        for (first = 0; first < no_of_members; first += BATCH_MAX_STARS) {
+            width = no_of_members - first;
+            if (width > BATCH_MAX_STARS) width = BATCH_MAX_STARS;
+            stage_start = trace_begin();
+            profile_start(PROFILE_STAGE_SEARCH);
+            perf_reset();
+            retval = batch_search_slice(timestamp, series, weight, length,
+                                        no_of_members, first, width,
+                                        min_period_days, max_period_days,
+                                        increment_days, params, period_days);
+            profile_stop(PROFILE_STAGE_SEARCH);
+            trace_end("period search", "search", stage_start, width, NULL);
+            sprintf(name, "%d stars of group %d", width, no_of_groups);
+            perf_report(stderr, name);
+            if (retval != 0) {
+                /* nothing is recorded, so that these stars are
+                   searched again next time */
+                printf("Unable to search %d stars of a group\n", width);
+                continue;
+            }
+
+            for (s = 0; s < width; s++) {
+                struct batch_star * star = &stars[members[first + s]];
+
+                /* every star of a group is folded at once, so each
+                   spans the whole group up to its result */
+                scan_name(star->filename, name);
+                trace_end("star", "scan", group_start, members[first + s],
+                          name);
+                if (manifest_enabled)
+                    manifest_record(star->filename, star->content_hash,
+                                    star->content_length, period_days[s]);
+                if (period_days[s] == 0)
+                    printf("%s No transits detected\n", star->filename);
+                else
+                    printf("%s orbital_period_days %.6f\n",
+                           star->filename, period_days[s]);
+            }
+        }
+        free(timestamp);
+        free(series);
+        free(weight);
+    }
+
+    if (manifest_enabled)
+        printf("%d stars searched in %d groups, %d unchanged\n",
+               no_of_stars, no_of_groups, no_of_unchanged);
+    else
+        printf("%d stars searched in %d groups\n",
+               no_of_stars, no_of_groups);
+    if (triage_mode != TRIAGE_OFF)
+        printf("%d stars skipped by triage\n", no_of_triaged);
+    for (i = 0; i < no_of_stars; i++) {
+        free(stars[i].timestamp);
+        free(stars[i].series);
+    }
+    free(stars);
+    free(members);
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The response at the best period depends upon the number of samples,
+   the noise and the grid searched, so it cannot be compared between
+   stars. The false alarm probability is the chance that a star with
+   no transit would give a response at least as large, found by
+   searching the same grid again with the magnitudes rearranged so
+   that any periodic dip is destroyed, and counting how often the best
+   response of those searches reaches that of the star.
+
+   Each search costs as much as the original, so searching stops once
+   the probability is clearly above or below the level of interest.
+   Stars with no transit usually stop after a few searches. */
+
+#include "waspscan.h"
+
+/* a gap in seconds longer than this begins another night */
+#define BOOTSTRAP_NIGHT_GAP         (60*60*4)
+
+/* searches made before stopping early */
+#define BOOTSTRAP_MIN_ITERATIONS    10
+
+/* standard errors by which the probability must be clear of the
+   level of interest to stop early */
+#define BOOTSTRAP_STOP_SIGMA        2.0
+
+/* maximum number of searches with rearranged magnitudes,
+   or zero for none */
+int bootstrap_iterations = 0;
+
+/* false alarm probability below which a detection is significant */
+float bootstrap_alpha = 0.01f;
+
+/* how the magnitudes are rearranged */
+int bootstrap_null = BOOTSTRAP_PERMUTE;
+
+/* seed for the rearrangements, so that results can be repeated */
+unsigned int bootstrap_seed = 1;
+
+/**
+ * @brief Returns a pseudo-random integer below the given limit
+ * @param state The generator state, which must not be zero
+ * @param limit Upper limit
+ * @returns Random integer from zero to limit-1
+ */
+static int bootstrap_random(unsigned long long * state, int limit)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (int)(((*state * 2685821657736338717ULL) >> 33) %
+                 (unsigned long long)limit);
+}
+
+/**
+ * @brief Rearranges the magnitudes of a series. With BOOTSTRAP_PERMUTE
+ *        the magnitudes are shuffled between all samples. With
+ *        BOOTSTRAP_NIGHTS the magnitudes within each night are rotated
+ *        by a different random number of samples, so that noise which
+ *        is correlated over a night, and any dip, is kept but moved to
+ *        a random phase.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param state The generator state
+ * @param result Returned magnitudes
+ */
+static void bootstrap_rearrange(float timestamp[], float series[],
+                                int series_length,
+                                unsigned long long * state, float result[])
+{
+    int i, j, start_index, length, offset;
+    float temp;
+
+    if (bootstrap_null == BOOTSTRAP_PERMUTE) {
+        /* shuffling the previous arrangement is as random as
+           shuffling the original */
+        for (i = series_length-1; i > 0; i--) {
+            j = bootstrap_random(state, i+1);
+            temp = result[i];
+            result[i] = result[j];
+            result[j] = temp;
+        }
+        return;
+    }
+
+    for (start_index = 0; start_index < series_length;
+         start_index += length) {
+        for (i = start_index+1; i < series_length; i++)
+            if (timestamp[i] - timestamp[i-1] > BOOTSTRAP_NIGHT_GAP) break;
+        length = i - start_index;
+        offset = bootstrap_random(state, length);
+        for (j = 0; j < length; j++)
+            result[start_index + ((j + offset) % length)] =
+                series[start_index + j];
+    }
+}
+
+/**
+ * @brief Finds the false alarm probability of a detection by searching
+ *        the same grid with the magnitudes rearranged. Each search is
+ *        spread over threads in the same way as the original. The
+ *        probability is (exceeded + 1) / (iterations + 1), and searching
+ *        stops once it lies more than BOOTSTRAP_STOP_SIGMA standard
+ *        errors either side of bootstrap_alpha, or after
+ *        bootstrap_iterations searches.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param response Response at the detected period
+ * @param result Returned false alarm probability
+ * @returns zero on success
+ */
+int bootstrap_fap(float timestamp[], float series[], int series_length,
+                  float min_period_days, float max_period_days,
+                  float increment_days,
+                  struct detect_params * params, float response,
+                  struct bootstrap_result * result)
+{
+    struct detect_context context;
+    unsigned long long state;
+    float * rearranged, null_response;
+    double probability, error;
+    int profiling = profile_enabled;
+
+    memset(result, 0, sizeof(struct bootstrap_result));
+    result->probability = 1;
+    result->verdict = BOOTSTRAP_UNDECIDED;
+    if (response <= 0) return -1;
+
+    rearranged = (float*)malloc(series_length*sizeof(float));
+    if (rearranged == NULL) return -2;
+    memcpy(rearranged, series, series_length*sizeof(float));
+
+    if (detect_context_create(timestamp, series_length,
+                              min_period_days, max_period_days,
+                              increment_days, &context) != 0) {
+        free(rearranged);
+        return -3;
+    }
+
+    /* the rejected trial periods of these searches are not those of
+       the star */
+    if (profiling) profile_enabled = 0;
+
+    state = ((unsigned long long)bootstrap_seed << 32) ^
+        0x9e3779b97f4a7c15ULL;
+    while (result->iterations < bootstrap_iterations) {
+        bootstrap_rearrange(timestamp, series, series_length,
+                            &state, rearranged);
+        detect_orbital_period_context(&context, rearranged, params,
+                                      NULL, &null_response, NULL);
+        result->iterations++;
+        if (null_response >= response) result->exceeded++;
+
+        probability =
+            (result->exceeded + 1) / (double)(result->iterations + 1);
+        result->probability = (float)probability;
+        if (result->iterations < BOOTSTRAP_MIN_ITERATIONS) continue;
+
+        error = BOOTSTRAP_STOP_SIGMA *
+            sqrt(probability * (1 - probability) /
+                 (result->iterations + 1));
+        if (probability + error < bootstrap_alpha) {
+            result->verdict = BOOTSTRAP_SIGNIFICANT;
+            break;
+        }
+        if (probability - error > bootstrap_alpha) {
+            result->verdict = BOOTSTRAP_NOT_SIGNIFICANT;
+            break;
+        }
+    }
+
+    if (profiling) profile_enabled = 1;
+    detect_context_free(&context);
+    free(rearranged);
+    return 0;
+}
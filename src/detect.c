@@ -16,17 +16,122 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <omp.h>
 #include "waspscan.h"
 
-/* length of the light curve used for transit detection */
-#define DETECT_CURVE_LENGTH 128
-
 /* maximum percentage of the light curve which may be missing */
 #define MISSING_THRESHOLD   0
 
+/* number of trial periods handed to a thread at a time */
+#define DETECT_CHUNK_STEPS  1024
+
+/* number of evenly spread trial periods scored by the first pass of a
+   search with a time budget */
+#define DETECT_ANYTIME_FIRST_PASS 256
+
+/* best candidates around which a search with a time budget looks more
+   closely after each pass */
+#define DETECT_ANYTIME_CANDIDATES 4
+
+/* trial periods either side of a candidate which are scored after each
+   pass, and within which trial periods belong to the same peak */
+#define DETECT_ANYTIME_WINDOW     32
+
 /* number of seconds in a day */
 #define DAY_SECONDS (1.0f / (60.0f*60.0f*24.0f))
 
+/* gaps between samples longer than this number of buckets of the
+   shortest trial period split the spans used to find phase coverage */
+#define COVERAGE_GAP_BUCKETS 4
+
+/* fraction of a bucket of the shortest trial period over which
+   consecutive samples are merged before searching, or zero to search
+   every sample */
+float detect_bin_fraction = 0;
+
+/* fraction of the frequencies within the search range whose trial
+   periods are folded, or zero to fold every trial period */
+float detect_prescreen_fraction = 0;
+
+/* non-zero if samples are folded from 16 bit magnitudes and 32 bit
+   times rather than from floats */
+int detect_compact = 0;
+
+/* number of buckets within the light curve of each trial period, which
+   is a power of two. Short transits cover more buckets of a longer
+   curve. */
+int detect_curve_length = DETECT_CURVE_LENGTH;
+
+/* samples of one star quantised so that less memory is read for each
+   sample when folding. Magnitudes are held as offsets from the average
+   in steps of flux_scale, and times as whole seconds after the first
+   sample. */
+struct compact_series {
+    int * time_offset;
+    short * flux;
+    int length;
+
+    /* time of the first sample in days */
+    double first_days;
+
+    float flux_offset;
+    float flux_scale;
+};
+
+/* series searched for a period, which may have merged samples */
+struct binned_series {
+    float * timestamp;
+    float * series;
+
+    /* number of samples merged into each, or NULL if none were merged */
+    float * weight;
+
+    int length;
+
+    /* samples before merging, which are counted individually when
+       checking the vacancy of the dip */
+    float * original_timestamp;
+    float * original_series;
+    int original_length;
+
+    /* magnitudes and weights of only the samples within the range
+       used when resampling */
+    float * clipped_series;
+    float * clipped_weight;
+
+    /* average magnitude and rms variance of the samples before they
+       were merged, since merging reduces the variance */
+    float av;
+    float variance;
+
+    /* sums within each bucket from which the light curve of every
+       trial period is made rather than folding, or NULL */
+    struct accumulator_store * accumulators;
+
+    /* the samples before merging in compact form, or NULL */
+    struct compact_series * compact;
+
+    /* phase dispersion to be found while folding, or NULL */
+    struct detect_dispersion * dispersion;
+
+    /* non-zero if only the phase dispersion is wanted, so that the
+       light curve need not be resampled */
+    int dispersion_only;
+};
+
+/* number, sum and sum of squares of the samples within each bucket,
+   found in the same pass as the light curve, from which the phase
+   dispersion is found */
+struct fold_moments {
+    /* magnitudes are taken relative to this, so that the sums of
+       squares keep their precision */
+    float offset;
+
+    int count[DETECT_MAX_CURVE_LENGTH];
+    double sum[DETECT_MAX_CURVE_LENGTH];
+    double sum_squared[DETECT_MAX_CURVE_LENGTH];
+};
+
 /**
  * @brief Detects the starting and ending indexes of active
  *        data sections within a time series
@@ -67,43 +172,207 @@ int detect_endpoints(float timestamp[], int series_length,
 }
 
 
+/**
+ * @brief Finds the spans of time within which samples were taken, from
+ *        the data sections. detect_endpoints leaves out the first sample
+ *        after each gap and the final section, so here the spans run
+ *        from one gap to the next in order to include every sample.
+ *        Sections are usually whole seasons, so they are also split at
+ *        any gap longer than a few buckets of the shortest trial period,
+ *        such as between nights. Treating each span as continuous can
+ *        only overestimate the phases which contain samples, so a trial
+ *        period is never wrongly rejected, and with gaps this short
+ *        almost every period which would have missing data is found.
+ * @param timestamp A series of timestamps
+ * @param series_length The number of entries in the time series
+ * @param min_period_days The minimum orbital period in days
+ * @param curve_length The number of buckets within the curve
+ * @param coverage Returned spans of time
+ * @returns zero on success
+ */
+static int phase_coverage_init(float timestamp[], int series_length,
+                               float min_period_days, int curve_length,
+                               struct phase_coverage * coverage)
+{
+    int * endpoints;
+    int i, j, sections, spans, start_index = 0;
+    float max_gap =
+        min_period_days * 60*60*24 * COVERAGE_GAP_BUCKETS / curve_length;
+
+    coverage->intervals = 0;
+    coverage->start_days = NULL;
+    coverage->end_days = NULL;
+    if (series_length < 1) return -1;
+
+    endpoints = (int*)malloc((series_length+1)*2*sizeof(int));
+    if (endpoints == NULL) return -2;
+
+    sections = 0;
+    if (series_length > 2)
+        sections = detect_endpoints(timestamp, series_length, endpoints);
+
+    /* number of spans after splitting at smaller gaps */
+    spans = 1;
+    for (i = 1; i < series_length; i++)
+        if (timestamp[i] - timestamp[i-1] > max_gap) spans++;
+    spans += sections;
+
+    coverage->start_days = (float*)malloc(spans*sizeof(float));
+    coverage->end_days = (float*)malloc(spans*sizeof(float));
+    if ((coverage->start_days == NULL) || (coverage->end_days == NULL)) {
+        free(coverage->start_days);
+        free(coverage->end_days);
+        coverage->start_days = NULL;
+        coverage->end_days = NULL;
+        free(endpoints);
+        return -3;
+    }
+
+    for (i = 0; i <= sections; i++) {
+        int end_index = series_length-1;
+        if (i < sections) end_index = endpoints[i*2+1];
+
+        coverage->start_days[coverage->intervals] =
+            timestamp[start_index] * DAY_SECONDS;
+        for (j = start_index+1; j <= end_index; j++) {
+            if (timestamp[j] - timestamp[j-1] <= max_gap) continue;
+            coverage->end_days[coverage->intervals++] =
+                timestamp[j-1] * DAY_SECONDS;
+            coverage->start_days[coverage->intervals] =
+                timestamp[j] * DAY_SECONDS;
+        }
+        coverage->end_days[coverage->intervals++] =
+            timestamp[end_index] * DAY_SECONDS;
+        start_index = end_index + 1;
+    }
+    free(endpoints);
+    return 0;
+}
+
+/**
+ * @brief Frees memory for the spans of time
+ * @param coverage Spans of time
+ */
+static void phase_coverage_free(struct phase_coverage * coverage)
+{
+    free(coverage->start_days);
+    free(coverage->end_days);
+    coverage->intervals = 0;
+}
+
+/**
+ * @brief Returns whether enough buckets of the light curve for a trial
+ *        period could contain samples for it not to be rejected. The
+ *        buckets covered by each span of time are found from the phases
+ *        at either end, and widened by one bucket either side since each
+ *        sample is also added to its neighbours. This takes time
+ *        proportional to the number of spans rather than the number of
+ *        samples, and if too many buckets are left uncovered then the
+ *        light curve would be rejected as having missing data.
+ * @param coverage Spans of time from phase_coverage_init
+ * @param period_days The trial orbital period
+ * @param curve_length The number of buckets within the curve
+ * @returns Zero if the light curve would be rejected for missing data
+ */
+static int phase_coverage_complete(struct phase_coverage * coverage,
+                                   float period_days, int curve_length)
+{
+    int i, lo, hi, covered = 0, missing = 0;
+    int diff[DETECT_MAX_CURVE_LENGTH+1];
+    float mult = (float)curve_length / period_days;
+
+    /* without spans nothing can be ruled out */
+    if (coverage->intervals == 0) return 1;
+
+    memset(diff, 0, (curve_length+1)*sizeof(int));
+    for (i = 0; i < coverage->intervals; i++) {
+        if (coverage->end_days[i] - coverage->start_days[i] >= period_days)
+            return 1;
+
+        /* the same bucket calculation as light_curve_base */
+        lo = (int)(fmod(coverage->start_days[i],period_days) * mult) - 1;
+        hi = (int)(fmod(coverage->end_days[i],period_days) * mult) + 1;
+        if (hi < lo) hi += curve_length;
+        if (hi - lo + 1 >= curve_length) return 1;
+        if (lo < 0) {
+            lo += curve_length;
+            hi += curve_length;
+        }
+
+        diff[lo]++;
+        if (hi < curve_length) {
+            diff[hi+1]--;
+        }
+        else {
+            /* wraps around to the start of the curve */
+            diff[curve_length]--;
+            diff[0]++;
+            diff[hi-curve_length+1]--;
+        }
+    }
+
+    for (i = 0; i < curve_length; i++) {
+        covered += diff[i];
+        if (covered <= 0) missing++;
+    }
+
+    /* the same threshold as light_curve */
+    return (missing*100/curve_length <= MISSING_THRESHOLD);
+}
+
 /**
  * @brief Returns an array containing a light curve for the given orbital period_days
  * @param timestamp Array of imaging times
  * @param series Time series array containing magnitudes
+ * @param weight Number of samples merged into each, or NULL
  * @param series_length The length of the data series
  * @param period_days The expected orbital period
  * @param curve Returned light curve Array
  * @param density Density of samples
  * @param curve_length The number of buckets within the curve
+ * @param moments Returned sums within each bucket, or NULL
  */
 static void light_curve_base(float timestamp[],
-                             float series[], int series_length,
+                             float series[], float weight[],
+                             int series_length,
                              float period_days,
-                             float curve[], float density[], int curve_length)
+                             float curve[], float density[], int curve_length,
+                             struct fold_moments * moments)
 {
     int i, index, prev_index, next_index;
-    float days, max_samples=0;
+    float days, w = 1, max_samples=0, x;
     float mult = (float)curve_length / period_days;
 
     memset(curve,0,curve_length*sizeof(float));
     memset(density,0,curve_length*sizeof(float));
+    if (moments != NULL) {
+        memset(moments->count,0,curve_length*sizeof(int));
+        memset(moments->sum,0,curve_length*sizeof(double));
+        memset(moments->sum_squared,0,curve_length*sizeof(double));
+    }
 
     for (i = series_length-1; i >= 0; i--) {
+        if (weight != NULL) w = weight[i];
         days = timestamp[i] * DAY_SECONDS;
         index = (int)(fmod(days,period_days) * mult);
-        curve[index] += series[i]*2;
-        density[index] += 2;
+        if (moments != NULL) {
+            x = series[i] - moments->offset;
+            moments->count[index] += (int)w;
+            moments->sum[index] += x*w;
+            moments->sum_squared[index] += x*x*w;
+        }
+        curve[index] += series[i]*w*2;
+        density[index] += w*2;
 
         prev_index = index - 1;
         if (prev_index < 0) prev_index += curve_length;
-        curve[prev_index] += series[i];
-        density[prev_index]++;
+        curve[prev_index] += series[i]*w;
+        density[prev_index] += w;
 
         next_index = index + 1;
         if (next_index >= curve_length) next_index -= curve_length;
-        curve[next_index] += series[i];
-        density[next_index]++;
+        curve[next_index] += series[i]*w;
+        density[next_index] += w;
     }
 
     for (i = curve_length-1; i >= 0; i--) {
@@ -116,34 +385,82 @@ static void light_curve_base(float timestamp[],
 }
 
 /**
- * @brief Returns a value indicating the density of samples within
- *        the region of the dip expected to be vacant
- * @param start_index Starting index for the dip within the light curve
- * @param end_index Ending index for the dip within the light curve
+ * @brief Returns the phase dispersion statistic of Stellingwerf (1978),
+ *        which is the variance within phase bins relative to the
+ *        variance of the whole series, averaged over several numbers of
+ *        bins. Each number of bins is made by merging adjacent buckets.
+ * @param count Number of samples within each bucket
+ * @param sum Sum of the samples within each bucket
+ * @param sum_squared Sum of squares within each bucket
+ * @param curve_length The number of buckets
+ * @param total_variance Sum of squared deviations of every sample
+ * @param bin_counts Numbers of bins, each dividing curve_length
+ * @param no_of_bin_counts Number of entries within bin_counts
+ * @returns Theta, which is small when the samples at each phase agree
+ */
+static float pdm_theta(int count[], double sum[], double sum_squared[],
+                       int curve_length, double total_variance,
+                       int bin_counts[], int no_of_bin_counts)
+{
+    int b, i, j, width, n, samples, bins;
+    double s, ss, within, theta = 0;
+
+    for (b = 0; b < no_of_bin_counts; b++) {
+        width = curve_length / bin_counts[b];
+        within = 0;
+        samples = 0;
+        bins = 0;
+        for (i = 0; i < curve_length; i += width) {
+            n = 0;
+            s = 0;
+            ss = 0;
+            for (j = i; j < i + width; j++) {
+                n += count[j];
+                s += sum[j];
+                ss += sum_squared[j];
+            }
+            if (n < 2) continue;
+            within += ss - (s*s/n);
+            samples += n;
+            bins++;
+        }
+        if (samples <= bins) return 1;
+        theta += (within / (samples - bins)) / total_variance;
+    }
+    return (float)(theta / no_of_bin_counts);
+}
+
+/**
+ * @brief Counts the samples within each bucket of the light curve, and
+ *        how many of those are above the lower bound of the curve, so
+ *        that the density within any vacant region can then be looked up
+ * @param timestamp Array of imaging times
  * @param series Array containing magnitudes
  * @param series_length The length of the data series
  * @param period_days The expected orbital period
  * @param curve Existing light curve Array
  * @param curve_length The number of buckets within the curve
- * @returns Density of samples within expected vacant area in the range 0.0-1.0
+ * @param vacancy Returned sample counts, within the above and
+ *        max_samples fields of the fold
  */
-static float dip_vacancy(int start_index, int end_index,
-                         float timestamp[],
-                         float series[], int series_length,
-                         float period_days,
-                         float curve[],
-                         int curve_length)
+static void dip_vacancy_table(float timestamp[],
+                              float series[], int series_length,
+                              float period_days,
+                              float curve[],
+                              int curve_length,
+                              struct fold_record * vacancy)
 {
     int i, index;
-    float days, max_samples = 0;
-    float density = 0, curve_average_mag = 0;
+    float days;
+    float curve_average_mag = 0;
     float curve_variance = 0, min_curve_mag;
-    float den[DETECT_CURVE_LENGTH];
+    float den[DETECT_MAX_CURVE_LENGTH];
     float mult = (float)curve_length / period_days;
 
     /* get the average magnitude */
     for (i = curve_length-1; i >= 0; i--) curve_average_mag += curve[i];
     memset(den,0,curve_length*sizeof(float));
+    memset(vacancy->above,0,curve_length*sizeof(float));
     curve_average_mag /= (float)curve_length;
 
     /* get the variance */
@@ -154,23 +471,41 @@ static float dip_vacancy(int start_index, int end_index,
     curve_variance = (float)sqrt(curve_variance / (float)curve_length);
     min_curve_mag = curve_average_mag - (curve_variance*2.0f);
 
-    /* find the number of points within the dip region which are
-       within the expected vacancy area */
+    /* count the points within each bucket, and those which are
+       above the minimum magnitude */
     for (i = series_length-1; i >= 0; i--) {
         days = timestamp[i] * DAY_SECONDS;
         index = (int)(fmod(days,period_days) * mult);
         den[index]++;
-        if ((index >= start_index) && (index < end_index)) {
-            if (series[i] > min_curve_mag) density++;
-        }
+        if (series[i] > min_curve_mag) vacancy->above[index]++;
     }
 
     /* get the maximum density samples */
+    vacancy->max_samples = 0;
     for (i = curve_length-1; i >= 0; i--)
-        if (den[i] > max_samples) max_samples = den[i];
+        if (den[i] > vacancy->max_samples) vacancy->max_samples = den[i];
+}
 
-    if (max_samples > 0)
-        return density / (max_samples * ((end_index - start_index)+1));
+/**
+ * @brief Returns a value indicating the density of samples within
+ *        the region of the dip expected to be vacant
+ * @param start_index Starting index for the dip within the light curve
+ * @param end_index Ending index for the dip within the light curve
+ * @param vacancy Sample counts from dip_vacancy_table
+ * @returns Density of samples within expected vacant area in the range 0.0-1.0
+ */
+static float dip_vacancy(int start_index, int end_index,
+                         struct fold_record * vacancy)
+{
+    int i;
+    float density = 0;
+
+    for (i = start_index; i < end_index; i++)
+        density += vacancy->above[i];
+
+    if (vacancy->max_samples > 0)
+        return density / (vacancy->max_samples *
+                          ((end_index - start_index)+1));
     return 1.0;
 }
 
@@ -182,6 +517,7 @@ static float dip_vacancy(int start_index, int end_index,
  * @param max_value Maximum value
  * @param timestamp Array of imaging times
  * @param series Array containing magnitudes
+ * @param weight Number of samples merged into each, or NULL
  * @param series_length The length of the data series
  * @param period_days The expected orbital period
  * @param curve Returned light curve Array
@@ -190,34 +526,36 @@ static float dip_vacancy(int start_index, int end_index,
  */
 static void light_curve_resample(float min_value, float max_value,
                                  float timestamp[],
-                                 float series[], int series_length,
+                                 float series[], float weight[],
+                                 int series_length,
                                  float period_days,
                                  float curve[], int curve_length)
 {
     int i, index, prev_index, next_index;
-    float days;
-    int hits[512];
+    float days, w = 1;
+    float hits[DETECT_MAX_CURVE_LENGTH];
     float mult = (float)curve_length / period_days;
 
     memset(curve,0,curve_length*sizeof(float));
-    memset(hits,0,curve_length*sizeof(int));
+    memset(hits,0,curve_length*sizeof(float));
 
     for (i = series_length-1; i >= 0; i--) {
         if ((series[i] < min_value) || (series[i] > max_value)) continue;
+        if (weight != NULL) w = weight[i];
         days = timestamp[i] * DAY_SECONDS;
         index = (int)(fmod(days,period_days) * mult);
-        curve[index] += series[i]*2;
-        hits[index] += 2;
+        curve[index] += series[i]*w*2;
+        hits[index] += w*2;
 
         prev_index = index - 1;
         if (prev_index < 0) prev_index += curve_length;
-        curve[prev_index] += series[i];
-        hits[prev_index]++;
+        curve[prev_index] += series[i]*w;
+        hits[prev_index] += w;
 
         next_index = index + 1;
         if (next_index >= curve_length) next_index -= curve_length;
-        curve[next_index] += series[i];
-        hits[next_index]++;
+        curve[next_index] += series[i]*w;
+        hits[next_index] += w;
     }
 
     for (i = curve_length-1; i >= 0; i--)
@@ -283,358 +621,2532 @@ int missing_data(float density[], int curve_length)
 }
 
 /**
- * @brief Returns an array containing a light curve for the given
- *        orbital period_days
- * @param timestamp Array of imaging times
+ * @brief Quantises a series so that it may be folded with less memory
+ *        traffic. Magnitudes are spread over the full range of 16 bits
+ *        about their average, and times are rounded to the second.
+ * @param timestamp Array of imaging times, in seconds
  * @param series Array containing magnitudes
  * @param series_length The length of the data series
+ * @param av Average magnitude
+ * @returns The compact series, or NULL if there was not enough memory
+ */
+static struct compact_series * compact_series_create(float timestamp[],
+                                                     float series[],
+                                                     int series_length,
+                                                     float av)
+{
+    struct compact_series * compact;
+    float max_deviation = 0;
+    int i;
+
+    compact = (struct compact_series*)malloc(sizeof(struct compact_series));
+    if (compact == NULL) return NULL;
+    compact->time_offset = (int*)malloc(series_length*sizeof(int));
+    compact->flux = (short*)malloc(series_length*sizeof(short));
+    if ((compact->time_offset == NULL) || (compact->flux == NULL)) {
+        free(compact->time_offset);
+        free(compact->flux);
+        free(compact);
+        return NULL;
+    }
+
+    for (i = series_length-1; i >= 0; i--)
+        if (fabs(series[i] - av) > max_deviation)
+            max_deviation = (float)fabs(series[i] - av);
+
+    compact->length = series_length;
+    compact->first_days = (series_length > 0) ? timestamp[0] * DAY_SECONDS : 0;
+    compact->flux_offset = av;
+    compact->flux_scale = (max_deviation > 0) ? max_deviation / 32767.0f : 1;
+    for (i = series_length-1; i >= 0; i--) {
+        compact->time_offset[i] =
+            (int)lrint((double)timestamp[i] - (double)timestamp[0]);
+        compact->flux[i] =
+            (short)lrintf((series[i] - av) / compact->flux_scale);
+    }
+    return compact;
+}
+
+/**
+ * @brief Frees a compact series
+ * @param compact The compact series
+ */
+static void compact_series_free(struct compact_series * compact)
+{
+    if (compact == NULL) return;
+    free(compact->time_offset);
+    free(compact->flux);
+    free(compact);
+}
+
+/**
+ * @brief Returns the bucket of a sample of a compact series. Its phase
+ *        is found from that of the first sample, so that only the small
+ *        time since then is added for each sample.
+ * @param compact The compact series
+ * @param i Index of the sample
+ * @param first_phase Phase of the first sample in days
+ * @param period_days The expected orbital period
+ * @param mult Number of buckets per day
+ * @returns The bucket
+ */
+static inline int compact_index(struct compact_series * compact, int i,
+                                double first_phase, float period_days,
+                                float mult)
+{
+    return (int)(fmod(first_phase +
+                      compact->time_offset[i] * (double)DAY_SECONDS,
+                      period_days) * mult);
+}
+
+/**
+ * @brief Returns the same light curve as light_curve_weighted for a
+ *        series without merged samples, but folded from its compact
+ *        form. The curve is summed from the quantised magnitudes, and
+ *        turned back into magnitudes once each bucket is complete.
+ * @param compact The compact series
+ * @param min_value Minimum magnitude used when resampling
+ * @param max_value Maximum magnitude used when resampling
  * @param period_days The expected orbital period
  * @param curve Returned light curve Array
  * @param density Density of samples
  * @param curve_length The number of buckets within the curve
+ * @param moments Returned sums within each bucket, or NULL
  * @return zero on success
  */
-int light_curve(float timestamp[],
-                float series[], int series_length,
-                float period_days,
-                float curve[], float density[], int curve_length)
+static int light_curve_compact(struct compact_series * compact,
+                               float min_value, float max_value,
+                               float period_days,
+                               float curve[], float density[],
+                               int curve_length,
+                               struct fold_moments * moments)
 {
-    float av, variance;
+    int i, index, prev_index, next_index;
+    float max_samples = 0, q, x;
+    float hits[DETECT_MAX_CURVE_LENGTH];
+    float mult = (float)curve_length / period_days;
+    double first_phase = fmod(compact->first_days, period_days);
+    float min_q = (min_value - compact->flux_offset) / compact->flux_scale;
+    float max_q = (max_value - compact->flux_offset) / compact->flux_scale;
 
-    /* bucket the samples into a light curve with a discreet length */
-    light_curve_base(timestamp, series, series_length,
-                     period_days, curve, density, curve_length);
+    memset(curve,0,curve_length*sizeof(float));
+    memset(density,0,curve_length*sizeof(float));
+    memset(hits,0,curve_length*sizeof(float));
+    if (moments != NULL) {
+        memset(moments->count,0,curve_length*sizeof(int));
+        memset(moments->sum,0,curve_length*sizeof(double));
+        memset(moments->sum_squared,0,curve_length*sizeof(double));
+    }
+
+    /* the density of every sample and the sums of those within range
+       are found in a single pass */
+    for (i = compact->length-1; i >= 0; i--) {
+        index = compact_index(compact, i, first_phase, period_days, mult);
+        prev_index = index - 1;
+        if (prev_index < 0) prev_index += curve_length;
+        next_index = index + 1;
+        if (next_index >= curve_length) next_index -= curve_length;
+
+        density[index] += 2;
+        density[prev_index]++;
+        density[next_index]++;
+
+        q = compact->flux[i];
+        if (moments != NULL) {
+            x = compact->flux_offset + q*compact->flux_scale -
+                moments->offset;
+            moments->count[index]++;
+            moments->sum[index] += x;
+            moments->sum_squared[index] += x*x;
+        }
+        if ((q < min_q) || (q > max_q)) continue;
+        curve[index] += q*2;
+        hits[index] += 2;
+        curve[prev_index] += q;
+        hits[prev_index]++;
+        curve[next_index] += q;
+        hits[next_index]++;
+    }
+    perf_mark(PERF_SECTION_FOLD);
+
+    for (i = curve_length-1; i >= 0; i--)
+        if (density[i] > max_samples) max_samples = density[i];
+    for (i = curve_length-1; i >= 0; i--) density[i] /= max_samples;
 
     if (missing_data(density, curve_length)*100/curve_length >
         MISSING_THRESHOLD)
         return -1;
 
-    /* get the average magnitude */
-    av = detect_av(series, series_length);
-
-    /* rms variance from the average magnitude */
-    variance = detect_variance(series, series_length, av);
+    for (i = curve_length-1; i >= 0; i--) {
+        if (hits[i] == 0) continue;
+        curve[i] = compact->flux_offset +
+            (curve[i] / hits[i])*compact->flux_scale;
+    }
 
-    light_curve_resample(av - variance, av + variance,
-                         timestamp, series, series_length,
-                         period_days, curve, curve_length);
+    /* fill any holes */
+    curve[0] = curve[curve_length-1];
+    for (i = 1; i < curve_length; i++) {
+        if (curve[i] != 0) continue;
+        curve[i] = curve[i-1];
+    }
+    perf_mark(PERF_SECTION_RESAMPLE);
     return 0;
 }
 
 /**
- * @brief Detects the array index of the centre of the transit
- * @param curve Array containing light curve magnitudes
- * @param curve_length Length of the array
- * @returns Array index of the centre of the transit
+ * @brief As dip_vacancy_table, but counting the samples of a compact
+ *        series
+ * @param compact The compact series
+ * @param period_days The expected orbital period
+ * @param curve Existing light curve Array
+ * @param curve_length The number of buckets within the curve
+ * @param vacancy Returned sample counts, within the above and
+ *        max_samples fields of the fold
  */
-int detect_phase_offset(float curve[], int curve_length)
+static void dip_vacancy_table_compact(struct compact_series * compact,
+                                      float period_days,
+                                      float curve[], int curve_length,
+                                      struct fold_record * vacancy)
 {
-    int i, j, l, offset = 0;
-    float minimum = 0, v;
-    int search_radius = (int)(curve_length*5/100);
+    int i, index;
+    float curve_average_mag = 0;
+    float curve_variance = 0, min_curve_q;
+    float den[DETECT_MAX_CURVE_LENGTH];
+    float mult = (float)curve_length / period_days;
+    double first_phase = fmod(compact->first_days, period_days);
 
-    for (i = 0; i < curve_length; i++) {
-        v = 0;
-        for (j = i-search_radius; j <= i+search_radius; j++) {
-            l = j;
-            if (l < 0) l += curve_length;
-            if (l >= curve_length) l -= curve_length;
-            v += curve[l];
-        }
-        if ((v < minimum) || (minimum == 0)) {
-            minimum = v;
-            offset = i;
-        }
+    for (i = curve_length-1; i >= 0; i--) curve_average_mag += curve[i];
+    memset(den,0,curve_length*sizeof(float));
+    memset(vacancy->above,0,curve_length*sizeof(float));
+    curve_average_mag /= (float)curve_length;
+
+    for (i = curve_length-1; i >= 0; i--)
+        curve_variance +=
+            (curve[i] - curve_average_mag)*(curve[i] - curve_average_mag);
+    curve_variance = (float)sqrt(curve_variance / (float)curve_length);
+    min_curve_q = (curve_average_mag - (curve_variance*2.0f) -
+                   compact->flux_offset) / compact->flux_scale;
+
+    for (i = compact->length-1; i >= 0; i--) {
+        index = compact_index(compact, i, first_phase, period_days, mult);
+        den[index]++;
+        if (compact->flux[i] > min_curve_q) vacancy->above[index]++;
     }
-    return offset;
+
+    vacancy->max_samples = 0;
+    for (i = curve_length-1; i >= 0; i--)
+        if (den[i] > vacancy->max_samples) vacancy->max_samples = den[i];
 }
 
 /**
- * @brief Adjust the light curve so that the transit is at the centre
- * @param curve Array containing light curve magnitudes
- * @param curve_length Length of the array
- * @param offset Array index of the centre of the transit
+ * @brief Returns an array containing a light curve for the given
+ *        orbital period_days from samples which may have been merged
+ * @param binned Series to be folded
+ * @param period_days The expected orbital period
+ * @param curve Returned light curve Array
+ * @param density Density of samples
+ * @param curve_length The number of buckets within the curve
+ * @param moments Returned sums within each bucket, or NULL
+ * @return zero on success
  */
-void adjust_curve(float curve[], int curve_length, int offset)
+static int light_curve_weighted(struct binned_series * binned,
+                                float period_days,
+                                float curve[], float density[],
+                                int curve_length,
+                                struct fold_moments * moments)
 {
-    int i, index;
-    int adjust = (int)(curve_length/2) - offset;
-    float new_curve[512];
+    if ((binned->compact != NULL) && (binned->weight == NULL))
+        return light_curve_compact(binned->compact,
+                                   binned->av - binned->variance,
+                                   binned->av + binned->variance,
+                                   period_days, curve, density,
+                                   curve_length, moments);
 
-    for (i = 0; i < curve_length; i++) {
-        index = i + adjust;
-        if (index < 0) index += curve_length;
-        if (index >= curve_length) index -= curve_length;
-        new_curve[index] = curve[i];
-    }
+    /* bucket the samples into a light curve with a discreet length */
+    light_curve_base(binned->timestamp, binned->series, binned->weight,
+                     binned->length, period_days,
+                     curve, density, curve_length, moments);
+    perf_mark(PERF_SECTION_FOLD);
+
+    if (missing_data(density, curve_length)*100/curve_length >
+        MISSING_THRESHOLD)
+        return -1;
+    if (binned->dispersion_only) return 0;
 
-    memcpy(curve,new_curve,curve_length*sizeof(float));
+    light_curve_resample(binned->av - binned->variance,
+                         binned->av + binned->variance,
+                         binned->timestamp, binned->clipped_series,
+                         binned->clipped_weight, binned->length,
+                         period_days, curve, curve_length);
+    perf_mark(PERF_SECTION_RESAMPLE);
+    return 0;
 }
 
 /**
- * @brief Attempts to detect the orbital period via the transit method.
- *        This tries many possible periods and looks for a dip in
- *        magnitude.
- * @param timestamp Times for observations
- * @param series Magnitude observations
- * @param series_length Length of the Array
- * @param min_period_days The minimum orbital period in days
- * @param max_period_days The maximum orbital period in days
- * @param increment_days The time increment used within the min/max range
- * @params min_dipped_density fraction of the maximum point density below
- *                            which a dip will be considered to be anomalous
- * @params max_dipped_percent Maximum percent of points which are dipped
- * @params min_intermediate_percent Minimum percent of samples between
- *                                  dipped and non-dipped
- * @params max_intermediate_percent Maximum percent of samples between
- *                                  dipped and non-dipped
- * @params expected_dip_radius_percent Expected dip radius as a percentage of
- *                                     the orbital period
- * @params peak_threshold Threshold above the average beyond which to
- *                        disguard the curve
- * @params max_vacancy_density Maximum density within the area of the dip
- *                             expected to be vacant
- * @params dip_threshold A threshold above which the profile will be
- *                       considered to be in the dipped state
- * @returns The best candidate orbital period, or zero if no transit found
+ * @brief Returns the same light curve as light_curve_weighted, but made
+ *        from the sums within each bucket rather than by folding the
+ *        series. The smoothing over neighbouring buckets is applied to
+ *        the sums.
+ * @param count Number of samples within each bucket
+ * @param clipped_count Number of samples within the range of magnitudes
+ *        used when resampling
+ * @param clipped_sum Sum of the samples within that range
+ * @param curve Returned light curve Array
+ * @param density Density of samples
+ * @param curve_length The number of buckets within the curve
+ * @return zero on success
  */
-float detect_orbital_period(float timestamp[],
-                            float series[], int series_length,
-                            float min_period_days,
-                            float max_period_days,
-                            float increment_days,
-                            float min_dipped_density,
-                            float max_dipped_percent,
-                            float min_intermediate_percent,
-                            float max_intermediate_percent,
-                            float expected_dip_radius_percent,
-                            float peak_threshold,
-                            float max_vacancy_density,
-                            float dip_threshold)
-{
-    float period_days=0;
-    float max_response = 0;
-    int expected_width =
-        (int)(DETECT_CURVE_LENGTH*expected_dip_radius_percent/100.0f);
-    int max_dipped = (int)(DETECT_CURVE_LENGTH*max_dipped_percent/100.0f);
-    int max_intermediates =
-        (int)(DETECT_CURVE_LENGTH*max_intermediate_percent/100.0f);
-    int min_intermediates =
-        (int)(DETECT_CURVE_LENGTH*min_intermediate_percent/100.0f);
-    int step = 0;
-    int steps = (int)((max_period_days - min_period_days)/increment_days);
-    float response[MAX_SEARCH_STEPS];
+static int light_curve_sums(int count[], int clipped_count[],
+                            double clipped_sum[],
+                            float curve[], float density[],
+                            int curve_length)
+{
+    int i, prev_index, next_index, hits;
+    float max_samples = 0;
 
-    if (steps > MAX_SEARCH_STEPS) {
-        printf("Maximum number of time steps exceeded\n");
-        return 0;
-    }
+    for (i = curve_length-1; i >= 0; i--) {
+        prev_index = i - 1;
+        if (prev_index < 0) prev_index += curve_length;
+        next_index = i + 1;
+        if (next_index >= curve_length) next_index -= curve_length;
 
-    /* Try different orbital periods in parallel */
-#pragma omp parallel for
-    for (step = 0; step < steps; step++) {
-        float curve[DETECT_CURVE_LENGTH];
-        float density[DETECT_CURVE_LENGTH];
-        float orbital_period_days = min_period_days + (step*increment_days);
+        density[i] = (float)(count[i]*2 +
+                             count[prev_index] +
+                             count[next_index]);
+        if (density[i] > max_samples) max_samples = density[i];
 
-        if (light_curve(timestamp, series, series_length,
-                        orbital_period_days,
-                        curve, density, DETECT_CURVE_LENGTH) != 0)
-            continue;
+        hits = clipped_count[i]*2 +
+            clipped_count[prev_index] +
+            clipped_count[next_index];
+        curve[i] = (float)(clipped_sum[i]*2 +
+                           clipped_sum[prev_index] +
+                           clipped_sum[next_index]);
+        if ((curve[i] > 0) && (hits > 0)) curve[i] /= (float)hits;
+    }
+    perf_mark(PERF_SECTION_FOLD);
+
+    /* normalise */
+    if (max_samples > 0)
+        for (i = curve_length-1; i >= 0; i--) density[i] /= max_samples;
+
+    if (missing_data(density, curve_length)*100/curve_length >
+        MISSING_THRESHOLD)
+        return -1;
+
+    /* fill any holes */
+    curve[0] = curve[curve_length-1];
+    for (i = 1; i < curve_length; i++) {
+        if (curve[i] != 0) continue;
+        curve[i] = curve[i-1];
+    }
+    perf_mark(PERF_SECTION_RESAMPLE);
+    return 0;
+}
 
-        /* calculate the av */
-        float av = 0;
-        int hits = 0;
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if (curve[j] <= 0) continue;
-            av += curve[j];
+/**
+ * @brief Returns the same light curve as light_curve_weighted, but made
+ *        from the sums within each bucket of an accumulator store
+ * @param record Sums for the trial period
+ * @param curve Returned light curve Array
+ * @param density Density of samples
+ * @param curve_length The number of buckets within the curve
+ * @return zero on success
+ */
+static int light_curve_accumulated(struct accumulator_record * record,
+                                   float curve[], float density[],
+                                   int curve_length)
+{
+    return light_curve_sums(record->count, record->clipped_count,
+                            record->clipped_sum, curve, density,
+                            curve_length);
+}
+
+/**
+ * @brief Returns an array containing a light curve for the given
+ *        orbital period_days
+ * @param timestamp Array of imaging times
+ * @param series Array containing magnitudes
+ * @param series_length The length of the data series
+ * @param period_days The expected orbital period
+ * @param curve Returned light curve Array
+ * @param density Density of samples
+ * @param curve_length The number of buckets within the curve
+ * @return zero on success
+ */
+int light_curve(float timestamp[],
+                float series[], int series_length,
+                float period_days,
+                float curve[], float density[], int curve_length)
+{
+    struct binned_series binned;
+
+    if ((curve_length < 1) || (curve_length > DETECT_MAX_CURVE_LENGTH))
+        return -2;
+
+    binned.timestamp = timestamp;
+    binned.series = series;
+    binned.weight = NULL;
+    binned.clipped_series = series;
+    binned.clipped_weight = NULL;
+    binned.length = series_length;
+    binned.original_timestamp = timestamp;
+    binned.original_series = series;
+    binned.original_length = series_length;
+    binned.accumulators = NULL;
+    binned.compact = NULL;
+    binned.dispersion = NULL;
+    binned.dispersion_only = 0;
+
+    /* get the average magnitude and the rms variance from it */
+    binned.av = detect_av(series, series_length);
+    binned.variance = detect_variance(series, series_length, binned.av);
+
+    return light_curve_weighted(&binned, period_days,
+                                curve, density, curve_length, NULL);
+}
+
+/**
+ * @brief Folds a series once into the buckets of the longest light curve
+ *        which will be needed, and makes each shorter curve by adding
+ *        pairs of buckets, so that curves of several lengths for the
+ *        same period do not each fold the series again
+ * @param timestamp Array of imaging times
+ * @param series Array containing magnitudes
+ * @param series_length The length of the data series
+ * @param period_days The orbital period
+ * @param curve_length The number of buckets within the longest curve,
+ *        which is a power of two
+ * @param pyramid Returned sums for every length of curve
+ * @return zero on success
+ */
+int fold_pyramid_create(float timestamp[],
+                        float series[], int series_length,
+                        float period_days, int curve_length,
+                        struct fold_pyramid * pyramid)
+{
+    int i, level, length, buckets = 0, index;
+    int * count, * clipped_count;
+    double * clipped_sum;
+    float av, variance, min_value, max_value;
+    float mult = (float)curve_length / period_days;
+
+    memset(pyramid, 0, sizeof(struct fold_pyramid));
+    if ((curve_length < DETECT_MIN_CURVE_LENGTH) ||
+        (curve_length > DETECT_MAX_CURVE_LENGTH) ||
+        ((curve_length & (curve_length-1)) != 0))
+        return -1;
+
+    for (length = curve_length; length >= DETECT_MIN_CURVE_LENGTH;
+         length /= 2) {
+        buckets += length;
+        pyramid->levels++;
+    }
+    pyramid->curve_length = curve_length;
+    pyramid->count = (int*)calloc(buckets, sizeof(int));
+    pyramid->clipped_count = (int*)calloc(buckets, sizeof(int));
+    pyramid->clipped_sum = (double*)calloc(buckets, sizeof(double));
+    if ((pyramid->count == NULL) || (pyramid->clipped_count == NULL) ||
+        (pyramid->clipped_sum == NULL)) {
+        fold_pyramid_free(pyramid);
+        return -2;
+    }
+
+    /* the same range of magnitudes as light_curve resamples within */
+    av = detect_av(series, series_length);
+    variance = detect_variance(series, series_length, av);
+    min_value = av - variance;
+    max_value = av + variance;
+
+    for (i = series_length-1; i >= 0; i--) {
+        index = (int)(fmod(timestamp[i] * DAY_SECONDS, period_days) * mult);
+        pyramid->count[index]++;
+        if ((series[i] < min_value) || (series[i] > max_value)) continue;
+        pyramid->clipped_count[index]++;
+        pyramid->clipped_sum[index] += series[i];
+    }
+
+    /* each bucket of a level is the sum of two of the level above */
+    count = pyramid->count;
+    clipped_count = pyramid->clipped_count;
+    clipped_sum = pyramid->clipped_sum;
+    length = curve_length;
+    for (level = 1; level < pyramid->levels; level++) {
+        for (i = 0; i < length/2; i++) {
+            count[length + i] = count[i*2] + count[i*2+1];
+            clipped_count[length + i] =
+                clipped_count[i*2] + clipped_count[i*2+1];
+            clipped_sum[length + i] = clipped_sum[i*2] + clipped_sum[i*2+1];
+        }
+        count += length;
+        clipped_count += length;
+        clipped_sum += length;
+        length /= 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the light curve of the given length from a pyramid,
+ *        as light_curve would return it
+ * @param pyramid Sums returned by fold_pyramid_create
+ * @param curve_length The number of buckets, which must be one of the
+ *        levels of the pyramid
+ * @param curve Returned light curve Array
+ * @param density Density of samples
+ * @return zero on success
+ */
+int fold_pyramid_curve(struct fold_pyramid * pyramid, int curve_length,
+                       float curve[], float density[])
+{
+    int level, length = pyramid->curve_length, offset = 0;
+
+    for (level = 0; level < pyramid->levels; level++) {
+        if (length == curve_length)
+            return light_curve_sums(&pyramid->count[offset],
+                                    &pyramid->clipped_count[offset],
+                                    &pyramid->clipped_sum[offset],
+                                    curve, density, curve_length);
+        offset += length;
+        length /= 2;
+    }
+    return -3;
+}
+
+/**
+ * @brief Frees the sums of a pyramid
+ * @param pyramid The pyramid
+ */
+void fold_pyramid_free(struct fold_pyramid * pyramid)
+{
+    free(pyramid->count);
+    free(pyramid->clipped_count);
+    free(pyramid->clipped_sum);
+    pyramid->count = NULL;
+    pyramid->clipped_count = NULL;
+    pyramid->clipped_sum = NULL;
+    pyramid->levels = 0;
+}
+
+/**
+ * @brief Merges runs of consecutive samples which are close together in
+ *        time into single samples, weighted by the number merged. Runs
+ *        are no longer than the given fraction of a bucket of the
+ *        shortest trial period, so that the phase of a merged sample is
+ *        never more than that fraction of a bucket from the phases of
+ *        the samples within it. Runs end at any longer gap, so they
+ *        never cross from one data section to the next.
+ * @param timestamp Times for observations, in ascending order
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param fraction Fraction of a bucket, or zero to merge nothing
+ * @param binned Returned series to be searched
+ * @returns zero on success
+ */
+static int detect_bin_series(float timestamp[],
+                             float series[], int series_length,
+                             float min_period_days, float fraction,
+                             struct binned_series * binned)
+{
+    int i, start, clipped;
+    double sum_time, sum_value, sum_clipped;
+    float min_value, max_value;
+    float width =
+        fraction * min_period_days * 60*60*24 / detect_curve_length;
+
+    binned->timestamp = timestamp;
+    binned->series = series;
+    binned->weight = NULL;
+    binned->clipped_series = series;
+    binned->clipped_weight = NULL;
+    binned->length = series_length;
+    binned->original_timestamp = timestamp;
+    binned->original_series = series;
+    binned->original_length = series_length;
+    binned->accumulators = NULL;
+    binned->dispersion = NULL;
+    binned->dispersion_only = 0;
+    binned->av = detect_av(series, series_length);
+    binned->variance = detect_variance(series, series_length, binned->av);
+    binned->compact = NULL;
+    if (detect_compact)
+        binned->compact = compact_series_create(timestamp, series,
+                                                series_length, binned->av);
+    if ((fraction <= 0) || (series_length < 2)) return 0;
+
+    binned->timestamp = (float*)malloc(series_length*5*sizeof(float));
+    if (binned->timestamp == NULL) {
+        binned->timestamp = timestamp;
+        return -1;
+    }
+    binned->series = &binned->timestamp[series_length];
+    binned->weight = &binned->timestamp[series_length*2];
+    binned->clipped_series = &binned->timestamp[series_length*3];
+    binned->clipped_weight = &binned->timestamp[series_length*4];
+
+    /* the range of magnitudes used when resampling does not depend upon
+       the period, so samples outside of it are left out of the
+       clipped values here rather than when folding */
+    min_value = binned->av - binned->variance;
+    max_value = binned->av + binned->variance;
+
+    binned->length = 0;
+    for (start = 0; start < series_length; start = i) {
+        sum_time = 0;
+        sum_value = 0;
+        sum_clipped = 0;
+        clipped = 0;
+        for (i = start; i < series_length; i++) {
+            if (timestamp[i] - timestamp[start] > width) break;
+            sum_time += timestamp[i];
+            sum_value += series[i];
+            if ((series[i] < min_value) || (series[i] > max_value)) continue;
+            sum_clipped += series[i];
+            clipped++;
+        }
+        binned->timestamp[binned->length] = (float)(sum_time / (i - start));
+        binned->series[binned->length] = (float)(sum_value / (i - start));
+        binned->weight[binned->length] = (float)(i - start);
+        binned->clipped_series[binned->length] = binned->av;
+        if (clipped > 0)
+            binned->clipped_series[binned->length] =
+                (float)(sum_clipped / clipped);
+        binned->clipped_weight[binned->length] = (float)clipped;
+        binned->length++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the timestamps of the samples merged by
+ *        detect_bin_series, without needing their magnitudes
+ * @param timestamp Times for observations, in ascending order
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param fraction Fraction of a bucket
+ * @param merged Returned timestamps of the merged samples
+ * @returns The number of merged samples
+ */
+static int detect_bin_timestamps(float timestamp[], int series_length,
+                                 float min_period_days, float fraction,
+                                 float merged[])
+{
+    int i, start, length = 0;
+    double sum_time;
+    float width =
+        fraction * min_period_days * 60*60*24 / detect_curve_length;
+
+    for (start = 0; start < series_length; start = i) {
+        sum_time = 0;
+        for (i = start; i < series_length; i++) {
+            if (timestamp[i] - timestamp[start] > width) break;
+            sum_time += timestamp[i];
+        }
+        merged[length++] = (float)(sum_time / (i - start));
+    }
+    return length;
+}
+
+/**
+ * @brief Frees memory for merged and compact samples
+ * @param binned Series returned by detect_bin_series
+ */
+static void detect_bin_free(struct binned_series * binned)
+{
+    compact_series_free(binned->compact);
+    binned->compact = NULL;
+    if (binned->weight == NULL) return;
+    free(binned->timestamp);
+    binned->weight = NULL;
+}
+
+/**
+ * @brief Detects the array index of the centre of the transit
+ * @param curve Array containing light curve magnitudes
+ * @param curve_length Length of the array
+ * @returns Array index of the centre of the transit
+ */
+int detect_phase_offset(float curve[], int curve_length)
+{
+    int i, j, l, offset = 0;
+    float minimum = 0, v;
+    int search_radius = (int)(curve_length*5/100);
+
+    for (i = 0; i < curve_length; i++) {
+        v = 0;
+        for (j = i-search_radius; j <= i+search_radius; j++) {
+            l = j;
+            if (l < 0) l += curve_length;
+            if (l >= curve_length) l -= curve_length;
+            v += curve[l];
+        }
+        if ((v < minimum) || (minimum == 0)) {
+            minimum = v;
+            offset = i;
+        }
+    }
+    return offset;
+}
+
+/**
+ * @brief Adjust the light curve so that the transit is at the centre
+ * @param curve Array containing light curve magnitudes
+ * @param curve_length Length of the array
+ * @param offset Array index of the centre of the transit
+ */
+void adjust_curve(float curve[], int curve_length, int offset)
+{
+    int i, start, index;
+    int adjust = (int)(curve_length/2) - offset;
+    float value, next;
+
+    adjust %= curve_length;
+    if (adjust < 0) adjust += curve_length;
+    if (adjust == 0) return;
+
+    /* rotated in place, following each cycle of moves, so that curves
+       of any length can be adjusted */
+    for (start = 0, i = 0; i < curve_length; start++) {
+        index = start;
+        value = curve[start];
+        do {
+            index += adjust;
+            if (index >= curve_length) index -= curve_length;
+            next = curve[index];
+            curve[index] = value;
+            value = next;
+            i++;
+        } while (index != start);
+    }
+}
+
+/**
+ * @brief Scores a light curve for a single trial period, applying each
+ *        of the checks for a transit other than the vacancy of the dip
+ * @param curve Light curve returned by light_curve
+ * @param density Density of samples returned by light_curve
+ * @param params Detection thresholds
+ * @param start_index Returned starting index of the dip
+ * @param end_index Returned ending index of the dip
+ * @param gate Returned gate at which the curve was rejected, or
+ *        PROFILE_GATE_SCORED if the dip vacancy remains to be checked
+ * @returns The response before the vacancy check, or zero if rejected
+ */
+static float detect_score(float curve[], float density[],
+                          struct detect_params * params,
+                          int * start_index, int * end_index, int * gate)
+{
+    int curve_length = detect_curve_length;
+    int expected_width =
+        (int)(curve_length*params->expected_dip_radius_percent/100.0f);
+    int max_dipped =
+        (int)(curve_length*params->max_dipped_percent/100.0f);
+    int max_intermediates =
+        (int)(curve_length*params->max_intermediate_percent/100.0f);
+    int min_intermediates =
+        (int)(curve_length*params->min_intermediate_percent/100.0f);
+    float response;
+
+    /* calculate the av */
+    float av = 0;
+    int hits = 0;
+    for (int j = curve_length-1; j >= 0; j--) {
+        if (curve[j] <= 0) continue;
+        av += curve[j];
+        hits++;
+    }
+    /* there should be no gaps in the series */
+    if (hits < curve_length) {
+        *gate = PROFILE_GATE_GAPS;
+        return 0;
+    }
+    av /= (float)hits;
+
+    /* average density of samples */
+    float av_density = 0;
+    hits = 0;
+    for (int j = curve_length-1; j >= 0; j--) {
+        if (density[j] <= 0) continue;
+        av_density += density[j];
+        hits++;
+    }
+    av_density /= (float)hits;
+
+    /* variation in the density of samples */
+    float density_variance = 0;
+    hits = 0;
+    for (int j = curve_length-1; j >= 0; j--) {
+        if (density[j] <= 0) continue;
+        density_variance +=
+            (density[j] - av_density)*(density[j] - av_density);
+        hits++;
+    }
+    density_variance = (float)(density_variance / (float)hits);
+
+    /* find the minimum */
+    float minimum = 0;
+    for (int j = 0; j < curve_length; j++) {
+        float v = 0;
+        hits = 0;
+        for (int k = j-expected_width; k <= j+expected_width; k++) {
+            int l = k;
+            if (l < 0) l += curve_length;
+            if (l >= curve_length) l -= curve_length;
+            if (curve[l] <= 0) continue;
+            v += curve[l];
             hits++;
+            if (k == j) {
+                v += curve[l];
+                hits++;
+            }
+        }
+        if (hits > 0) {
+            v /= (float)hits;
+            if ((v < minimum) || (minimum == 0)) minimum = v;
+        }
+    }
+
+    /* start and end indexes of the dip */
+    *start_index = -1;
+    *end_index = -1;
+
+    /* How much difference from the av? */
+    int dipped = 0;
+    float dipped_density = 0;
+    float threshold_dipped = minimum + ((av-minimum)*params->dip_threshold);
+    for (int j = 0; j < curve_length; j++) {
+        if (curve[j] >= threshold_dipped) continue;
+        if (*start_index == -1) *start_index = j;
+        *end_index = j;
+        dipped++;
+        if (dipped > max_dipped) break;
+        dipped_density += density[j];
+    }
+
+    /* there should be a beginning and end to the dipped area */
+    if ((*start_index == -1) && (*end_index == -1)) {
+        *gate = PROFILE_GATE_NO_DIP;
+        return 0;
+    }
+
+    /* dipped area should not be too wide */
+    if (*end_index - *start_index > (int)(curve_length*10/100)) {
+        *gate = PROFILE_GATE_DIP_WIDTH;
+        return 0;
+    }
+
+    /* we only expect a small percentage
+       of the curve to be dipped */
+    if (dipped > max_dipped) {
+        dipped = 0;
+    }
+    if (dipped == 0) {
+        *gate = PROFILE_GATE_MAX_DIPPED;
+        return 0;
+    }
+    dipped_density /= (float)dipped;
+    if (dipped_density < params->min_dipped_density) {
+        *gate = PROFILE_GATE_DIPPED_DENSITY;
+        return 0;
+    }
+
+    /* peaks above the av are an indicator that this isn't a transit  */
+    int peaked = 0;
+    float threshold_peaked = av + ((av-minimum)*params->peak_threshold);
+    for (int j = curve_length-1; j >= 0; j--) {
+        if (curve[j] > threshold_peaked) {
+            peaked++;
+            break;
+        }
+    }
+    if (peaked > 0) {
+        *gate = PROFILE_GATE_PEAK;
+        return 0;
+    }
+
+    /* How much difference from the av? */
+    int nondipped = 0;
+    float threshold_upper = av - ((av-minimum)*0.2);
+    for (int j = curve_length-1; j >= 0; j--) {
+        if ((curve[j] < threshold_upper) &&
+            (curve[j] > threshold_dipped)) {
+            nondipped++;
+            if (nondipped > max_intermediates) {
+                break;
+            }
+        }
+    }
+    if ((nondipped < min_intermediates) ||
+        (nondipped > max_intermediates)) {
+        *gate = PROFILE_GATE_INTERMEDIATES;
+        return 0;
+    }
+
+    /* variance of the averaged light curve from average */
+    float variance_value = 0;
+    float variance_min = 0;
+    float variance_max = 0;
+    float variance_diff = 1.0f;
+    hits = 0;
+    for (int j = curve_length-1; j >= 0; j--) {
+        if (curve[j] <= 0) continue;
+        variance_value = (curve[j] - av)*(curve[j] - av);
+        if (variance_value > 0) {
+            if (variance_min != 0) {
+                if (variance_value < variance_min)
+                    variance_min = variance_value;
+            }
+            else
+                variance_min = variance_value;
+            if (variance_max != 0) {
+                if (variance_value > variance_max)
+                    variance_max = variance_value;
+            }
+            else
+                variance_max = variance_value;
+        }
+        hits++;
+    }
+
+    if ((hits == 0) || (variance_max <= variance_min)) {
+        *gate = PROFILE_GATE_FLAT;
+        return 0;
+    }
+
+    density_variance = 1.0f + density_variance;
+    variance_diff = 1.0f + (variance_max - variance_min);
+
+    response =
+        (av-minimum)*(float)dipped*100.0f/(av*(float)(1+nondipped));
+    response /= (density_variance*variance_diff);
+
+    *gate = PROFILE_GATE_SCORED;
+    return response;
+}
+
+/**
+ * @brief Counts the samples before merging within each bucket, and how
+ *        many are above the lower bound of the curve, as
+ *        dip_vacancy_table
+ * @param binned Series being searched
+ * @param period_days The expected orbital period
+ * @param vacancy Light curve, returned with its counts
+ */
+static void detect_vacancy_table(struct binned_series * binned,
+                                 float period_days,
+                                 struct fold_record * vacancy)
+{
+    if (binned->compact != NULL) {
+        dip_vacancy_table_compact(binned->compact, period_days,
+                                  vacancy->curve, detect_curve_length,
+                                  vacancy);
+        return;
+    }
+    dip_vacancy_table(binned->original_timestamp, binned->original_series,
+                      binned->original_length, period_days,
+                      vacancy->curve, detect_curve_length, vacancy);
+}
+
+/**
+ * @brief Folds the series at a trial period, reads the fold from a
+ *        store, or makes it from accumulated sums. When a store is being
+ *        filled in, the counts needed for the vacancy check are always
+ *        found, since whether later searches will need them depends
+ *        upon their thresholds.
+ * @param binned Series to be folded
+ * @param period_days The trial orbital period
+ * @param step Index of the trial period within the search grid
+ * @param coverage Spans of time within which samples were taken, or NULL
+ *        if no period is to be ruled out for its phase coverage
+ * @param store Fold store, or NULL
+ * @param fold Working space for the folded light curve
+ * @param have_vacancy Returned non-zero if the vacancy counts are known
+ * @returns The folded light curve, having its gate set to
+ *          PROFILE_GATE_SCORED if it may be scored
+ */
+static struct fold_record * detect_fold(struct binned_series * binned,
+                                        float period_days, int step,
+                                        struct phase_coverage * coverage,
+                                        struct fold_store * store,
+                                        struct fold_record * fold,
+                                        int * have_vacancy)
+{
+    struct fold_moments moments, * fold_moments = NULL;
+    struct detect_dispersion * dispersion = binned->dispersion;
+
+    *have_vacancy = 0;
+    fold->theta = 1;
+    if ((store != NULL) && (!store->writing)) {
+        /* periods which were rejected were never written, and so
+           read back as missing data */
+        *have_vacancy = 1;
+        if (foldstore_read(store, step, fold) != 0)
+            fold->gate = PROFILE_GATE_MISSING_DATA;
+        return fold;
+    }
+
+    /* periods for which some phases can have no samples are
+       rejected without folding */
+    fold->gate = PROFILE_GATE_MISSING_DATA;
+    if ((coverage != NULL) &&
+        (!phase_coverage_complete(coverage, period_days, detect_curve_length)))
+        return fold;
+
+    fold->gate = PROFILE_GATE_SCORED;
+    /* accumulated sums have a fixed number of buckets, and are not
+       opened with any other */
+    if (binned->accumulators != NULL) {
+        if (light_curve_accumulated(&binned->accumulators->records[step],
+                                    fold->curve, fold->density,
+                                    DETECT_CURVE_LENGTH) != 0)
+            fold->gate = PROFILE_GATE_MISSING_DATA;
+        return fold;
+    }
+    if (dispersion != NULL) {
+        moments.offset = binned->av;
+        fold_moments = &moments;
+    }
+    if (light_curve_weighted(binned, period_days, fold->curve, fold->density,
+                             detect_curve_length, fold_moments) != 0)
+        fold->gate = PROFILE_GATE_MISSING_DATA;
+
+    /* the sums are complete even where too many buckets are empty
+       for a transit to be scored, since phase bins are wider */
+    if (dispersion != NULL)
+        fold->theta = pdm_theta(moments.count, moments.sum,
+                                moments.sum_squared, detect_curve_length,
+                                dispersion->total_variance,
+                                dispersion->bin_counts,
+                                dispersion->no_of_bin_counts);
+    if ((store == NULL) || (fold->gate != PROFILE_GATE_SCORED))
+        return fold;
+
+    /* gaps do not depend upon the thresholds, so are checked here
+       so that only curves which may be scored are kept */
+    for (int j = detect_curve_length-1; j >= 0; j--) {
+        if (fold->curve[j] > 0) continue;
+        fold->gate = PROFILE_GATE_GAPS;
+        foldstore_write(store, step, fold);
+        return fold;
+    }
+
+    detect_vacancy_table(binned, period_days, fold);
+    *have_vacancy = 1;
+
+    foldstore_write(store, step, fold);
+    return fold;
+}
+
+/**
+ * @brief Returns which trial periods pass the pre-screen
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param steps Number of trial periods
+ * @returns Non-zero for each trial period to be folded, or NULL if
+ *          every trial period is to be folded
+ */
+static unsigned char * detect_prescreen(float timestamp[],
+                                        float series[], int series_length,
+                                        float min_period_days,
+                                        float increment_days, int steps)
+{
+    unsigned char * keep;
+
+    if (detect_prescreen_fraction <= 0) return NULL;
+
+    keep = (unsigned char*)malloc(steps);
+    if (keep == NULL) return NULL;
+
+    if (prescreen_periods(timestamp, series, series_length,
+                          min_period_days, increment_days, steps,
+                          detect_prescreen_fraction, keep) != 0) {
+        free(keep);
+        return NULL;
+    }
+    return keep;
+}
+
+/**
+ * @brief Applies the check on the density of samples within the
+ *        region of the dip which is expected to be vacant
+ * @param response Response returned by detect_score
+ * @param vacancy_density Density of samples returned by dip_vacancy
+ * @param params Detection thresholds
+ * @param gate Returned gate at which the curve was rejected, or
+ *        PROFILE_GATE_SCORED
+ * @returns The final response, or zero if rejected
+ */
+static float detect_vacancy_response(float response, float vacancy_density,
+                                     struct detect_params * params,
+                                     int * gate)
+{
+    if (vacancy_density > params->max_vacancy_density) {
+        *gate = PROFILE_GATE_VACANCY;
+        return 0;
+    }
+    *gate = PROFILE_GATE_SCORED;
+    return response / (1.0f + (vacancy_density*10));
+}
+
+/**
+ * @brief Returns the orbital period having the best response over all
+ *        chunks of the search. Ties go to the longest period.
+ * @param chunk_response Best response within each chunk
+ * @param chunk_step Step at which the best response in each chunk occurred
+ * @param chunks Number of chunks
+ * @param stride Distance between the entries for successive chunks
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param best_response Returned best response, or NULL
+ * @param best_chunk Returned chunk having the best response, or -1 if
+ *        there was no response. May be NULL.
+ * @returns The best orbital period, or zero if there was no response
+ */
+static float detect_best_period(float chunk_response[], int chunk_step[],
+                                int chunks, int stride,
+                                float min_period_days, float increment_days,
+                                float * best_response, int * best_chunk)
+{
+    int chunk, best = -1;
+    float period_days = 0, max_response = 0;
+
+    for (chunk = chunks-1; chunk >= 0; chunk--) {
+        if (chunk_response[chunk*stride] <= max_response) continue;
+        max_response = chunk_response[chunk*stride];
+        period_days =
+            min_period_days + (chunk_step[chunk*stride]*increment_days);
+        best = chunk;
+    }
+    if (best_response != NULL) *best_response = max_response;
+    if (best_chunk != NULL) *best_chunk = best;
+    return period_days;
+}
+
+/**
+ * @brief Folds and scores one trial period
+ * @param binned Series being searched
+ * @param coverage Spans of time used to find phase coverage
+ * @param keep Trial periods kept by the pre-screen, or NULL for all
+ * @param store Fold store, or NULL
+ * @param params Detection thresholds
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param step Index of the trial period
+ * @param value Returned response if scored, or -(gate+1) if rejected,
+ *        as saved within the periodogram. Without params this is one
+ *        minus the phase dispersion.
+ * @param theta Returned phase dispersion, or one if it was not found.
+ *        May be NULL.
+ * @returns The response, which is only a candidate if above zero
+ */
+static float detect_trial(struct binned_series * binned,
+                          struct phase_coverage * coverage,
+                          unsigned char keep[], struct fold_store * store,
+                          struct detect_params * params,
+                          float min_period_days, float increment_days,
+                          int step, float * value, float * theta)
+{
+    struct fold_record working, * fold;
+    float orbital_period_days = min_period_days + (step*increment_days);
+    float response;
+    int start_index, end_index, gate, have_vacancy;
+
+    if (theta != NULL) *theta = 1;
+    if ((keep != NULL) && (!keep[step])) {
+        profile_gate(PROFILE_GATE_PRESCREEN);
+        *value = -(float)(PROFILE_GATE_PRESCREEN + 1);
+        return 0;
+    }
+
+    fold = detect_fold(binned, orbital_period_days, step, coverage,
+                       store, &working, &have_vacancy);
+    if (theta != NULL) *theta = fold->theta;
+
+    /* only the phase dispersion is wanted, which is found unless
+       the period was rejected before folding */
+    if ((params == NULL) && (fold->theta < 1)) {
+        profile_gate(PROFILE_GATE_SCORED);
+        *value = 1.0f - fold->theta;
+        return 0;
+    }
+    if ((params == NULL) || (fold->gate != PROFILE_GATE_SCORED)) {
+        profile_gate(fold->gate);
+        *value = -(float)(fold->gate + 1);
+        return 0;
+    }
+
+    response = detect_score(fold->curve, fold->density, params,
+                            &start_index, &end_index, &gate);
+    if (gate == PROFILE_GATE_SCORED) {
+        /* check the density within the area of the dip which
+           is expected to be vacant */
+        if (!have_vacancy)
+            detect_vacancy_table(binned, orbital_period_days, fold);
+        response =
+            detect_vacancy_response(response,
+                                    dip_vacancy(start_index, end_index,
+                                                fold),
+                                    params, &gate);
+    }
+    profile_gate(gate);
+    *value = (gate == PROFILE_GATE_SCORED) ? response : -(float)(gate + 1);
+    return response;
+}
+
+/**
+ * @brief Folds and scores every trial period of the search grid. If
+ *        binned->dispersion is given the phase dispersion of each fold
+ *        is also found, and without params only that is found.
+ * @param binned Series being searched
+ * @param coverage Spans of time used to find phase coverage, or NULL
+ * @param keep Trial periods kept by the pre-screen, or NULL for all
+ * @param store Fold store, or NULL
+ * @param params Detection thresholds
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param steps Number of trial periods
+ * @param max_response Returned response at the best period
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+static float detect_grid(struct binned_series * binned,
+                         struct phase_coverage * coverage,
+                         unsigned char keep[], struct fold_store * store,
+                         struct detect_params * params,
+                         float min_period_days, float increment_days,
+                         int steps, float * max_response)
+{
+    float period_days, best_response;
+    int chunk, best_chunk;
+    int chunks = (steps + DETECT_CHUNK_STEPS - 1) / DETECT_CHUNK_STEPS;
+    float * chunk_response;
+    int * chunk_step;
+    struct detect_dispersion * dispersion = binned->dispersion;
+
+    /* rather than keeping a response for every trial period only the
+       best within each chunk is kept, so that many stars may be
+       searched at once without large stack arrays. With the phase
+       dispersion the entries after the first chunks hold one minus
+       the smallest theta of each chunk, and the theta at its best
+       transit response. */
+    chunk_response = (float*)calloc(chunks*3, sizeof(float));
+    chunk_step = (int*)calloc(chunks*2, sizeof(int));
+    if ((chunk_response == NULL) || (chunk_step == NULL)) {
+        free(chunk_response);
+        free(chunk_step);
+        return 0;
+    }
+    for (chunk = 0; chunk < chunks; chunk++)
+        chunk_response[chunks*2 + chunk] = 1;
+
+    /* Try different orbital periods in parallel, in chunks of steps */
+#pragma omp parallel for schedule(dynamic)
+    for (chunk = 0; chunk < chunks; chunk++) {
+        double chunk_start = trace_begin();
+        int first_step = chunk*DETECT_CHUNK_STEPS;
+        int last_step = (chunk+1)*DETECT_CHUNK_STEPS;
+        float values[DETECT_CHUNK_STEPS];
+        if (last_step > steps) last_step = steps;
+
+        perf_begin();
+        for (int step = first_step; step < last_step; step++) {
+            float response, theta;
+
+            /* scoring of the previous trial period ends here */
+            perf_mark(PERF_SECTION_SCORE);
+
+            response = detect_trial(binned, coverage, keep, store, params,
+                                    min_period_days, increment_days, step,
+                                    &values[step - first_step], &theta);
+
+            /* best response within this chunk, with later trial
+               periods winning ties */
+            if ((response > 0) && (response >= chunk_response[chunk])) {
+                chunk_response[chunk] = response;
+                chunk_step[chunk] = step;
+                chunk_response[chunks*2 + chunk] = theta;
+            }
+            if ((theta < 1) &&
+                (1.0f - theta >= chunk_response[chunks + chunk])) {
+                chunk_response[chunks + chunk] = 1.0f - theta;
+                chunk_step[chunks + chunk] = step;
+            }
+        }
+        perf_end(PERF_SECTION_SCORE);
+        periodogram_add(first_step, values, last_step - first_step);
+        trace_end("period chunk", "search", chunk_start, chunk, NULL);
+    }
+
+    period_days = detect_best_period(chunk_response, chunk_step, chunks, 1,
+                                     min_period_days, increment_days,
+                                     max_response, &best_chunk);
+    if (dispersion != NULL) {
+        dispersion->theta = 1;
+        if (best_chunk >= 0)
+            dispersion->theta = chunk_response[chunks*2 + best_chunk];
+        dispersion->period_days =
+            detect_best_period(&chunk_response[chunks], &chunk_step[chunks],
+                               chunks, 1, min_period_days, increment_days,
+                               &best_response, NULL);
+        dispersion->min_theta = 1.0f - best_response;
+    }
+    free(chunk_response);
+    free(chunk_step);
+    return period_days;
+}
+
+/**
+ * @brief Attempts to detect the orbital period via the transit method.
+ *        This tries many possible periods and looks for a dip in
+ *        magnitude.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period(float timestamp[],
+                            float series[], int series_length,
+                            float min_period_days,
+                            float max_period_days,
+                            float increment_days,
+                            struct detect_params * params,
+                            struct fold_store * store)
+{
+    float max_response;
+
+    return detect_orbital_period_response(timestamp, series, series_length,
+                                          min_period_days, max_period_days,
+                                          increment_days, params, store,
+                                          &max_response);
+}
+
+/**
+ * @brief As detect_orbital_period, but also returns the response at the
+ *        best period, so that searches over separate ranges of the
+ *        orbital period can be compared
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @param max_response Returned response at the best period
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period_response(float timestamp[],
+                                     float series[], int series_length,
+                                     float min_period_days,
+                                     float max_period_days,
+                                     float increment_days,
+                                     struct detect_params * params,
+                                     struct fold_store * store,
+                                     float * max_response)
+{
+    return detect_orbital_period_dispersion(timestamp, series, series_length,
+                                            min_period_days, max_period_days,
+                                            increment_days, params, store,
+                                            max_response, NULL);
+}
+
+/**
+ * @brief As detect_orbital_period_response, but also finding the phase
+ *        dispersion of every trial period from the sums of the same
+ *        fold, so that a second statistic which makes no assumption
+ *        about the shape of the light curve comes at little extra cost
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds, or NULL to find only the
+ *        phase dispersion
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @param max_response Returned response at the best period
+ * @param dispersion Numbers of phase bins, and the returned phase
+ *        dispersion, or NULL
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period_dispersion(float timestamp[],
+                                       float series[], int series_length,
+                                       float min_period_days,
+                                       float max_period_days,
+                                       float increment_days,
+                                       struct detect_params * params,
+                                       struct fold_store * store,
+                                       float * max_response,
+                                       struct detect_dispersion * dispersion)
+{
+    float period_days;
+    struct detect_context context;
+
+    *max_response = 0;
+    if (dispersion != NULL) {
+        dispersion->period_days = 0;
+        dispersion->min_theta = 1;
+        dispersion->theta = 1;
+    }
+    if (detect_context_create(timestamp, series_length,
+                              min_period_days, max_period_days,
+                              increment_days, &context) != 0)
+        return 0;
+    period_days = detect_orbital_period_context(&context, series, params,
+                                                store, max_response,
+                                                dispersion);
+    detect_context_free(&context);
+    return period_days;
+}
+
+/**
+ * @brief Prepares to search a series, possibly many times with its
+ *        magnitudes rearranged. What depends only upon the timestamps
+ *        and the search grid is found once here.
+ * @param timestamp Times for observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param context Returned context
+ * @returns zero on success
+ */
+int detect_context_create(float timestamp[], int series_length,
+                          float min_period_days,
+                          float max_period_days,
+                          float increment_days,
+                          struct detect_context * context)
+{
+    float * merged;
+    int length;
+
+    context->timestamp = timestamp;
+    context->series_length = series_length;
+    context->min_period_days = min_period_days;
+    context->increment_days = increment_days;
+    context->steps =
+        (int)((max_period_days - min_period_days)/increment_days);
+    context->coverage.intervals = 0;
+    context->coverage.start_days = NULL;
+    context->coverage.end_days = NULL;
+    if (context->steps > MAX_SEARCH_STEPS) {
+        printf("Maximum number of time steps exceeded\n");
+        return -1;
+    }
+    if (context->steps < 1) return -2;
+
+    if ((detect_bin_fraction <= 0) || (series_length < 2)) {
+        phase_coverage_init(timestamp, series_length, min_period_days,
+                            detect_curve_length, &context->coverage);
+        return 0;
+    }
+
+    /* samples are merged over spans of time which do not depend upon
+       their magnitudes, so the merged timestamps are the same for
+       any arrangement of the magnitudes */
+    merged = (float*)malloc(series_length*sizeof(float));
+    if (merged == NULL) return -3;
+    length = detect_bin_timestamps(timestamp, series_length,
+                                   min_period_days, detect_bin_fraction,
+                                   merged);
+    phase_coverage_init(merged, length, min_period_days,
+                        detect_curve_length, &context->coverage);
+    free(merged);
+    return 0;
+}
+
+/**
+ * @brief Searches the grid of a context for the orbital period of
+ *        the given magnitudes
+ * @param context Context returned by detect_context_create
+ * @param series Magnitude observations at the timestamps of the context
+ * @param params Detection thresholds, or NULL to find only the
+ *        phase dispersion
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @param max_response Returned response at the best period
+ * @param dispersion Numbers of phase bins, and the returned phase
+ *        dispersion, or NULL
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period_context(struct detect_context * context,
+                                    float series[],
+                                    struct detect_params * params,
+                                    struct fold_store * store,
+                                    float * max_response,
+                                    struct detect_dispersion * dispersion)
+{
+    float period_days;
+    struct binned_series binned;
+    unsigned char * keep;
+    int i;
+    float w = 1, samples = 0;
+
+    *max_response = 0;
+    detect_bin_series(context->timestamp, series, context->series_length,
+                      context->min_period_days, detect_bin_fraction,
+                      &binned);
+    if (dispersion != NULL) {
+        /* variance of the samples which are folded, against which the
+           variance within each phase bin is compared */
+        dispersion->total_variance = 0;
+        for (i = 0; i < binned.length; i++) {
+            if (binned.weight != NULL) w = binned.weight[i];
+            dispersion->total_variance +=
+                (binned.series[i] - binned.av)*
+                (binned.series[i] - binned.av)*w;
+            samples += w;
         }
-        /* there should be no gaps in the series */
-        if (hits < DETECT_CURVE_LENGTH) {
-            response[step] = 0;
-            continue;
+        if (samples > 1) {
+            dispersion->total_variance /= (samples - 1);
+            binned.dispersion = dispersion;
+            binned.dispersion_only = (params == NULL);
         }
-        av /= (float)hits;
+    }
 
-        /* average density of samples */
-        float av_density = 0;
-        hits = 0;
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if (density[j] <= 0) continue;
-            av_density += density[j];
-            hits++;
-        }
-        av_density /= (float)hits;
+    /* the pre-screen looks for dips, so is not used when only the
+       phase dispersion is wanted */
+    keep = NULL;
+    if (params != NULL)
+        keep = detect_prescreen(context->timestamp, series,
+                                context->series_length,
+                                context->min_period_days,
+                                context->increment_days, context->steps);
+
+    /* phase bins may be empty without harm to the phase dispersion,
+       so without params no period is ruled out for its coverage */
+    period_days = detect_grid(&binned,
+                              (params != NULL) ? &context->coverage : NULL,
+                              keep, store, params, context->min_period_days,
+                              context->increment_days, context->steps,
+                              max_response);
+    detect_bin_free(&binned);
+    free(keep);
+    return period_days;
+}
 
-        /* variation in the density of samples */
-        float density_variance = 0;
-        hits = 0;
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if (density[j] <= 0) continue;
-            density_variance +=
-                (density[j] - av_density)*(density[j] - av_density);
-            hits++;
+/**
+ * @brief Frees memory for a context
+ * @param context Context returned by detect_context_create
+ */
+void detect_context_free(struct detect_context * context)
+{
+    phase_coverage_free(&context->coverage);
+}
+
+/**
+ * @brief Adds samples to the sums within each bucket for every trial
+ *        period. Samples from store->folded onwards are new, and are
+ *        added to every sum. The range of magnitudes used when
+ *        resampling moves as samples are added, so earlier samples
+ *        are also visited where they move into or out of that range,
+ *        but no others.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param store Accumulators for the same series and search grid
+ * @returns zero on success
+ */
+static int detect_accumulate(float timestamp[],
+                             float series[], int series_length,
+                             float min_period_days, float increment_days,
+                             struct accumulator_store * store)
+{
+    int i, step, no_of_moved = 0, folded = store->folded;
+    int * moved;
+    float av = detect_av(series, series_length);
+    float variance = detect_variance(series, series_length, av);
+    float clip_min = av - variance, clip_max = av + variance;
+
+    /* earlier samples which are now inside or outside of the range */
+    moved = (int*)malloc((folded + 1)*sizeof(int));
+    if (moved == NULL) return -1;
+    for (i = 0; i < folded; i++) {
+        int was_inside = !((series[i] < store->clip_min) ||
+                           (series[i] > store->clip_max));
+        int inside = !((series[i] < clip_min) || (series[i] > clip_max));
+        if (was_inside != inside) moved[no_of_moved++] = i;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (step = 0; step < store->steps; step++) {
+        float period_days = min_period_days + (step*increment_days);
+        float mult = (float)DETECT_CURVE_LENGTH / period_days;
+        struct accumulator_record * record = &store->records[step];
+
+        for (int j = folded; j < series_length; j++) {
+            float days = timestamp[j] * DAY_SECONDS;
+            int index = (int)(fmod(days,period_days) * mult);
+            record->count[index]++;
+            record->sum[index] += series[j];
+            record->sum_squared[index] += (double)series[j]*series[j];
+            if ((series[j] < clip_min) || (series[j] > clip_max)) continue;
+            record->clipped_count[index]++;
+            record->clipped_sum[index] += series[j];
         }
-        density_variance = (float)(density_variance / (float)hits);
-
-        /* find the minimum */
-        float minimum = 0;
-        for (int j = 0; j < DETECT_CURVE_LENGTH; j++) {
-            float v = 0;
-            hits = 0;
-            for (int k = j-expected_width; k <= j+expected_width; k++) {
-                int l = k;
-                if (l < 0) l += DETECT_CURVE_LENGTH;
-                if (l >= DETECT_CURVE_LENGTH) l -= DETECT_CURVE_LENGTH;
-                if (curve[l] <= 0) continue;
-                v += curve[l];
-                hits++;
-                if (k == j) {
-                    v += curve[l];
-                    hits++;
-                }
+
+        for (int j = 0; j < no_of_moved; j++) {
+            float days = timestamp[moved[j]] * DAY_SECONDS;
+            int index = (int)(fmod(days,period_days) * mult);
+            if ((series[moved[j]] < clip_min) ||
+                (series[moved[j]] > clip_max)) {
+                record->clipped_count[index]--;
+                record->clipped_sum[index] -= series[moved[j]];
             }
-            if (hits > 0) {
-                v /= (float)hits;
-                if ((v < minimum) || (minimum == 0)) minimum = v;
+            else {
+                record->clipped_count[index]++;
+                record->clipped_sum[index] += series[moved[j]];
             }
         }
+    }
 
-        /* start and end indexes of the dip */
-        int start_index = -1;
-        int end_index = -1;
+    free(moved);
+    store->folded = series_length;
+    store->clip_min = clip_min;
+    store->clip_max = clip_max;
+    return 0;
+}
 
-        /* How much difference from the av? */
-        int dipped = 0;
-        float dipped_density = 0;
-        float threshold_dipped = minimum + ((av-minimum)*dip_threshold);
-        for (int j = 0; j < DETECT_CURVE_LENGTH; j++) {
-            if (curve[j] >= threshold_dipped) continue;
-            if (start_index == -1) start_index = j;
-            end_index = j;
-            dipped++;
-            if (dipped > max_dipped) break;
-            dipped_density += density[j];
-        }
+/**
+ * @brief As detect_orbital_period_response, but with the light curve of
+ *        each trial period made from an accumulator store. Samples
+ *        which were not in the store are added to it first. The vacancy
+ *        of the dip is found from the series for the few trial periods
+ *        which pass every other check.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param store Accumulators opened for the same series and search grid
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period_incremental(float timestamp[],
+                                        float series[], int series_length,
+                                        float min_period_days,
+                                        float max_period_days,
+                                        float increment_days,
+                                        struct detect_params * params,
+                                        struct accumulator_store * store)
+{
+    float period_days, max_response;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    struct phase_coverage coverage;
+    struct binned_series binned;
+    unsigned char * keep;
 
-        /* there should be a beginning and end to the dipped area */
-        if ((start_index == -1) && (end_index == -1)) {
-            response[step] = 0;
+    if ((steps < 1) || (steps != store->steps)) return 0;
+
+    /* sums are kept for curves of the default length only */
+    if (detect_curve_length != DETECT_CURVE_LENGTH) return 0;
+    if (detect_accumulate(timestamp, series, series_length,
+                          min_period_days, increment_days, store) != 0)
+        return 0;
+
+    /* samples are never merged, since a merged sample could span the
+       samples already added and those which are new */
+    detect_bin_series(timestamp, series, series_length, min_period_days,
+                      0, &binned);
+    binned.accumulators = store;
+    phase_coverage_init(binned.timestamp, binned.length, min_period_days,
+                        detect_curve_length, &coverage);
+    keep = detect_prescreen(timestamp, series, series_length,
+                            min_period_days, increment_days, steps);
+
+    period_days = detect_grid(&binned, &coverage, keep, NULL, params,
+                              min_period_days, increment_days, steps,
+                              &max_response);
+    phase_coverage_free(&coverage);
+    detect_bin_free(&binned);
+    free(keep);
+    return period_days;
+}
+
+/* state of a search which refines its grid of trial periods until its
+   time runs out */
+struct detect_anytime {
+    struct binned_series * binned;
+    struct phase_coverage * coverage;
+    unsigned char * keep;
+    struct fold_store * store;
+    struct detect_params * params;
+    float min_period_days;
+    float increment_days;
+    int steps;
+
+    /* non-zero for each trial period already scored */
+    unsigned char * done;
+    int evaluated;
+
+    /* trial periods waiting to be scored together */
+    int batch[DETECT_CHUNK_STEPS];
+    float batch_response[DETECT_CHUNK_STEPS];
+    int batch_length;
+
+    /* best responses found so far, each from a separate peak, best first */
+    float candidate_response[DETECT_ANYTIME_CANDIDATES];
+    int candidate_step[DETECT_ANYTIME_CANDIDATES];
+
+    double deadline;
+    int expired;
+};
+
+/**
+ * @brief Adds a scored trial period to the best candidates. A trial
+ *        period close to an existing candidate is part of the same peak
+ *        and only replaces it if better. Ties go to the longest period.
+ * @param search The search
+ * @param step Index of the trial period
+ * @param response Its response
+ */
+static void detect_anytime_candidate(struct detect_anytime * search,
+                                     int step, float response)
+{
+    int i, slot = DETECT_ANYTIME_CANDIDATES-1;
+
+    if (response <= 0) return;
+
+    for (i = 0; i < DETECT_ANYTIME_CANDIDATES; i++) {
+        if (search->candidate_response[i] <= 0) continue;
+        if (abs(search->candidate_step[i] - step) > DETECT_ANYTIME_WINDOW)
             continue;
+        slot = i;
+        break;
+    }
+    if ((response < search->candidate_response[slot]) ||
+        ((response == search->candidate_response[slot]) &&
+         (step < search->candidate_step[slot])))
+        return;
+
+    /* move better candidates up, keeping the order */
+    while ((slot > 0) &&
+           ((response > search->candidate_response[slot-1]) ||
+            ((response == search->candidate_response[slot-1]) &&
+             (step > search->candidate_step[slot-1])))) {
+        search->candidate_response[slot] = search->candidate_response[slot-1];
+        search->candidate_step[slot] = search->candidate_step[slot-1];
+        slot--;
+    }
+    search->candidate_response[slot] = response;
+    search->candidate_step[slot] = step;
+}
+
+/**
+ * @brief Scores the trial periods waiting within the batch in parallel
+ * @param search The search
+ */
+static void detect_anytime_flush(struct detect_anytime * search)
+{
+    int i;
+
+    if (search->batch_length == 0) return;
+
+#pragma omp parallel for schedule(dynamic, 16)
+    for (i = 0; i < search->batch_length; i++) {
+        float value;
+        search->batch_response[i] =
+            detect_trial(search->binned, search->coverage, search->keep,
+                         search->store, search->params,
+                         search->min_period_days, search->increment_days,
+                         search->batch[i], &value, NULL);
+    }
+
+    for (i = 0; i < search->batch_length; i++)
+        detect_anytime_candidate(search, search->batch[i],
+                                 search->batch_response[i]);
+    search->evaluated += search->batch_length;
+    search->batch_length = 0;
+    if (omp_get_wtime() >= search->deadline) search->expired = 1;
+}
+
+/**
+ * @brief Adds a trial period to the batch to be scored, unless it has
+ *        already been scored
+ * @param search The search
+ * @param step Index of the trial period
+ */
+static void detect_anytime_add(struct detect_anytime * search, int step)
+{
+    if ((step < 0) || (step >= search->steps) || search->done[step]) return;
+    if (search->expired) return;
+
+    search->done[step] = 1;
+    search->batch[search->batch_length++] = step;
+    if (search->batch_length == DETECT_CHUNK_STEPS)
+        detect_anytime_flush(search);
+}
+
+/**
+ * @brief Searches for the orbital period within a time budget. A sparse,
+ *        evenly spread subset of the trial periods is scored first, and
+ *        then the spacing is halved repeatedly until every trial period
+ *        has been scored. After each pass the trial periods around the
+ *        best candidates so far are scored at full resolution, so that
+ *        narrow peaks are found early. When time runs out the best
+ *        period so far is returned. Given enough time the result is the
+ *        same as that of detect_orbital_period.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @param budget_seconds Seconds within which to search
+ * @param max_response Returned response at the best period
+ * @param grid_coverage Returned fraction of the trial periods scored
+ * @returns The best candidate orbital period, or zero if no transit found
+ */
+float detect_orbital_period_anytime(float timestamp[],
+                                    float series[], int series_length,
+                                    float min_period_days,
+                                    float max_period_days,
+                                    float increment_days,
+                                    struct detect_params * params,
+                                    struct fold_store * store,
+                                    float budget_seconds,
+                                    float * max_response,
+                                    float * grid_coverage)
+{
+    int i, c, stride, step;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    float period_days = 0;
+    struct phase_coverage coverage;
+    struct binned_series binned;
+    struct detect_anytime * search;
+
+    *max_response = 0;
+    *grid_coverage = 0;
+    if (steps > MAX_SEARCH_STEPS) {
+        printf("Maximum number of time steps exceeded\n");
+        return 0;
+    }
+    if (steps < 1) return 0;
+
+    search = (struct detect_anytime*)calloc(1, sizeof(struct detect_anytime));
+    if (search == NULL) return 0;
+    search->done = (unsigned char*)calloc(steps, sizeof(unsigned char));
+    if (search->done == NULL) {
+        free(search);
+        return 0;
+    }
+    search->deadline = omp_get_wtime() + budget_seconds;
+
+    detect_bin_series(timestamp, series, series_length, min_period_days,
+                      detect_bin_fraction, &binned);
+    phase_coverage_init(binned.timestamp, binned.length, min_period_days,
+                        detect_curve_length, &coverage);
+    search->binned = &binned;
+    search->coverage = &coverage;
+    search->keep = detect_prescreen(timestamp, series, series_length,
+                                    min_period_days, increment_days, steps);
+    search->store = store;
+    search->params = params;
+    search->min_period_days = min_period_days;
+    search->increment_days = increment_days;
+    search->steps = steps;
+
+    /* the spacing of the first pass */
+    stride = 1;
+    while (stride*2 <= steps / DETECT_ANYTIME_FIRST_PASS) stride *= 2;
+
+    for (; (stride >= 1) && (!search->expired); stride /= 2) {
+        for (step = 0; step < steps; step += stride)
+            detect_anytime_add(search, step);
+        detect_anytime_flush(search);
+
+        /* look closely around the best candidates so far */
+        for (c = 0; c < DETECT_ANYTIME_CANDIDATES; c++) {
+            if (search->candidate_response[c] <= 0) continue;
+            step = search->candidate_step[c];
+            for (i = 1; (i <= stride) && (i <= DETECT_ANYTIME_WINDOW); i++) {
+                detect_anytime_add(search, step - i);
+                detect_anytime_add(search, step + i);
+            }
         }
+        detect_anytime_flush(search);
+    }
 
-        /* dipped area should not be too wide */
-        if (end_index - start_index > (int)(DETECT_CURVE_LENGTH*10/100)) {
-            response[step] = 0;
-            continue;
+    if (search->candidate_response[0] > 0) {
+        *max_response = search->candidate_response[0];
+        period_days = min_period_days +
+            (search->candidate_step[0]*increment_days);
+    }
+    *grid_coverage = search->evaluated / (float)steps;
+
+    phase_coverage_free(&coverage);
+    detect_bin_free(&binned);
+    free(search->keep);
+    free(search->done);
+    free(search);
+    return period_days;
+}
+
+/**
+ * @brief Searches for the orbital period with many sets of detection
+ *        thresholds at once. Each trial period is folded only once,
+ *        since the light curve does not depend upon the thresholds,
+ *        and then scored for every set.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param sets Array of detection thresholds
+ * @param no_of_sets Number of sets of detection thresholds
+ * @param period_days Returned best candidate orbital period for each set,
+ *        or zero if no transit was found with that set
+ * @param store Fold store opened for the same series and search grid,
+ *        or NULL
+ * @returns zero on success
+ */
+int detect_orbital_period_sweep(float timestamp[],
+                                float series[], int series_length,
+                                float min_period_days,
+                                float max_period_days,
+                                float increment_days,
+                                struct detect_params sets[], int no_of_sets,
+                                float period_days[],
+                                struct fold_store * store)
+{
+    int chunk, s;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    int chunks = (steps + DETECT_CHUNK_STEPS - 1) / DETECT_CHUNK_STEPS;
+    float * chunk_response;
+    int * chunk_step;
+    struct phase_coverage coverage;
+    struct binned_series binned;
+    unsigned char * keep;
+
+    memset(period_days, 0, no_of_sets*sizeof(float));
+    if (steps > MAX_SEARCH_STEPS) {
+        printf("Maximum number of time steps exceeded\n");
+        return -1;
+    }
+    if (chunks < 1) return 0;
+    detect_bin_series(timestamp, series, series_length, min_period_days,
+                      detect_bin_fraction, &binned);
+    phase_coverage_init(binned.timestamp, binned.length, min_period_days,
+                        detect_curve_length, &coverage);
+    keep = detect_prescreen(timestamp, series, series_length,
+                            min_period_days, increment_days, steps);
+
+    /* best response within each chunk for each set */
+    chunk_response = (float*)calloc(chunks*no_of_sets, sizeof(float));
+    chunk_step = (int*)calloc(chunks*no_of_sets, sizeof(int));
+    if ((chunk_response == NULL) || (chunk_step == NULL)) {
+        free(chunk_response);
+        free(chunk_step);
+        phase_coverage_free(&coverage);
+        detect_bin_free(&binned);
+        free(keep);
+        return -2;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (chunk = 0; chunk < chunks; chunk++) {
+        double chunk_start = trace_begin();
+        int last_step = (chunk+1)*DETECT_CHUNK_STEPS;
+        if (last_step > steps) last_step = steps;
+
+        for (int step = chunk*DETECT_CHUNK_STEPS; step < last_step; step++) {
+            struct fold_record working, * fold;
+            int have_vacancy;
+            float orbital_period_days =
+                min_period_days + (step*increment_days);
+
+            if ((keep != NULL) && (!keep[step])) continue;
+
+            fold = detect_fold(&binned,
+                               orbital_period_days, step, &coverage,
+                               store, &working, &have_vacancy);
+            if (fold->gate != PROFILE_GATE_SCORED) continue;
+
+            for (int set = 0; set < no_of_sets; set++) {
+                int start_index, end_index, gate;
+                int index = chunk*no_of_sets + set;
+                float response =
+                    detect_score(fold->curve, fold->density, &sets[set],
+                                 &start_index, &end_index, &gate);
+                if (gate != PROFILE_GATE_SCORED) continue;
+
+                /* the vacancy counts are the same for every set,
+                   so are only found once */
+                if (!have_vacancy) {
+                    detect_vacancy_table(&binned, orbital_period_days,
+                                         fold);
+                    have_vacancy = 1;
+                }
+                response =
+                    detect_vacancy_response(response,
+                                            dip_vacancy(start_index,
+                                                        end_index,
+                                                        fold),
+                                            &sets[set], &gate);
+                if ((response > 0) && (response >= chunk_response[index])) {
+                    chunk_response[index] = response;
+                    chunk_step[index] = step;
+                }
+            }
         }
+        trace_end("sweep chunk", "search", chunk_start, chunk, NULL);
+    }
+
+    for (s = 0; s < no_of_sets; s++) {
+        period_days[s] =
+            detect_best_period(&chunk_response[s], &chunk_step[s],
+                               chunks, no_of_sets,
+                               min_period_days, increment_days, NULL,
+                               NULL);
+    }
+
+    free(chunk_response);
+    free(chunk_step);
+    phase_coverage_free(&coverage);
+    detect_bin_free(&binned);
+    free(keep);
+    return 0;
+}
+
+/**
+ * @brief Finds the period at which the phase dispersion is smallest,
+ *        over the same grid of trial periods and in the same parallel
+ *        loop as detect_orbital_period. Unlike the transit search this
+ *        makes no assumption about the shape of the light curve.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum period in days
+ * @param max_period_days The maximum period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param bin_counts Numbers of phase bins, each dividing
+ *        detect_curve_length, over which theta is averaged
+ * @param no_of_bin_counts Number of entries within bin_counts
+ * @param min_theta Returned theta at the best period
+ * @returns The best period, or zero if none had theta below one
+ */
+float detect_pdm_period(float timestamp[],
+                        float series[], int series_length,
+                        float min_period_days,
+                        float max_period_days,
+                        float increment_days,
+                        int bin_counts[], int no_of_bin_counts,
+                        float * min_theta)
+{
+    struct detect_dispersion dispersion;
+    float max_response;
+
+    *min_theta = 1;
+    if ((series_length < 2) || (no_of_bin_counts < 1) ||
+        (no_of_bin_counts > PDM_MAX_BIN_COUNTS))
+        return 0;
+
+    memcpy(dispersion.bin_counts, bin_counts, no_of_bin_counts*sizeof(int));
+    dispersion.no_of_bin_counts = no_of_bin_counts;
+    detect_orbital_period_dispersion(timestamp, series, series_length,
+                                     min_period_days, max_period_days,
+                                     increment_days, NULL, NULL,
+                                     &max_response, &dispersion);
+    *min_theta = dispersion.min_theta;
+    return dispersion.period_days;
+}
 
-        /* we only expect a small percentage
-           of the curve to be dipped */
-        if (dipped > max_dipped) {
-            dipped = 0;
+/**
+ * @brief As detect_pdm_period, but with the sums within each bucket
+ *        taken from an accumulator store. Samples which were not in the
+ *        store are added to it first.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param bin_counts Numbers of phase bins, each dividing the curve length
+ * @param no_of_bin_counts Number of entries within bin_counts
+ * @param store Accumulators opened for the same series and search grid
+ * @param min_theta Returned theta at the best period
+ * @returns The best candidate orbital period, or zero if none was found
+ */
+float detect_pdm_period_incremental(float timestamp[],
+                                    float series[], int series_length,
+                                    float min_period_days,
+                                    float max_period_days,
+                                    float increment_days,
+                                    int bin_counts[], int no_of_bin_counts,
+                                    struct accumulator_store * store,
+                                    float * min_theta)
+{
+    float period_days, av;
+    double total_variance = 0;
+    int i, chunk;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    int chunks = (steps + DETECT_CHUNK_STEPS - 1) / DETECT_CHUNK_STEPS;
+    float * chunk_response;
+    int * chunk_step;
+
+    *min_theta = 1;
+    if ((chunks < 1) || (steps != store->steps) || (series_length < 2) ||
+        (no_of_bin_counts < 1))
+        return 0;
+    if (detect_accumulate(timestamp, series, series_length,
+                          min_period_days, increment_days, store) != 0)
+        return 0;
+
+    chunk_response = (float*)calloc(chunks, sizeof(float));
+    chunk_step = (int*)calloc(chunks, sizeof(int));
+    if ((chunk_response == NULL) || (chunk_step == NULL)) {
+        free(chunk_response);
+        free(chunk_step);
+        return 0;
+    }
+    av = detect_av(series, series_length);
+    for (i = 0; i < series_length; i++)
+        total_variance += (series[i] - av)*(series[i] - av);
+    total_variance /= (series_length - 1);
+
+    /* the variance within each bin does not depend upon the average,
+       so the sums of the magnitudes themselves may be used */
+#pragma omp parallel for schedule(dynamic)
+    for (chunk = 0; chunk < chunks; chunk++) {
+        double chunk_start = trace_begin();
+        int first_step = chunk*DETECT_CHUNK_STEPS;
+        int last_step = (chunk+1)*DETECT_CHUNK_STEPS;
+        float values[DETECT_CHUNK_STEPS];
+        if (last_step > steps) last_step = steps;
+
+        for (int step = first_step; step < last_step; step++) {
+            struct accumulator_record * record = &store->records[step];
+            float response;
+
+            response = 1.0f - pdm_theta(record->count, record->sum,
+                                        record->sum_squared,
+                                        DETECT_CURVE_LENGTH,
+                                        total_variance,
+                                        bin_counts, no_of_bin_counts);
+            if (response < 0) response = 0;
+            values[step - first_step] = response;
+
+            if ((response > 0) && (response >= chunk_response[chunk])) {
+                chunk_response[chunk] = response;
+                chunk_step[chunk] = step;
+            }
         }
-        if (dipped == 0) {
-            response[step] = 0;
-            continue;
+        periodogram_add(first_step, values, last_step - first_step);
+        trace_end("pdm chunk", "search", chunk_start, chunk, NULL);
+    }
+
+    period_days = detect_best_period(chunk_response, chunk_step, chunks, 1,
+                                     min_period_days, increment_days, NULL,
+                                     NULL);
+    for (chunk = 0; chunk < chunks; chunk++) {
+        if (1.0f - chunk_response[chunk] < *min_theta)
+            *min_theta = 1.0f - chunk_response[chunk];
+    }
+    free(chunk_response);
+    free(chunk_step);
+    return period_days;
+}
+
+/**
+ * @brief Folds a group of stars which share the same imaging times in
+ *        a single pass over the samples, finding the density of samples
+ *        in the same way as light_curve_base and the sums used by
+ *        light_curve_resample. The bucket of each sample is found once
+ *        from the shared times, and the values for the stars of each
+ *        sample are held next to each other so that they are added
+ *        together, giving sums for star s within bucket b at
+ *        [b*stars + s].
+ * @param index Bucket of each shared sample
+ * @param series Magnitudes, star-minor
+ * @param weight One where a star has a sample at a shared time, zero
+ *        otherwise, star-minor
+ * @param clipped_weight Weight of each sample within the range used
+ *        when resampling, star-minor
+ * @param series_length Number of shared samples
+ * @param stars Number of stars
+ * @param density Returned densities, star-minor
+ * @param curve Returned sums of the magnitudes within range, star-minor
+ * @param hits Returned weights of those sums, star-minor
+ * @param curve_length The number of buckets within the curve
+ */
+static void light_curve_batch(int index[],
+                              float series[], float weight[],
+                              float clipped_weight[],
+                              int series_length, int stars,
+                              float density[], float curve[], float hits[],
+                              int curve_length)
+{
+    int i, s, centre, prev, next;
+    float * w, * c, * x, q;
+
+    memset(density,0,curve_length*stars*sizeof(float));
+    memset(curve,0,curve_length*stars*sizeof(float));
+    memset(hits,0,curve_length*stars*sizeof(float));
+
+    for (i = series_length-1; i >= 0; i--) {
+        prev = index[i] - 1;
+        if (prev < 0) prev += curve_length;
+        next = index[i] + 1;
+        if (next >= curve_length) next -= curve_length;
+        centre = index[i]*stars;
+        prev *= stars;
+        next *= stars;
+
+        w = &weight[i*stars];
+        c = &clipped_weight[i*stars];
+        x = &series[i*stars];
+        for (s = 0; s < stars; s++) {
+            density[centre + s] += w[s]*2;
+            density[prev + s] += w[s];
+            density[next + s] += w[s];
+
+            /* samples outside of the range have zero weight */
+            q = x[s]*c[s];
+            curve[centre + s] += q*2;
+            hits[centre + s] += c[s]*2;
+            curve[prev + s] += q;
+            hits[prev + s] += c[s];
+            curve[next + s] += q;
+            hits[next + s] += c[s];
         }
-        dipped_density /= (float)dipped;
-        if (dipped_density < min_dipped_density) {
-            response[step] = 0;
-            continue;
+    }
+}
+
+/**
+ * @brief Finishes the light curve of one star of a group from the sums
+ *        of light_curve_batch, in the same way as light_curve_weighted
+ * @param density Densities, star-minor
+ * @param curve Sums of the magnitudes within range, star-minor
+ * @param hits Weights of those sums, star-minor
+ * @param stars Number of stars
+ * @param star Index of the star within the group
+ * @param fold Returned light curve and density of the star
+ * @returns zero on success
+ */
+static int light_curve_batch_star(float density[], float curve[],
+                                  float hits[], int stars, int star,
+                                  struct fold_record * fold)
+{
+    int curve_length = detect_curve_length;
+    int i;
+    float max_samples = 0;
+
+    for (i = curve_length-1; i >= 0; i--) {
+        fold->density[i] = density[i*stars + star];
+        if (fold->density[i] > max_samples) max_samples = fold->density[i];
+    }
+    for (i = curve_length-1; i >= 0; i--)
+        fold->density[i] /= max_samples;
+
+    if (missing_data(fold->density, curve_length)*100/
+        curve_length > MISSING_THRESHOLD)
+        return -1;
+
+    for (i = curve_length-1; i >= 0; i--) {
+        fold->curve[i] = curve[i*stars + star];
+        if (fold->curve[i] > 0) fold->curve[i] /= hits[i*stars + star];
+    }
+
+    /* fill any holes */
+    fold->curve[0] = fold->curve[curve_length-1];
+    for (i = 1; i < curve_length; i++) {
+        if (fold->curve[i] != 0) continue;
+        fold->curve[i] = fold->curve[i-1];
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the magnitude above which samples are counted by
+ *        dip_vacancy_table, for a light curve
+ * @param curve Light curve Array
+ * @param curve_length The number of buckets within the curve
+ * @returns Minimum magnitude
+ */
+static float dip_vacancy_threshold(float curve[], int curve_length)
+{
+    int i;
+    float curve_average_mag = 0, curve_variance = 0;
+
+    for (i = curve_length-1; i >= 0; i--)
+        curve_average_mag += curve[i];
+    curve_average_mag /= (float)curve_length;
+
+    for (i = curve_length-1; i >= 0; i--)
+        curve_variance += (curve[i] - curve_average_mag)*
+            (curve[i] - curve_average_mag);
+    curve_variance = (float)sqrt(curve_variance / (float)curve_length);
+    return curve_average_mag - (curve_variance*2.0f);
+}
+
+/**
+ * @brief Counts the samples of a group of stars within each bucket, in
+ *        the same way as dip_vacancy_table, in a single pass over the
+ *        samples. Counts for star s within bucket b are at [b*stars + s].
+ * @param index Bucket of each shared sample
+ * @param series Magnitudes, star-minor
+ * @param weight Presence of each sample, star-minor
+ * @param series_length Number of shared samples
+ * @param stars Number of stars
+ * @param min_curve_mag Magnitude of each star above which samples
+ *        are counted
+ * @param den Returned number of samples, star-minor
+ * @param above Returned number of samples above min_curve_mag,
+ *        star-minor
+ * @param curve_length The number of buckets within the curve
+ */
+static void dip_vacancy_table_batch(int index[],
+                                    float series[], float weight[],
+                                    int series_length, int stars,
+                                    float min_curve_mag[],
+                                    float den[], float above[],
+                                    int curve_length)
+{
+    int i, s, centre;
+    float * w, * x;
+
+    memset(den,0,curve_length*stars*sizeof(float));
+    memset(above,0,curve_length*stars*sizeof(float));
+
+    for (i = series_length-1; i >= 0; i--) {
+        centre = index[i]*stars;
+        w = &weight[i*stars];
+        x = &series[i*stars];
+        for (s = 0; s < stars; s++) {
+            den[centre + s] += w[s];
+            if (x[s] > min_curve_mag[s]) above[centre + s] += w[s];
         }
+    }
+}
 
-        /* peaks above the av are an indicator that this isn't a transit  */
-        int peaked = 0;
-        float threshold_peaked = av + ((av-minimum)*peak_threshold);
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if (curve[j] > threshold_peaked) {
-                peaked++;
-                break;
-            }
+/**
+ * @brief Searches for the orbital periods of a group of stars which
+ *        were imaged at the same times, such as those within the same
+ *        field of one camera. The bucket of each sample is found once
+ *        per trial period for the whole group rather than once per star.
+ * @param timestamp Shared times for observations
+ * @param series Magnitudes, star-minor, so that the value for star s at
+ *        time i is series[i*stars + s]
+ * @param weight One where a star has a sample at a shared time and zero
+ *        otherwise, star-minor
+ * @param series_length Number of shared times
+ * @param stars Number of stars, at most BATCH_MAX_STARS
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @param period_days Returned best candidate orbital period for each
+ *        star, or zero if no transit was found
+ * @returns zero on success
+ */
+int detect_orbital_period_batch(float timestamp[],
+                                float series[], float weight[],
+                                int series_length, int stars,
+                                float min_period_days,
+                                float max_period_days,
+                                float increment_days,
+                                struct detect_params * params,
+                                float period_days[])
+{
+    int i, s, chunk, failed = 0;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    int chunks = (steps + DETECT_CHUNK_STEPS - 1) / DETECT_CHUNK_STEPS;
+    float * chunk_response, * clipped_weight;
+    int * chunk_step;
+    double sum, variance, total;
+    float av, deviation;
+
+    memset(period_days, 0, stars*sizeof(float));
+    if ((stars < 1) || (stars > BATCH_MAX_STARS)) return -1;
+    if (steps > MAX_SEARCH_STEPS) {
+        printf("Maximum number of time steps exceeded\n");
+        return -2;
+    }
+    if (chunks < 1) return 0;
+
+    chunk_response = (float*)calloc(chunks*stars, sizeof(float));
+    chunk_step = (int*)calloc(chunks*stars, sizeof(int));
+    clipped_weight = (float*)malloc(series_length*stars*sizeof(float));
+    if ((chunk_response == NULL) || (chunk_step == NULL) ||
+        (clipped_weight == NULL)) {
+        free(chunk_response);
+        free(chunk_step);
+        free(clipped_weight);
+        return -3;
+    }
+
+    /* the range of magnitudes used when resampling does not depend
+       upon the period, so samples of each star outside of it are
+       given zero weight once here */
+    for (s = 0; s < stars; s++) {
+        sum = 0;
+        variance = 0;
+        total = 0;
+        for (i = series_length-1; i >= 0; i--) {
+            if (weight[i*stars + s] == 0) continue;
+            sum += series[i*stars + s];
+            total++;
         }
-        if (peaked > 0) {
-            response[step] = 0;
-            continue;
+        if (total < 1) total = 1;
+        av = (float)(sum/total);
+        for (i = series_length-1; i >= 0; i--) {
+            if (weight[i*stars + s] == 0) continue;
+            variance += (series[i*stars + s] - av)*(series[i*stars + s] - av);
         }
-
-        /* How much difference from the av? */
-        int nondipped = 0;
-        float threshold_upper = av - ((av-minimum)*0.2);
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if ((curve[j] < threshold_upper) &&
-                (curve[j] > threshold_dipped)) {
-                nondipped++;
-                if (nondipped > max_intermediates) {
-                    break;
-                }
-            }
+        deviation = (float)sqrt(variance/total);
+        for (i = 0; i < series_length; i++) {
+            clipped_weight[i*stars + s] = weight[i*stars + s];
+            if ((series[i*stars + s] < av - deviation) ||
+                (series[i*stars + s] > av + deviation))
+                clipped_weight[i*stars + s] = 0;
         }
-        if ((nondipped < min_intermediates) ||
-            (nondipped > max_intermediates)) {
-            response[step] = 0;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (chunk = 0; chunk < chunks; chunk++) {
+        double chunk_start = trace_begin();
+        int last_step = (chunk+1)*DETECT_CHUNK_STEPS;
+        int buckets = detect_curve_length*stars;
+        int * index, stop;
+        float * sums;
+        if (last_step > steps) last_step = steps;
+
+        /* no more chunks are searched once one has failed */
+#pragma omp atomic read
+        stop = failed;
+        if (stop) continue;
+
+        /* buckets of the shared samples, then the density, curve and
+           hits of every star, reused as the vacancy counts */
+        index = (int*)malloc(series_length*sizeof(int));
+        sums = (float*)malloc(buckets*3*sizeof(float));
+        if ((index == NULL) || (sums == NULL)) {
+            free(index);
+            free(sums);
+#pragma omp atomic write
+            failed = 1;
             continue;
         }
 
-        /* variance of the averaged light curve from average */
-        float variance_value = 0;
-        float variance_min = 0;
-        float variance_max = 0;
-        float variance_diff = 1.0f;
-        hits = 0;
-        for (int j = DETECT_CURVE_LENGTH-1; j >= 0; j--) {
-            if (curve[j] <= 0) continue;
-            variance_value = (curve[j] - av)*(curve[j] - av);
-            if (variance_value > 0) {
-                if (variance_min != 0) {
-                    if (variance_value < variance_min)
-                        variance_min = variance_value;
+        perf_begin();
+        for (int step = chunk*DETECT_CHUNK_STEPS; step < last_step; step++) {
+            float orbital_period_days =
+                min_period_days + (step*increment_days);
+            float mult = (float)detect_curve_length / orbital_period_days;
+            struct fold_record fold;
+            float response[BATCH_MAX_STARS];
+            float min_curve_mag[BATCH_MAX_STARS];
+            int start_index[BATCH_MAX_STARS], end_index[BATCH_MAX_STARS];
+            int gate, scored = 0;
+
+            for (int j = series_length-1; j >= 0; j--)
+                index[j] = (int)(fmod(timestamp[j] * DAY_SECONDS,
+                                      orbital_period_days) * mult);
+
+            light_curve_batch(index, series, weight, clipped_weight,
+                              series_length, stars, sums, &sums[buckets],
+                              &sums[buckets*2], detect_curve_length);
+
+            /* the sums for resampling are found within the fold, and
+               the curves are finished while scoring */
+            perf_mark(PERF_SECTION_FOLD);
+
+            for (int star = 0; star < stars; star++) {
+                response[star] = 0;
+                min_curve_mag[star] = 0;
+                start_index[star] = -1;
+                if (light_curve_batch_star(sums, &sums[buckets],
+                                           &sums[buckets*2], stars, star,
+                                           &fold) != 0) {
+                    profile_gate(PROFILE_GATE_MISSING_DATA);
+                    continue;
                 }
-                else
-                    variance_min = variance_value;
-                if (variance_max != 0) {
-                    if (variance_value > variance_max)
-                        variance_max = variance_value;
+                response[star] = detect_score(fold.curve, fold.density,
+                                              params, &start_index[star],
+                                              &end_index[star], &gate);
+                if (gate != PROFILE_GATE_SCORED) {
+                    profile_gate(gate);
+                    start_index[star] = -1;
+                    continue;
                 }
-                else
-                    variance_max = variance_value;
-            }
-            hits++;
-        }
 
-        response[step] = 0;
-        if ((hits > 0) && (variance_max > variance_min)) {
-            density_variance = 1.0f + density_variance;
-            variance_diff = 1.0f + (variance_max - variance_min);
-
-            response[step] =
-                (av-minimum)*(float)dipped*100.0f/(av*(float)(1+nondipped));
-            response[step] /= (density_variance*variance_diff);
-
-            /* check the density within the area of the dip which
-               is expected to be vacant */
-            float vacancy_density =
-                dip_vacancy(start_index, end_index,
-                            timestamp,
-                            series, series_length,
-                            orbital_period_days,
-                            curve,
-                            DETECT_CURVE_LENGTH);
-            if (vacancy_density > max_vacancy_density) {
-                response[step] = 0;
+                /* the dip is checked for vacancy once every star
+                   has been scored */
+                min_curve_mag[star] =
+                    dip_vacancy_threshold(fold.curve, detect_curve_length);
+                scored++;
             }
-            else {
-                response[step] /= (1.0f + (vacancy_density*10));
+
+            if (scored > 0)
+                dip_vacancy_table_batch(index, series, weight,
+                                        series_length, stars,
+                                        min_curve_mag, sums, &sums[buckets],
+                                        detect_curve_length);
+
+            for (int star = 0; star < stars; star++) {
+                if (start_index[star] >= 0) {
+                    fold.max_samples = 0;
+                    for (int b = detect_curve_length-1; b >= 0; b--) {
+                        fold.above[b] = sums[buckets + b*stars + star];
+                        if (sums[b*stars + star] > fold.max_samples)
+                            fold.max_samples = sums[b*stars + star];
+                    }
+                    response[star] =
+                        detect_vacancy_response(response[star],
+                                                dip_vacancy(start_index[star],
+                                                            end_index[star],
+                                                            &fold),
+                                                params, &gate);
+                    profile_gate(gate);
+                }
+                if ((response[star] > 0) &&
+                    (response[star] >= chunk_response[chunk*stars + star])) {
+                    chunk_response[chunk*stars + star] = response[star];
+                    chunk_step[chunk*stars + star] = step;
+                }
             }
+            perf_mark(PERF_SECTION_SCORE);
         }
+        perf_end(PERF_SECTION_SCORE);
+        free(index);
+        free(sums);
+        trace_end("batch chunk", "search", chunk_start, chunk, NULL);
     }
 
-    for (int i = steps-1; i >= 0; i--) {
-        if (response[i] <= max_response) continue;
-        max_response = response[i];
-        period_days = min_period_days + (i*increment_days);
+    if (failed) {
+        free(chunk_response);
+        free(chunk_step);
+        free(clipped_weight);
+        return -4;
     }
 
-    return period_days;
+    for (s = 0; s < stars; s++) {
+        period_days[s] =
+            detect_best_period(&chunk_response[s], &chunk_step[s],
+                               chunks, stars,
+                               min_period_days, increment_days, NULL,
+                               NULL);
+    }
+
+    free(chunk_response);
+    free(chunk_step);
+    free(clipped_weight);
+    return 0;
 }
@@ -0,0 +1,681 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Spreads a search over many machines. A coordinator splits every star
+   listed within a manifest into work units, each being a range of the
+   trial periods of one star, and workers connect to it over TCP to be
+   given units and to return their results. Each exchange is a single
+   line sent by the worker and a single line in reply, on a connection
+   of its own, so a worker which dies holds nothing open.
+
+       REQUEST               UNIT <id> <lease> <min> <max> <incr>
+                                  <minsamples> <time field> <flux field>
+                                  <8 thresholds> <buckets> <bin>
+                                  <prescreen> <compact> <filename>
+                             or WAIT <seconds>, or DONE
+       HEARTBEAT <id>        OK, or DONE if the unit is already done
+       RESULT <id> <period> <response>
+                             OK
+
+   A unit is leased to a worker for a number of seconds, and the worker
+   renews the lease with heartbeats while it searches. If the lease runs
+   out the unit is given to the next worker to ask. Once no units are
+   left to hand out, idle workers are given a second copy of the unit
+   leased the longest ago, so that fast workers are not left waiting on
+   a slow one, and whichever copy finishes first is kept. A worker whose
+   heartbeat is answered with DONE sends no result for its copy. */
+
+#include "waspscan.h"
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/* longest line exchanged between a worker and the coordinator */
+#define DISTRIBUTE_LINE_LENGTH  (MAX_FILENAME_LENGTH + 512)
+
+/* seconds to wait for a line before giving up on a connection */
+#define DISTRIBUTE_IO_TIMEOUT   5
+
+/* attempts made by a worker to reach the coordinator, a second apart */
+#define DISTRIBUTE_RETRIES      10
+
+/* most copies of a unit which may be leased at once */
+#define DISTRIBUTE_MAX_COPIES   2
+
+/* states of a work unit */
+#define UNIT_PENDING  0
+#define UNIT_LEASED   1
+#define UNIT_DONE     2
+
+struct work_unit {
+    int star;
+    int first_step;
+    int steps;
+    int state;
+    int copies;
+    time_t issued;
+    time_t expires;
+    float period_days;
+    float response;
+};
+
+struct heartbeat {
+    char * host;
+    int port;
+    int unit;
+    int interval;
+    int stop;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/**
+ * @brief Sets the time after which reads and writes on a connection fail
+ * @param sock The connection
+ */
+static void distribute_timeout(int sock)
+{
+    struct timeval timeout;
+
+    timeout.tv_sec = DISTRIBUTE_IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief Reads one line from a connection
+ * @param sock The connection
+ * @param linestr Returned line, without its newline
+ * @param max_length Size of the line buffer
+ * @returns Length of the line, or -1 if no complete line arrived
+ */
+static int distribute_read_line(int sock, char * linestr, int max_length)
+{
+    int len = 0;
+    ssize_t got;
+    char c;
+
+    while (len < max_length-1) {
+        got = recv(sock, &c, 1, 0);
+        if (got <= 0) return -1;
+        if (c == '\n') {
+            linestr[len] = 0;
+            return len;
+        }
+        if (c != '\r') linestr[len++] = c;
+    }
+    return -1;
+}
+
+/**
+ * @brief Writes a whole line to a connection
+ * @param sock The connection
+ * @param linestr The line, including its newline
+ * @returns zero on success
+ */
+static int distribute_write_line(int sock, char * linestr)
+{
+    int len = strlen(linestr), sent = 0;
+    ssize_t n;
+
+    while (sent < len) {
+        n = send(sock, &linestr[sent], len - sent, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one line to the coordinator and reads its reply
+ * @param host Name or address of the coordinator
+ * @param port Port on which the coordinator listens
+ * @param request The line to be sent, including its newline
+ * @param reply Returned reply
+ * @param max_length Size of the reply buffer
+ * @returns zero on success
+ */
+static int distribute_exchange(char * host, int port, char * request,
+                               char * reply, int max_length)
+{
+    struct addrinfo hints, * addresses, * address;
+    char port_str[16];
+    int sock = -1, retval = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port_str, "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &addresses) != 0) return -1;
+
+    for (address = addresses; address != NULL; address = address->ai_next) {
+        sock = socket(address->ai_family, address->ai_socktype,
+                      address->ai_protocol);
+        if (sock < 0) continue;
+        if (connect(sock, address->ai_addr, address->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    if (sock < 0) return -1;
+
+    distribute_timeout(sock);
+    if ((distribute_write_line(sock, request) == 0) &&
+        (distribute_read_line(sock, reply, max_length) >= 0))
+        retval = 0;
+    close(sock);
+    return retval;
+}
+
+/**
+ * @brief Loads the manifest of stars to be searched
+ * @param manifest_filename File containing one log filename per line
+ * @param no_of_stars Returned number of stars
+ * @returns Log filenames, each MAX_FILENAME_LENGTH long, or NULL
+ */
+static char * distribute_manifest(char * manifest_filename,
+                                  int * no_of_stars)
+{
+    FILE * fp;
+    char linestr[MAX_FILENAME_LENGTH];
+    char * filenames = NULL, * grown;
+    int len, max_stars = 0;
+
+    *no_of_stars = 0;
+    fp = fopen(manifest_filename, "r");
+    if (!fp) return NULL;
+
+    while (fgets(linestr, MAX_FILENAME_LENGTH-1, fp) != NULL) {
+        len = strlen(linestr);
+        while ((len > 0) &&
+               ((linestr[len-1] == '\n') || (linestr[len-1] == '\r') ||
+                (linestr[len-1] == ' ')))
+            linestr[--len] = 0;
+        if ((len == 0) || (linestr[0] == '#')) continue;
+
+        if (*no_of_stars >= max_stars) {
+            max_stars = (max_stars == 0) ? 64 : max_stars*2;
+            grown = (char*)realloc(filenames,
+                                   max_stars*MAX_FILENAME_LENGTH);
+            if (grown == NULL) break;
+            filenames = grown;
+        }
+        sprintf(&filenames[(*no_of_stars)*MAX_FILENAME_LENGTH], "%s",
+                linestr);
+        (*no_of_stars)++;
+    }
+    fclose(fp);
+    return filenames;
+}
+
+/**
+ * @brief Chooses the unit to be given to a worker asking for one.
+ *        Units whose leases have run out are first returned to those
+ *        waiting to be handed out.
+ * @param units Array of work units
+ * @param no_of_units Number of work units
+ * @param now The current time
+ * @param reissued Incremented for each lease which ran out
+ * @returns Index of the unit, -1 if the worker should wait, or -2 if
+ *          every unit is done
+ */
+static int distribute_next_unit(struct work_unit units[], int no_of_units,
+                                time_t now, int * reissued)
+{
+    int u, oldest = -1, done = 0;
+
+    for (u = 0; u < no_of_units; u++) {
+        if ((units[u].state == UNIT_LEASED) && (units[u].expires < now)) {
+            units[u].state = UNIT_PENDING;
+            units[u].copies = 0;
+            (*reissued)++;
+        }
+    }
+
+    for (u = 0; u < no_of_units; u++) {
+        if (units[u].state == UNIT_PENDING) return u;
+        if (units[u].state == UNIT_DONE) {
+            done++;
+            continue;
+        }
+        if (units[u].copies >= DISTRIBUTE_MAX_COPIES) continue;
+        if ((oldest == -1) || (units[u].issued < units[oldest].issued))
+            oldest = u;
+    }
+    if (done == no_of_units) return -2;
+    return oldest;
+}
+
+/**
+ * @brief Prints the orbital period of each star, from whichever of its
+ *        units had the best response. Ties go to the longest period.
+ * @param filenames Log filename of each star, each MAX_FILENAME_LENGTH long
+ * @param no_of_stars Number of stars
+ * @param units Array of work units, with those of each star consecutive
+ * @param ranges Number of units per star
+ */
+static void distribute_report(char * filenames,
+                              int no_of_stars, struct work_unit units[],
+                              int ranges)
+{
+    int s, r;
+    float period_days, max_response;
+    struct work_unit * unit;
+
+    for (s = 0; s < no_of_stars; s++) {
+        period_days = 0;
+        max_response = 0;
+        for (r = ranges-1; r >= 0; r--) {
+            unit = &units[s*ranges + r];
+            if ((unit->period_days == 0) ||
+                (unit->response <= max_response)) continue;
+            max_response = unit->response;
+            period_days = unit->period_days;
+        }
+        if (period_days == 0)
+            printf("%s No transits detected\n",
+                   &filenames[s*MAX_FILENAME_LENGTH]);
+        else
+            printf("%s orbital_period_days %.6f\n",
+                   &filenames[s*MAX_FILENAME_LENGTH], period_days);
+    }
+}
+
+/**
+ * @brief Serves work units for every star within a manifest to workers
+ *        until all have been searched, then prints the orbital period
+ *        of each star
+ * @param manifest_filename File containing one log filename per line
+ * @param port Port on which to listen for workers
+ * @param ranges Number of ranges of the orbital period each star is
+ *        split into
+ * @param lease_seconds Seconds a worker may hold a unit without a
+ *        heartbeat before it is given to another
+ * @param time_field_index Field containing the time
+ * @param flux_field_index Field containing the magnitude
+ * @param minimum_data_samples Stars with fewer samples are not searched
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param params Detection thresholds
+ * @returns zero on success
+ */
+int distribute_serve(char * manifest_filename, int port,
+                     int ranges, int lease_seconds,
+                     int time_field_index, int flux_field_index,
+                     int minimum_data_samples,
+                     float min_period_days, float max_period_days,
+                     float increment_days,
+                     struct detect_params * params)
+{
+    char * filenames;
+    char linestr[DISTRIBUTE_LINE_LENGTH], reply[DISTRIBUTE_LINE_LENGTH];
+    int no_of_stars, no_of_units, steps, s, r, u, sock, client;
+    int remaining, reissued = 0, copies = 0, one = 1;
+    float period_days, response;
+    time_t now, finished = 0;
+    struct work_unit * units;
+    struct sockaddr_in address;
+
+    steps = (int)((max_period_days - min_period_days)/increment_days);
+    if ((steps < 1) || (steps > MAX_SEARCH_STEPS)) {
+        printf("Invalid number of time steps %d\n", steps);
+        return -1;
+    }
+    if (ranges > steps) ranges = steps;
+
+    filenames = distribute_manifest(manifest_filename, &no_of_stars);
+    if ((filenames == NULL) || (no_of_stars == 0)) {
+        printf("Unable to load stars from %s\n", manifest_filename);
+        free(filenames);
+        return -2;
+    }
+
+    /* each star is split into ranges of consecutive trial periods */
+    no_of_units = no_of_stars * ranges;
+    units = (struct work_unit*)calloc(no_of_units, sizeof(struct work_unit));
+    if (units == NULL) {
+        free(filenames);
+        return -3;
+    }
+    for (s = 0; s < no_of_stars; s++) {
+        for (r = 0; r < ranges; r++) {
+            u = s*ranges + r;
+            units[u].star = s;
+            units[u].first_step = (int)((long)steps * r / ranges);
+            units[u].steps =
+                (int)((long)steps * (r+1) / ranges) - units[u].first_step;
+            units[u].state = UNIT_PENDING;
+        }
+    }
+    remaining = no_of_units;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        free(units);
+        free(filenames);
+        return -4;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if ((bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0) ||
+        (listen(sock, 64) != 0)) {
+        printf("Unable to listen on port %d\n", port);
+        close(sock);
+        free(units);
+        free(filenames);
+        return -5;
+    }
+    /* wake periodically so that the coordinator can finish */
+    distribute_timeout(sock);
+    printf("Serving %d work units for %d stars on port %d\n",
+           no_of_units, no_of_stars, port);
+    fflush(stdout);
+
+    /* once everything is done, workers still asking are told so for
+       the length of a lease before the coordinator exits */
+    while ((remaining > 0) || (time(NULL) < finished + lease_seconds)) {
+        client = accept(sock, NULL, NULL);
+        if (client < 0) continue;
+        distribute_timeout(client);
+        if (distribute_read_line(client, linestr,
+                                 DISTRIBUTE_LINE_LENGTH) < 0) {
+            close(client);
+            continue;
+        }
+        now = time(NULL);
+        sprintf(reply, "ERROR\n");
+
+        if (strcmp(linestr, "REQUEST") == 0) {
+            u = distribute_next_unit(units, no_of_units, now, &reissued);
+            if (u == -2) {
+                sprintf(reply, "DONE\n");
+            }
+            else if (u == -1) {
+                sprintf(reply, "WAIT %d\n", 1 + lease_seconds/4);
+            }
+            else {
+                if (units[u].state == UNIT_LEASED) copies++;
+                units[u].state = UNIT_LEASED;
+                units[u].copies++;
+                units[u].issued = now;
+                units[u].expires = now + lease_seconds;
+                snprintf(reply, DISTRIBUTE_LINE_LENGTH,
+                         "UNIT %d %d %.9g %.9g %.9g %d %d %d "
+                         "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g "
+                         "%d %.9g %.9g %d %s\n",
+                         u, lease_seconds,
+                         min_period_days + (units[u].first_step*increment_days),
+                         min_period_days +
+                         ((units[u].first_step + units[u].steps + 0.5f) *
+                          increment_days),
+                         increment_days, minimum_data_samples,
+                         time_field_index, flux_field_index,
+                         params->min_dipped_density,
+                         params->max_dipped_percent,
+                         params->min_intermediate_percent,
+                         params->max_intermediate_percent,
+                         params->expected_dip_radius_percent,
+                         params->peak_threshold,
+                         params->max_vacancy_density,
+                         params->dip_threshold,
+                         detect_curve_length, detect_bin_fraction,
+                         detect_prescreen_fraction, detect_compact,
+                         &filenames[units[u].star*MAX_FILENAME_LENGTH]);
+            }
+        }
+        else if (sscanf(linestr, "HEARTBEAT %d", &u) == 1) {
+            if ((u >= 0) && (u < no_of_units)) {
+                if (units[u].state == UNIT_DONE) {
+                    sprintf(reply, "DONE\n");
+                }
+                else {
+                    /* a unit whose lease ran out is taken back */
+                    if (units[u].state == UNIT_PENDING) {
+                        units[u].state = UNIT_LEASED;
+                        units[u].copies = 1;
+                        units[u].issued = now;
+                    }
+                    units[u].expires = now + lease_seconds;
+                    sprintf(reply, "OK\n");
+                }
+            }
+        }
+        else if (sscanf(linestr, "RESULT %d %f %f",
+                        &u, &period_days, &response) == 3) {
+            if ((u >= 0) && (u < no_of_units)) {
+                /* the first copy to finish is kept */
+                if (units[u].state != UNIT_DONE) {
+                    units[u].state = UNIT_DONE;
+                    units[u].period_days = period_days;
+                    units[u].response = response;
+                    remaining--;
+                    if (remaining == 0) finished = now;
+                }
+                sprintf(reply, "OK\n");
+            }
+        }
+
+        distribute_write_line(client, reply);
+        close(client);
+    }
+    close(sock);
+
+    distribute_report(filenames, no_of_stars, units, ranges);
+    printf("%d stars searched in %d work units, %d reissued, "
+           "%d duplicated\n", no_of_stars, no_of_units, reissued, copies);
+
+    free(units);
+    free(filenames);
+    return 0;
+}
+
+/**
+ * @brief Sends heartbeats for the unit being searched until told to stop
+ * @param arg The heartbeat state
+ */
+static void * distribute_heartbeat(void * arg)
+{
+    struct heartbeat * beat = (struct heartbeat*)arg;
+    char request[64], reply[DISTRIBUTE_LINE_LENGTH];
+    struct timespec wake_time;
+
+    pthread_mutex_lock(&beat->lock);
+    while (!beat->stop) {
+        clock_gettime(CLOCK_REALTIME, &wake_time);
+        wake_time.tv_sec += beat->interval;
+        pthread_cond_timedwait(&beat->wake, &beat->lock, &wake_time);
+        if (beat->stop) break;
+
+        pthread_mutex_unlock(&beat->lock);
+        sprintf(request, "HEARTBEAT %d\n", beat->unit);
+        reply[0] = 0;
+        distribute_exchange(beat->host, beat->port, request,
+                            reply, DISTRIBUTE_LINE_LENGTH);
+        pthread_mutex_lock(&beat->lock);
+
+        /* another copy of the unit has already finished */
+        if (strcmp(reply, "DONE") == 0) {
+            beat->done = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&beat->lock);
+    return NULL;
+}
+
+/**
+ * @brief Searches one work unit
+ * @param unit_str The UNIT line given by the coordinator
+ * @param host Name or address of the coordinator
+ * @param port Port on which the coordinator listens
+ * @param timestamp Buffer for the times of the star
+ * @param series Buffer for the magnitudes of the star
+ * @param result Returned RESULT line
+ * @returns zero on success, or one if another copy of the unit finished
+ *          first and there is no result to send
+ */
+static int distribute_search_unit(char * unit_str, char * host, int port,
+                                  float timestamp[], float series[],
+                                  char * result)
+{
+    int u, lease_seconds, minimum_data_samples, series_length, offset = 0;
+    int time_field_index, flux_field_index, curve_length, compact;
+    float bin_fraction, prescreen_fraction;
+    float min_period_days, max_period_days, increment_days;
+    float period_days = 0, response = 0;
+    struct detect_params params;
+    struct heartbeat beat;
+    pthread_t heartbeat_thread;
+
+    if (sscanf(unit_str, "UNIT %d %d %f %f %f %d %d %d "
+               "%f %f %f %f %f %f %f %f %d %f %f %d %n",
+               &u, &lease_seconds,
+               &min_period_days, &max_period_days, &increment_days,
+               &minimum_data_samples, &time_field_index, &flux_field_index,
+               &params.min_dipped_density, &params.max_dipped_percent,
+               &params.min_intermediate_percent,
+               &params.max_intermediate_percent,
+               &params.expected_dip_radius_percent,
+               &params.peak_threshold, &params.max_vacancy_density,
+               &params.dip_threshold, &curve_length, &bin_fraction,
+               &prescreen_fraction, &compact, &offset) < 20) return -1;
+    if (offset == 0) return -1;
+    if ((curve_length < DETECT_MIN_CURVE_LENGTH) ||
+        (curve_length > DETECT_MAX_CURVE_LENGTH) ||
+        ((curve_length & (curve_length-1)) != 0)) return -1;
+
+    /* the search is made in the same way as by the coordinator */
+    detect_curve_length = curve_length;
+    detect_bin_fraction = bin_fraction;
+    detect_prescreen_fraction = prescreen_fraction;
+    detect_compact = compact;
+
+    beat.host = host;
+    beat.port = port;
+    beat.unit = u;
+    beat.interval = lease_seconds / 4;
+    if (beat.interval < 1) beat.interval = 1;
+    beat.stop = 0;
+    beat.done = 0;
+    pthread_mutex_init(&beat.lock, NULL);
+    pthread_cond_init(&beat.wake, NULL);
+    if (pthread_create(&heartbeat_thread, NULL,
+                       distribute_heartbeat, &beat) != 0) {
+        pthread_mutex_destroy(&beat.lock);
+        pthread_cond_destroy(&beat.wake);
+        return -2;
+    }
+
+    series_length = logfile_load(&unit_str[offset], timestamp, series,
+                                 MAX_SERIES_LENGTH,
+                                 time_field_index, flux_field_index);
+    if (series_length >= minimum_data_samples)
+        period_days =
+            detect_orbital_period_response(timestamp, series, series_length,
+                                           min_period_days, max_period_days,
+                                           increment_days, &params, NULL,
+                                           &response);
+
+    pthread_mutex_lock(&beat.lock);
+    beat.stop = 1;
+    pthread_cond_signal(&beat.wake);
+    pthread_mutex_unlock(&beat.lock);
+    pthread_join(heartbeat_thread, NULL);
+    pthread_mutex_destroy(&beat.lock);
+    pthread_cond_destroy(&beat.wake);
+    if (beat.done) return 1;
+
+    sprintf(result, "RESULT %d %.9g %.9g\n", u, period_days, response);
+    return 0;
+}
+
+/**
+ * @brief Asks a coordinator for work units and searches them until
+ *        there are none left
+ * @param host Name or address of the coordinator
+ * @param port Port on which the coordinator listens
+ * @returns zero once the coordinator has no more units, or non-zero if
+ *          it could not be reached
+ */
+int distribute_work(char * host, int port)
+{
+    char reply[DISTRIBUTE_LINE_LENGTH], result[DISTRIBUTE_LINE_LENGTH];
+    int attempts = 0, wait_seconds, searched = 0, retval;
+    float * timestamp, * series;
+
+    timestamp = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+    series = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+    if ((timestamp == NULL) || (series == NULL)) {
+        free(timestamp);
+        free(series);
+        return -1;
+    }
+
+    for (;;) {
+        if (distribute_exchange(host, port, "REQUEST\n", reply,
+                                DISTRIBUTE_LINE_LENGTH) != 0) {
+            if (++attempts >= DISTRIBUTE_RETRIES) {
+                printf("Unable to reach the coordinator at %s:%d\n",
+                       host, port);
+                free(timestamp);
+                free(series);
+                return -2;
+            }
+            sleep(1);
+            continue;
+        }
+        attempts = 0;
+
+        if (strcmp(reply, "DONE") == 0) break;
+        if (sscanf(reply, "WAIT %d", &wait_seconds) == 1) {
+            sleep(wait_seconds);
+            continue;
+        }
+        retval = distribute_search_unit(reply, host, port, timestamp, series,
+                                        result);
+        if (retval == 1) continue;
+        if (retval != 0) {
+            printf("Unable to search %s\n", reply);
+            continue;
+        }
+
+        /* results are kept until the coordinator has them */
+        while (distribute_exchange(host, port, result, reply,
+                                   DISTRIBUTE_LINE_LENGTH) != 0) {
+            if (++attempts >= DISTRIBUTE_RETRIES) break;
+            sleep(1);
+        }
+        searched++;
+    }
+
+    printf("%d work units searched\n", searched);
+    free(timestamp);
+    free(series);
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A pre-screen which finds the trial periods worth folding from the
+   power spectrum of the series. Transits are short compared to the
+   orbital period, so most of their power lies in the harmonics of the
+   orbital frequency rather than at the frequency itself. Each
+   frequency is therefore ranked by the power summed over its first few
+   harmonics, with the power first divided by the average nearby, so
+   that the slow variations present in most light curves do not
+   dominate. */
+
+#include "waspscan.h"
+
+/* number of harmonics summed for each orbital frequency */
+#define PRESCREEN_HARMONICS    8
+
+/* largest number of points within the evenly sampled series */
+#define PRESCREEN_MAX_POINTS   (1<<21)
+
+/* number of frequencies either side over which the average power
+   is found when normalising */
+#define PRESCREEN_NOISE_RADIUS 64
+
+/**
+ * @brief In place complex fast Fourier transform
+ * @param re Real parts
+ * @param im Imaginary parts
+ * @param n Number of points, which must be a power of two
+ */
+void fft_radix2(double re[], double im[], int n)
+{
+    int i, j, k, len;
+    double angle, wr, wi, cr, ci, tr, ti, t;
+
+    /* reorder by bit reversed index */
+    for (i = 1, j = 0; i < n; i++) {
+        k = n >> 1;
+        while (j & k) {
+            j ^= k;
+            k >>= 1;
+        }
+        j |= k;
+        if (i >= j) continue;
+        t = re[i]; re[i] = re[j]; re[j] = t;
+        t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+
+    for (len = 2; len <= n; len <<= 1) {
+        angle = -2*M_PI/len;
+        wr = cos(angle);
+        wi = sin(angle);
+        for (i = 0; i < n; i += len) {
+            cr = 1;
+            ci = 0;
+            for (j = 0; j < len/2; j++) {
+                k = i + j + len/2;
+                tr = re[k]*cr - im[k]*ci;
+                ti = re[k]*ci + im[k]*cr;
+                re[k] = re[i+j] - tr;
+                im[k] = im[i+j] - ti;
+                re[i+j] += tr;
+                im[i+j] += ti;
+                t = cr*wr - ci*wi;
+                ci = cr*wi + ci*wr;
+                cr = t;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Returns the power spectrum of an evenly sampled series
+ * @param series Evenly sampled values
+ * @param series_length Number of values, which should be a power of two.
+ *        Any values beyond the largest power of two are ignored.
+ * @param freq Returned power at each frequency, having series_length/2
+ *        entries, where entry k is k cycles over the length of the series
+ */
+void fft1D(float series[], int series_length, float freq[])
+{
+    int i, n = 1;
+    double * re, * im;
+
+    while (n*2 <= series_length) n *= 2;
+    if (n < 2) return;
+
+    re = (double*)malloc(n*sizeof(double));
+    im = (double*)calloc(n, sizeof(double));
+    if ((re == NULL) || (im == NULL)) {
+        free(re);
+        free(im);
+        memset(freq, 0, (series_length/2)*sizeof(float));
+        return;
+    }
+
+    for (i = 0; i < n; i++) re[i] = series[i];
+    fft_radix2(re, im, n);
+
+    for (i = 0; i < n/2; i++)
+        freq[i] = (float)((re[i]*re[i] + im[i]*im[i]) / n);
+    for (i = n/2; i < series_length/2; i++) freq[i] = 0;
+
+    free(re);
+    free(im);
+}
+
+/**
+ * @brief Averages the series onto an even grid of times. Cells without
+ *        samples are left at the average, so contribute no power.
+ * @param timestamp Times for observations in seconds
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param start Time of the first cell in seconds
+ * @param cell_seconds Duration of each cell
+ * @param grid Returned evenly sampled series, relative to the average
+ * @param points Number of cells
+ */
+static void prescreen_grid(float timestamp[], float series[],
+                           int series_length,
+                           double start, double cell_seconds,
+                           float grid[], int points)
+{
+    int i, cell;
+    float av = detect_av(series, series_length);
+    int * hits = (int*)calloc(points, sizeof(int));
+
+    memset(grid, 0, points*sizeof(float));
+    for (i = 0; i < series_length; i++) {
+        cell = (int)((timestamp[i] - start) / cell_seconds);
+        if ((cell < 0) || (cell >= points)) continue;
+        grid[cell] += series[i] - av;
+        if (hits != NULL) hits[cell]++;
+    }
+    if (hits == NULL) return;
+
+    for (i = 0; i < points; i++)
+        if (hits[i] > 1) grid[i] /= hits[i];
+    free(hits);
+}
+
+/**
+ * @brief Divides the power at each frequency by the average power of
+ *        the frequencies around it
+ * @param power Power spectrum, which is returned normalised
+ * @param length Number of frequencies
+ * @returns zero on success
+ */
+static int prescreen_normalise(float power[], int length)
+{
+    int i, lo, hi;
+    double * sum = (double*)malloc((length+1)*sizeof(double));
+
+    if (sum == NULL) return -1;
+
+    sum[0] = 0;
+    for (i = 0; i < length; i++) sum[i+1] = sum[i] + power[i];
+
+    for (i = 0; i < length; i++) {
+        lo = i - PRESCREEN_NOISE_RADIUS;
+        hi = i + PRESCREEN_NOISE_RADIUS + 1;
+        if (lo < 1) lo = 1;
+        if (hi > length) hi = length;
+        if ((hi <= lo) || (sum[hi] - sum[lo] <= 0)) {
+            power[i] = 0;
+            continue;
+        }
+        power[i] = (float)(power[i] * (hi - lo) / (sum[hi] - sum[lo]));
+    }
+    free(sum);
+    return 0;
+}
+
+/**
+ * @brief Sorts frequencies into descending order of score
+ */
+static int prescreen_compare(const void * a, const void * b)
+{
+    float score_a = *(const float*)a;
+    float score_b = *(const float*)b;
+
+    if (score_a < score_b) return 1;
+    if (score_a > score_b) return -1;
+    return 0;
+}
+
+/**
+ * @brief Finds the trial periods within the strongest bands of the
+ *        power spectrum of the series, which are the only ones that
+ *        need to be folded
+ * @param timestamp Times for observations in seconds
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the search
+ * @param steps Number of trial periods
+ * @param fraction Fraction of the frequencies within the search range
+ *        which are kept
+ * @param keep Returned non-zero for each trial period to be folded
+ * @returns zero on success. On failure every trial period is kept.
+ */
+int prescreen_periods(float timestamp[], float series[], int series_length,
+                      float min_period_days, float increment_days,
+                      int steps, float fraction, unsigned char keep[])
+{
+    int i, h, k, lo, hi, points, length, kmin, kmax, bands, kept;
+    double start, span, cell_seconds, cycles;
+    float max_power, * grid, * power, * score, * ranked, threshold;
+    float max_period_days = min_period_days + (steps*increment_days);
+
+    memset(keep, 1, steps);
+    if ((series_length < 2) || (fraction <= 0) || (fraction >= 1)) return 0;
+
+    start = timestamp[0];
+    span = timestamp[0];
+    for (i = 1; i < series_length; i++) {
+        if (timestamp[i] < start) start = timestamp[i];
+        if (timestamp[i] > span) span = timestamp[i];
+    }
+    span -= start;
+    if (span <= 0) return -1;
+
+    /* cells short enough that the highest harmonic of the shortest
+       period is below the Nyquist frequency, if the span allows */
+    cell_seconds = min_period_days * 60*60*24 / (2*PRESCREEN_HARMONICS);
+    points = 2;
+    while ((points < PRESCREEN_MAX_POINTS) && (points*cell_seconds < span))
+        points *= 2;
+    if (points*cell_seconds < span) cell_seconds = span / points;
+    cycles = points * cell_seconds / (60*60*24);
+    length = points/2;
+
+    /* frequencies within the search range, in cycles over the grid */
+    kmin = (int)(cycles / max_period_days);
+    kmax = (int)(cycles / min_period_days) + 1;
+    if (kmin < 1) kmin = 1;
+    if (kmax >= length) kmax = length-1;
+    bands = kmax - kmin + 1;
+    if (bands < 2) return -2;
+
+    grid = (float*)malloc(points*sizeof(float));
+    power = (float*)malloc(length*sizeof(float));
+    score = (float*)calloc(bands, sizeof(float));
+    ranked = (float*)malloc(bands*sizeof(float));
+    if ((grid == NULL) || (power == NULL) ||
+        (score == NULL) || (ranked == NULL)) {
+        free(grid);
+        free(power);
+        free(score);
+        free(ranked);
+        return -3;
+    }
+
+    prescreen_grid(timestamp, series, series_length, start, cell_seconds,
+                   grid, points);
+    fft1D(grid, points, power);
+    prescreen_normalise(power, length);
+
+    /* sum the strongest power near each harmonic, since the orbital
+       frequency is only known to within one frequency of the grid */
+    for (k = kmin; k <= kmax; k++) {
+        for (h = 1; h <= PRESCREEN_HARMONICS; h++) {
+            lo = h*k - h/2;
+            hi = h*k + h/2;
+            if (lo >= length) break;
+            if (hi >= length) hi = length-1;
+            max_power = 0;
+            for (i = lo; i <= hi; i++)
+                if (power[i] > max_power) max_power = power[i];
+            score[k - kmin] += max_power;
+        }
+    }
+
+    memcpy(ranked, score, bands*sizeof(float));
+    qsort(ranked, bands, sizeof(float), prescreen_compare);
+    kept = (int)(bands * fraction);
+    if (kept < 1) kept = 1;
+    threshold = ranked[kept-1];
+
+    /* keep trial periods within or next to a kept frequency */
+    for (i = 0; i < steps; i++) {
+        k = (int)(cycles / (min_period_days + (i*increment_days)) + 0.5f);
+        keep[i] = 0;
+        for (h = k-1; h <= k+1; h++) {
+            if ((h < kmin) || (h > kmax)) continue;
+            if (score[h - kmin] >= threshold) keep[i] = 1;
+        }
+    }
+
+    free(grid);
+    free(power);
+    free(score);
+    free(ranked);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A fold store holds the folded light curve for every trial period of
+   one star's search, so that later searches over the same grid may be
+   scored with different thresholds without folding the series again.
+   Only periods which pass the checks that do not depend upon the
+   thresholds have a record written, and the file is created sparse,
+   so rejected periods take no space on disk. Each record holds only as
+   many buckets as the light curves of the search, so that stores for
+   short light curves are no larger than they need be. */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "waspscan.h"
+
+/* identifies a fold store file */
+#define FOLDSTORE_MAGIC        "WASPFOLD"
+#define FOLDSTORE_VERSION      4
+
+/* records begin after the header, on a page boundary */
+#define FOLDSTORE_HEADER_BYTES 4096
+
+/* bytes of a record holding the given number of buckets, being the gate
+   and maximum samples followed by the curve, density and counts above
+   the lower bound of the curve */
+#define FOLDSTORE_RECORD_BYTES(curve_length) \
+    (sizeof(int) + sizeof(float)*(1 + 3*(size_t)(curve_length)))
+
+struct fold_store_header {
+    char magic[8];
+    int version;
+    int complete;
+    int record_bytes;
+    int steps;
+    int series_length;
+    unsigned int series_hash;
+    float min_period_days;
+    float max_period_days;
+    float increment_days;
+    float bin_fraction;
+    float prescreen_fraction;
+    int compact;
+    int curve_length;
+};
+
+/**
+ * @brief Maps a store file into memory
+ * @param store The store
+ * @param writable Non-zero if records are to be written
+ * @returns zero on success
+ */
+static int foldstore_map(struct fold_store * store, int writable)
+{
+    store->map = (unsigned char*)mmap(NULL, store->length,
+                                      writable ?
+                                      (PROT_READ | PROT_WRITE) : PROT_READ,
+                                      MAP_SHARED, store->fd, 0);
+    if (store->map == MAP_FAILED) {
+        store->map = NULL;
+        return -1;
+    }
+    store->records = store->map + FOLDSTORE_HEADER_BYTES;
+    return 0;
+}
+
+/**
+ * @brief Opens an existing store if it was completed for the same
+ *        series and search grid
+ * @param store The store, with its filename and steps set
+ * @param header The header expected
+ * @returns zero if the store can be read
+ */
+static int foldstore_open_existing(struct fold_store * store,
+                                   struct fold_store_header * header)
+{
+    struct fold_store_header * existing;
+    struct stat st;
+
+    store->fd = open(store->filename, O_RDONLY);
+    if (store->fd < 0) return -1;
+
+    if ((fstat(store->fd, &st) != 0) ||
+        ((size_t)st.st_size != store->length) ||
+        (foldstore_map(store, 0) != 0)) {
+        close(store->fd);
+        store->fd = -1;
+        return -1;
+    }
+
+    existing = (struct fold_store_header*)store->map;
+    if ((memcmp(existing->magic, header->magic, 8) != 0) ||
+        (existing->version != header->version) ||
+        (!existing->complete) ||
+        (existing->record_bytes != header->record_bytes) ||
+        (existing->steps != header->steps) ||
+        (existing->series_length != header->series_length) ||
+        (existing->series_hash != header->series_hash) ||
+        (existing->min_period_days != header->min_period_days) ||
+        (existing->max_period_days != header->max_period_days) ||
+        (existing->increment_days != header->increment_days) ||
+        (existing->bin_fraction != header->bin_fraction) ||
+        (existing->prescreen_fraction != header->prescreen_fraction) ||
+        (existing->compact != header->compact) ||
+        (existing->curve_length != header->curve_length)) {
+        munmap(store->map, store->length);
+        store->map = NULL;
+        store->records = NULL;
+        close(store->fd);
+        store->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a new store, written under a temporary name until
+ *        it is complete so that an interrupted search is never read
+ * @param store The store, with its filename and steps set
+ * @param header The header to be written
+ * @returns zero on success
+ */
+static int foldstore_create(struct fold_store * store,
+                            struct fold_store_header * header)
+{
+    sprintf(store->temp_filename, "%s.%d", store->filename, (int)getpid());
+    store->fd = open(store->temp_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (store->fd < 0) return -1;
+
+    /* records which are never written remain as holes */
+    if ((ftruncate(store->fd, (off_t)store->length) != 0) ||
+        (foldstore_map(store, 1) != 0)) {
+        close(store->fd);
+        unlink(store->temp_filename);
+        store->fd = -1;
+        return -2;
+    }
+    memcpy(store->map, header, sizeof(struct fold_store_header));
+    store->writing = 1;
+    return 0;
+}
+
+/**
+ * @brief Opens the fold store for a star and search grid. If a complete
+ *        store exists for the same series and grid then its records
+ *        are read, otherwise a new store is created which will be
+ *        filled in by the search.
+ * @param directory Directory in which stores are kept
+ * @param name Name of the star
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param store Returned store
+ * @returns zero on success
+ */
+int foldstore_open(char * directory, char * name,
+                   float timestamp[], float series[], int series_length,
+                   float min_period_days, float max_period_days,
+                   float increment_days,
+                   struct fold_store * store)
+{
+    struct fold_store_header header;
+    unsigned int grid_hash;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+
+    memset(store, 0, sizeof(struct fold_store));
+    store->fd = -1;
+    if ((steps < 1) || (steps > MAX_SEARCH_STEPS)) return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FOLDSTORE_MAGIC, 8);
+    header.version = FOLDSTORE_VERSION;
+    header.record_bytes = (int)FOLDSTORE_RECORD_BYTES(detect_curve_length);
+    header.steps = steps;
+    header.series_length = series_length;
+    header.series_hash =
+        fnv1a_hash(timestamp, series_length*sizeof(float), FNV1A_OFFSET);
+    header.series_hash =
+        fnv1a_hash(series, series_length*sizeof(float), header.series_hash);
+    header.min_period_days = min_period_days;
+    header.max_period_days = max_period_days;
+    header.increment_days = increment_days;
+    header.bin_fraction = detect_bin_fraction;
+    header.prescreen_fraction = detect_prescreen_fraction;
+    header.compact = detect_compact;
+    header.curve_length = detect_curve_length;
+
+    /* the filename is keyed by the search grid, binning, pre-screen,
+       layout of the samples and length of the light curve, so that
+       stores for several grids may be kept for the same star */
+    grid_hash = fnv1a_hash(&header.record_bytes, sizeof(int), FNV1A_OFFSET);
+    grid_hash = fnv1a_hash(&header.min_period_days, sizeof(float)*5,
+                           grid_hash);
+    grid_hash = fnv1a_hash(&header.compact, sizeof(int)*2, grid_hash);
+    if (strlen(directory) + strlen(name) + 16 >= MAX_FILENAME_LENGTH*2)
+        return -2;
+    sprintf(store->filename, "%s/%s_%08x.fold", directory, name, grid_hash);
+
+    store->steps = steps;
+    store->curve_length = detect_curve_length;
+    store->record_bytes = FOLDSTORE_RECORD_BYTES(detect_curve_length);
+    store->length = FOLDSTORE_HEADER_BYTES +
+        ((size_t)steps * store->record_bytes);
+
+    if (foldstore_open_existing(store, &header) == 0) return 0;
+    if (foldstore_create(store, &header) != 0) return -3;
+    return 0;
+}
+
+/**
+ * @brief Reads the record for a trial period. Periods which were
+ *        rejected before being written read back as missing data.
+ * @param store The store
+ * @param step Index of the trial period within the search grid
+ * @param fold Returned light curve
+ * @returns zero on success
+ */
+int foldstore_read(struct fold_store * store, int step,
+                   struct fold_record * fold)
+{
+    unsigned char * record;
+    size_t bytes = store->curve_length*sizeof(float);
+
+    if ((step < 0) || (step >= store->steps)) return -1;
+    record = store->records + (size_t)step*store->record_bytes;
+    memcpy(&fold->gate, record, sizeof(int));
+    if (fold->gate != PROFILE_GATE_SCORED) return 0;
+
+    record += sizeof(int);
+    memcpy(&fold->max_samples, record, sizeof(float));
+    record += sizeof(float);
+    memcpy(fold->curve, record, bytes);
+    memcpy(fold->density, record + bytes, bytes);
+    memcpy(fold->above, record + bytes*2, bytes);
+    return 0;
+}
+
+/**
+ * @brief Writes the record for a trial period. Only the gate of a
+ *        rejected period is written.
+ * @param store The store
+ * @param step Index of the trial period within the search grid
+ * @param fold Light curve to be kept
+ */
+void foldstore_write(struct fold_store * store, int step,
+                     struct fold_record * fold)
+{
+    unsigned char * record;
+    size_t bytes = store->curve_length*sizeof(float);
+
+    if ((step < 0) || (step >= store->steps)) return;
+    record = store->records + (size_t)step*store->record_bytes;
+    memcpy(record, &fold->gate, sizeof(int));
+    if (fold->gate != PROFILE_GATE_SCORED) return;
+
+    record += sizeof(int);
+    memcpy(record, &fold->max_samples, sizeof(float));
+    record += sizeof(float);
+    memcpy(record, fold->curve, bytes);
+    memcpy(record + bytes, fold->density, bytes);
+    memcpy(record + bytes*2, fold->above, bytes);
+}
+
+/**
+ * @brief Closes a store. A newly created store is marked as complete
+ *        and moved into place, so that subsequent searches can read it.
+ * @param store The store
+ * @returns zero on success
+ */
+int foldstore_close(struct fold_store * store)
+{
+    int retval = 0;
+
+    if (store->map == NULL) return 0;
+
+    if (store->writing) {
+        ((struct fold_store_header*)store->map)->complete = 1;
+        if (msync(store->map, store->length, MS_SYNC) != 0) retval = -1;
+    }
+    munmap(store->map, store->length);
+    close(store->fd);
+
+    if (store->writing) {
+        if ((retval != 0) ||
+            (rename(store->temp_filename, store->filename) != 0)) {
+            unlink(store->temp_filename);
+            retval = -2;
+        }
+    }
+
+    store->map = NULL;
+    store->records = NULL;
+    store->fd = -1;
+    store->writing = 0;
+    return retval;
+}
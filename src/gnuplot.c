@@ -18,8 +18,6 @@
 
 #include "waspscan.h"
 
-#define LIGHT_CURVE_LENGTH 256
-
 /* temporary files used to create plots */
 char script_filename[32];
 char data_filename[32];
@@ -327,6 +325,7 @@ int gnuplot_distribution(char * title,
  * @param axis_label Label for the vertical axis
  * @param period_days Orbital period in days
  * @param vertical_scale Vertical scaling factor
+ * @param pyramid Sums folded at the period, or NULL to fold the series
  * @returns result of the call to system()
  */
 int gnuplot_light_curve(char * title,
@@ -338,7 +337,8 @@ int gnuplot_light_curve(char * title,
                         float subtitle_indent_vertical,
                         char * axis_label,
                         float period_days,
-                        float vertical_scale)
+                        float vertical_scale,
+                        struct fold_pyramid * pyramid)
 {
     char subtitle[256];
     float av, variance;
@@ -362,8 +362,11 @@ int gnuplot_light_curve(char * title,
         phase[i] = (i*360.0f/LIGHT_CURVE_LENGTH)-180.0f;
     }
 
-    light_curve(timestamp, series, series_length,
-                period_days, curve, density, LIGHT_CURVE_LENGTH);
+    if (pyramid != NULL)
+        fold_pyramid_curve(pyramid, LIGHT_CURVE_LENGTH, curve, density);
+    else
+        light_curve(timestamp, series, series_length,
+                    period_days, curve, density, LIGHT_CURVE_LENGTH);
 
     offset = detect_phase_offset(curve, LIGHT_CURVE_LENGTH);
     adjust_curve(curve, LIGHT_CURVE_LENGTH, offset);
@@ -417,6 +420,7 @@ int gnuplot_light_curve(char * title,
  * @param axis_label Label for the vertical axis
  * @param period_days Orbital period in days
  * @param vertical_scale Vertical scaling factor
+ * @param pyramid Sums folded at the period, or NULL to fold the series
  * @returns result of the call to system()
  */
 int gnuplot_light_curve_distribution(char * title,
@@ -428,7 +432,8 @@ int gnuplot_light_curve_distribution(char * title,
                                      float subtitle_indent_vertical,
                                      char * axis_label,
                                      float period_days,
-                                     float vertical_scale)
+                                     float vertical_scale,
+                                     struct fold_pyramid * pyramid)
 {
     char subtitle[256];
     float av, variance, adjust;
@@ -448,8 +453,11 @@ int gnuplot_light_curve_distribution(char * title,
 
     sprintf(subtitle,"Orbital Period %.5f days",period_days);
 
-    light_curve(timestamp, series, series_length,
-                period_days, curve, density, LIGHT_CURVE_LENGTH);
+    if (pyramid != NULL)
+        fold_pyramid_curve(pyramid, LIGHT_CURVE_LENGTH, curve, density);
+    else
+        light_curve(timestamp, series, series_length,
+                    period_days, curve, density, LIGHT_CURVE_LENGTH);
     offset = detect_phase_offset(curve, LIGHT_CURVE_LENGTH);
     adjust = (period_days/2) - (offset*period_days/LIGHT_CURVE_LENGTH);
 
@@ -493,3 +501,55 @@ int gnuplot_light_curve_distribution(char * title,
     gnuplot_update();
     return system(commandstr);
 }
+
+/**
+ * @brief Plots a periodogram
+ * @param title Title for the plot
+ * @param period_days Array containing orbital periods
+ * @param response Array containing the response for each period
+ * @param length Length of the arrays
+ * @param image_filename Filename for the image to save as
+ * @param image_width Width of the image to be saved
+ * @param image_height Height of the image to be saved
+ * @returns result of the call to system()
+ */
+int gnuplot_periodogram(char * title,
+                        float period_days[], float response[], int length,
+                        char * image_filename,
+                        int image_width, int image_height)
+{
+    float range_min=0;
+    float range_max=0;
+    char commandstr[256];
+
+    if (create_temporary_files() != 0) {
+        return -1;
+    }
+
+    if (gnuplot_save_data(period_days, response, length,
+                          plot_data_file) != 0) {
+        return -3;
+    }
+
+    gnuplot_get_range(response, length, &range_min, &range_max);
+    if (range_max <= 0) {
+        range_max = 1;
+    }
+
+    if (gnuplot_create_script(plot_script_file,
+                              (char*)data_filename,
+                              title, "",
+                              0, 0,
+                              period_days[0], period_days[length-1],
+                              0, range_max*1.05f,
+                              "Orbital Period (days)", "Response",
+                              image_filename,
+                              image_width, image_height,
+                              "Response", 2, 0, 0, 0) != 0) {
+        return -5;
+    }
+
+    sprintf(commandstr,"gnuplot %s", (char*)script_filename);
+    gnuplot_update();
+    return system(commandstr);
+}
@@ -0,0 +1,463 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Reads the whole contents of many log files with many reads in flight
+   at once, so that loading thousands of small files from a network
+   filesystem or a cold page cache is not limited by the latency of
+   each read. Opens and reads are submitted through an io_uring, using
+   the system calls directly so that no library is needed. Where the
+   kernel does not provide io_uring, or it is not permitted, each file
+   is instead read with pread by a pool of threads. */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "waspscan.h"
+
+/* number of files opened or read at once */
+#define INGEST_DEPTH    64
+
+/* threads reading files when io_uring is not available */
+#define INGEST_THREADS  16
+
+/* stages of reading one file */
+#define INGEST_OPENING  0
+#define INGEST_READING  1
+
+/* non-zero to use io_uring where it is available */
+int ingest_uring = 1;
+
+struct ingest_ring {
+    int fd;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void * sq_map;
+    void * cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/* a file being read through the ring */
+struct ingest_slot {
+    int file;
+    int fd;
+    int stage;
+    char * contents;
+    long length;
+    long done;
+};
+
+/**
+ * @brief Reads the whole of a file with pread
+ * @param filename The file
+ * @param length Returned length in bytes
+ * @returns The contents, terminated with a zero, or NULL on failure
+ */
+static char * ingest_read_file(char * filename, long * length)
+{
+    struct stat st;
+    char * contents;
+    ssize_t n;
+    int fd;
+
+    *length = 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    contents = (char*)malloc(st.st_size + 1);
+    if (contents == NULL) {
+        close(fd);
+        return NULL;
+    }
+    while (*length < st.st_size) {
+        n = pread(fd, &contents[*length], st.st_size - *length, *length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(contents);
+            close(fd);
+            return NULL;
+        }
+        if (n == 0) break;
+        *length += n;
+    }
+    contents[*length] = 0;
+    close(fd);
+    return contents;
+}
+
+/**
+ * @brief Reads files with a pool of threads
+ * @param filenames The files to be read
+ * @param no_of_files Number of files
+ * @param callback Called with the contents of each file, from any thread
+ * @param context Passed to the callback
+ * @param first_file Index given to the callback for the first file
+ */
+static void ingest_threads(char ** filenames, int no_of_files,
+                           ingest_callback callback, void * context,
+                           int first_file)
+{
+    int i;
+
+#pragma omp parallel for schedule(dynamic) num_threads(INGEST_THREADS)
+    for (i = 0; i < no_of_files; i++) {
+        long length;
+        char * contents = ingest_read_file(filenames[i], &length);
+        callback(first_file + i, contents, length, context);
+        free(contents);
+    }
+}
+
+/**
+ * @brief Creates an io_uring and maps its queues
+ * @param ring Returned ring
+ * @param entries Number of submission queue entries
+ * @returns zero on success
+ */
+static int ingest_ring_open(struct ingest_ring * ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(struct ingest_ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring->cq_map_size =
+        p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -2;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    }
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return -3;
+        }
+    }
+    ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)
+        mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return -4;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_map + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_map + p.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_map + p.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Unmaps and closes an io_uring
+ * @param ring The ring
+ */
+static void ingest_ring_close(struct ingest_ring * ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+/**
+ * @brief Returns the next free submission queue entry. There is always
+ *        one, since no more than one operation is in flight per slot.
+ * @param ring The ring
+ * @param user_data Index of the slot, returned with the completion
+ * @returns The entry, cleared
+ */
+static struct io_uring_sqe * ingest_sqe(struct ingest_ring * ring,
+                                        int user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (unsigned long long)user_data;
+    ring->sq_array[index] = index;
+
+    /* the entry is written before the kernel can see the new tail */
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * @brief Queues the opening of the next file for a slot
+ * @param ring The ring
+ * @param slots Every slot
+ * @param slot Index of the slot
+ * @param file Index of the file
+ * @param filenames The files to be read
+ */
+static void ingest_submit_open(struct ingest_ring * ring,
+                               struct ingest_slot slots[], int slot,
+                               int file, char ** filenames)
+{
+    struct io_uring_sqe * sqe = ingest_sqe(ring, slot);
+
+    slots[slot].file = file;
+    slots[slot].fd = -1;
+    slots[slot].stage = INGEST_OPENING;
+    slots[slot].contents = NULL;
+    slots[slot].length = 0;
+    slots[slot].done = 0;
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long long)(uintptr_t)filenames[file];
+    sqe->open_flags = O_RDONLY;
+}
+
+/**
+ * @brief Queues a read of the remainder of the file held by a slot
+ * @param ring The ring
+ * @param slots Every slot
+ * @param slot Index of the slot
+ */
+static void ingest_submit_read(struct ingest_ring * ring,
+                               struct ingest_slot slots[], int slot)
+{
+    struct io_uring_sqe * sqe = ingest_sqe(ring, slot);
+
+    slots[slot].stage = INGEST_READING;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slots[slot].fd;
+    sqe->addr =
+        (unsigned long long)(uintptr_t)&slots[slot].contents[slots[slot].done];
+    sqe->len = (unsigned)(slots[slot].length - slots[slot].done);
+    sqe->off = (unsigned long long)slots[slot].done;
+}
+
+/**
+ * @brief Handles the completion of an open or read. Where the ring
+ *        cannot do what is needed the file is read with pread instead,
+ *        so that older kernels which lack some operations still work.
+ * @param ring The ring
+ * @param slots Every slot
+ * @param slot Index of the slot
+ * @param res Result of the operation
+ * @param filenames The files to be read
+ * @param callback Called with the contents of each file
+ * @param context Passed to the callback
+ * @returns Non-zero if the file held by the slot is finished
+ */
+static int ingest_complete(struct ingest_ring * ring,
+                           struct ingest_slot slots[], int slot, int res,
+                           char ** filenames,
+                           ingest_callback callback, void * context)
+{
+    struct ingest_slot * s = &slots[slot];
+    struct stat st;
+
+    if (s->stage == INGEST_OPENING) {
+        if (res >= 0) {
+            s->fd = res;
+            if ((fstat(s->fd, &st) == 0) &&
+                ((s->contents = (char*)malloc(st.st_size + 1)) != NULL)) {
+                s->length = st.st_size;
+                if (s->length > 0) {
+                    ingest_submit_read(ring, slots, slot);
+                    return 0;
+                }
+            }
+        }
+    }
+    else if (res > 0) {
+        s->done += res;
+        if (s->done < s->length) {
+            ingest_submit_read(ring, slots, slot);
+            return 0;
+        }
+    }
+
+    if (s->fd >= 0) close(s->fd);
+    if ((s->contents != NULL) && ((res >= 0) || (s->length == 0))) {
+        s->contents[s->done] = 0;
+        callback(s->file, s->contents, s->done, context);
+    }
+    else {
+        /* find the reason for the failure, or read it another way */
+        free(s->contents);
+        s->contents = ingest_read_file(filenames[s->file], &s->done);
+        callback(s->file, s->contents, s->done, context);
+    }
+    free(s->contents);
+    s->contents = NULL;
+    s->fd = -1;
+    s->file = -1;
+    return 1;
+}
+
+/**
+ * @brief Reads files through an io_uring, keeping up to INGEST_DEPTH
+ *        of them in flight
+ * @param ring The ring
+ * @param filenames The files to be read
+ * @param no_of_files Number of files
+ * @param callback Called with the contents of each file
+ * @param context Passed to the callback
+ * @returns zero on success
+ */
+static int ingest_ring_read(struct ingest_ring * ring,
+                            char ** filenames, int no_of_files,
+                            ingest_callback callback, void * context)
+{
+    struct ingest_slot slots[INGEST_DEPTH];
+    struct io_uring_cqe * cqe;
+    int slot, next_file = 0, in_flight = 0, to_submit = 0;
+    unsigned head;
+
+    memset(slots, 0, sizeof(slots));
+    for (slot = 0; slot < INGEST_DEPTH; slot++) {
+        slots[slot].file = -1;
+        slots[slot].fd = -1;
+    }
+
+    for (slot = 0; (slot < INGEST_DEPTH) && (next_file < no_of_files);
+         slot++, next_file++, in_flight++, to_submit++)
+        ingest_submit_open(ring, slots, slot, next_file, filenames);
+
+    while (in_flight > 0) {
+        if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        to_submit = 0;
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            slot = (int)cqe->user_data;
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+            if (!ingest_complete(ring, slots, slot, cqe->res, filenames,
+                                 callback, context)) {
+                to_submit++;
+                continue;
+            }
+            in_flight--;
+            if (next_file < no_of_files) {
+                ingest_submit_open(ring, slots, slot, next_file++,
+                                   filenames);
+                in_flight++;
+                to_submit++;
+            }
+        }
+    }
+
+    if (in_flight == 0) return 0;
+
+    /* the ring failed, so the files which were in flight and those
+       not yet started are read another way. Buffers which the kernel
+       may still write into are not freed. */
+    for (slot = 0; slot < INGEST_DEPTH; slot++) {
+        long length;
+        char * contents;
+
+        if (slots[slot].file < 0) continue;
+        contents = ingest_read_file(filenames[slots[slot].file], &length);
+        callback(slots[slot].file, contents, length, context);
+        free(contents);
+    }
+    ingest_threads(&filenames[next_file], no_of_files - next_file,
+                   callback, context, next_file);
+    return -1;
+}
+
+/**
+ * @brief Reads the whole contents of many files, with many reads in
+ *        flight at once. The callback is given the index of each file
+ *        within the list, its contents terminated with a zero, or NULL
+ *        if it could not be read, and its length. Files complete in any
+ *        order, and without io_uring the callback may be called from
+ *        several threads at once.
+ * @param filenames The files to be read
+ * @param no_of_files Number of files
+ * @param callback Called with the contents of each file
+ * @param context Passed to the callback
+ * @returns zero on success
+ */
+int ingest_files(char ** filenames, int no_of_files,
+                 ingest_callback callback, void * context)
+{
+    struct ingest_ring ring;
+    int retval;
+
+    if (no_of_files < 1) return 0;
+
+    if ((!ingest_uring) || (ingest_ring_open(&ring, INGEST_DEPTH) != 0)) {
+        ingest_threads(filenames, no_of_files, callback, context, 0);
+        return 0;
+    }
+    retval = ingest_ring_read(&ring, filenames, no_of_files,
+                              callback, context);
+    ingest_ring_close(&ring);
+    return retval;
+}
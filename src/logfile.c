@@ -32,6 +32,50 @@
 
 #include "waspscan.h"
 
+/**
+ * @brief Reads the time and magnitude from one line of a log file
+ * @param linestr The line
+ * @param timestamp Array containing the time of each data point
+ * @param series Array containing magnitudes
+ * @param series_length Number of data points, which is incremented if
+ *        the line contains a magnitude
+ * @param time_field_index Index of the table column which contains the time
+ * @param flux_field_index Index of the table column which contains the
+ *        photon flux
+ */
+static void logfile_line(char * linestr, float timestamp[], float series[],
+                         int * series_length,
+                         int time_field_index, int flux_field_index)
+{
+    char valuestr[512];
+    int i, ctr=0, field_index=0;
+
+    if (strlen(linestr) < 1) return;
+    if ((linestr[0]=='\\') ||
+        (linestr[0]=='|')) {
+        return;
+    }
+    for (i = 0; i < strlen(linestr); i++) {
+        if (!((linestr[i]==' ') || (linestr[i]=='\t'))) {
+            valuestr[ctr++] = linestr[i];
+        }
+        else {
+            if (ctr > 0) {
+                valuestr[ctr]=0;
+                if (field_index == time_field_index) {
+                    timestamp[*series_length] = atof(valuestr);
+                }
+                if (field_index == flux_field_index) {
+                    series[(*series_length)++] = atof(valuestr);
+                    break;
+                }
+                ctr = 0;
+                field_index++;
+            }
+        }
+    }
+}
+
 /**
  * @brief Loads a WASP log file containing times and magnitudes
  *        for a given star
@@ -49,9 +93,8 @@ int logfile_load(char * filename, float timestamp[],
 				 int time_field_index, int flux_field_index)
 {
     FILE * fp;
-    char linestr[512], valuestr[512];
+    char linestr[512];
     char * retval = NULL;
-    int i,ctr=0,field_index;
     int series_length=0;
 
     fp = fopen(filename,"r");
@@ -60,39 +103,50 @@ int logfile_load(char * filename, float timestamp[],
     while (!feof(fp)) {
         retval = fgets(linestr,511,fp);
         if (retval != NULL) {
-            if (strlen(linestr) < 1) continue;
-            if ((linestr[0]=='\\') ||
-                (linestr[0]=='|')) {
-                continue;
-            }
-            field_index = 0;
-            ctr=0;
-            for (i = 0; i < strlen(linestr); i++) {
-                if (!((linestr[i]==' ') || (linestr[i]=='\t'))) {
-                    valuestr[ctr++] = linestr[i];
-                }
-                else {
-                    if (ctr > 0) {
-                        valuestr[ctr]=0;
-                        if (field_index == time_field_index) {
-                            timestamp[series_length] = atof(valuestr);
-                        }
-                        if (field_index == flux_field_index) {
-                            series[series_length++] = atof(valuestr);
-                            if (series_length >= max_series_length) {
-                                fclose(fp);
-                                return(series_length);
-                            }
-                            break;
-                        }
-                        ctr = 0;
-                        field_index++;
-                    }
-                }
-            }
+            logfile_line(linestr, timestamp, series, &series_length,
+                         time_field_index, flux_field_index);
+            if (series_length >= max_series_length) break;
         }
     }
 
     fclose(fp);
     return series_length;
 }
+
+/**
+ * @brief Reads times and magnitudes from the contents of a log file
+ *        which are already in memory, in the same way as logfile_load
+ * @param contents The contents of the log file
+ * @param length Length of the contents in bytes
+ * @param timestamp Returned array containing the time of each data point
+ * @param series Returned array containing magnitudes
+ * @param max_series_length The maximum number of data points to be returned
+ * @param time_field_index Index of the table column which contains the time
+ * @param flux_field_index Index of the table column which contains the
+ *        photon flux
+ * @returns The number of data points loaded
+ */
+int logfile_parse(char * contents, long length, float timestamp[],
+                  float series[], int max_series_length,
+                  int time_field_index, int flux_field_index)
+{
+    char linestr[512];
+    long position = 0;
+    int n, series_length=0;
+
+    while (position < length) {
+        /* lines are split where fgets would split them */
+        for (n = 0; (n < 510) && (position < length); n++) {
+            linestr[n] = contents[position++];
+            if (linestr[n] == '\n') {
+                n++;
+                break;
+            }
+        }
+        linestr[n] = 0;
+        logfile_line(linestr, timestamp, series, &series_length,
+                     time_field_index, flux_field_index);
+        if (series_length >= max_series_length) break;
+    }
+    return series_length;
+}
@@ -0,0 +1,225 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Lomb-Scargle periodogram, for finding the periods of variable stars
+   rather than transits. Rather than summing over every sample for
+   every frequency, each sample is extirpolated onto an even grid and
+   the sums needed for all frequencies are found with two fast Fourier
+   transforms, as described by Press and Rybicki (1989). The power at
+   each trial period is then interpolated from the nearest frequencies
+   of the transform. */
+
+#include "waspscan.h"
+
+/* number of grid points each sample is extirpolated onto */
+#define LS_EXTIRPOLATION_POINTS 4
+
+/* frequencies per peak width of the transform */
+#define LS_OVERSAMPLE           10
+
+/* largest number of points within each transform */
+#define LS_MAX_POINTS           (1<<24)
+
+/* trial periods added to a periodogram at a time */
+#define LS_CHUNK_STEPS          1024
+
+/**
+ * @brief Adds a value at a fractional position within a periodic grid,
+ *        spreading it over neighbouring points with Lagrange weights so
+ *        that sums of smooth functions over the grid are preserved
+ * @param value The value to be added
+ * @param grid The grid
+ * @param length Number of points within the grid
+ * @param position Fractional position within the grid
+ */
+static void lomb_scargle_extirpolate(double value, double grid[],
+                                     int length, double position)
+{
+    int j, k, first;
+    double weight;
+
+    if (position == floor(position)) {
+        grid[((int)position) % length] += value;
+        return;
+    }
+
+    first = (int)floor(position - (LS_EXTIRPOLATION_POINTS*0.5) + 1);
+    for (j = first; j < first + LS_EXTIRPOLATION_POINTS; j++) {
+        weight = 1;
+        for (k = first; k < first + LS_EXTIRPOLATION_POINTS; k++) {
+            if (k == j) continue;
+            weight *= (position - k) / (double)(j - k);
+        }
+        grid[((j % length) + length) % length] += value*weight;
+    }
+}
+
+/**
+ * @brief Returns the normalised power at one frequency of the transforms
+ * @param data_re Real part of the transform of the data
+ * @param data_im Imaginary part of the transform of the data
+ * @param window_re Real part of the transform at twice the frequency
+ * @param window_im Imaginary part of the transform at twice the frequency
+ * @param series_length Number of samples
+ * @param variance Variance of the samples
+ * @returns Power
+ */
+static double lomb_scargle_power(double data_re, double data_im,
+                                 double window_re, double window_im,
+                                 int series_length, double variance)
+{
+    double hypot_2wt, cos_2wt, sin_2wt, cos_wt, sin_wt;
+    double den, c_term, s_term;
+
+    hypot_2wt = sqrt(window_re*window_re + window_im*window_im);
+    if (hypot_2wt <= 0) return 0;
+
+    /* the phase offset which makes the sine and cosine terms
+       independent */
+    cos_2wt = 0.5*window_re/hypot_2wt;
+    sin_2wt = 0.5*window_im/hypot_2wt;
+    cos_wt = sqrt(0.5 + cos_2wt);
+    sin_wt = sqrt(fmax(0.5 - cos_2wt, 0));
+    if (sin_2wt < 0) sin_wt = -sin_wt;
+
+    den = 0.5*series_length + cos_2wt*window_re + sin_2wt*window_im;
+    if ((den <= 0) || (den >= series_length)) return 0;
+
+    c_term = cos_wt*data_re + sin_wt*data_im;
+    s_term = cos_wt*data_im - sin_wt*data_re;
+    return (c_term*c_term/den +
+            s_term*s_term/(series_length - den)) / (2*variance);
+}
+
+/**
+ * @brief Finds the period with the greatest Lomb-Scargle power over the
+ *        same grid of trial periods as detect_orbital_period. If a
+ *        periodogram is being saved then the power at every trial
+ *        period is added to it.
+ * @param timestamp Times for observations in seconds
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param min_period_days The minimum period in days
+ * @param max_period_days The maximum period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param max_power Returned power at the best period
+ * @returns The period with the greatest power, or zero on failure
+ */
+float lomb_scargle_period(float timestamp[], float series[],
+                          int series_length,
+                          float min_period_days, float max_period_days,
+                          float increment_days, float * max_power)
+{
+    int i, k, length;
+    int steps = (int)((max_period_days - min_period_days)/increment_days);
+    double av = 0, variance = 0, start, end, span_days, df, fac;
+    double position, fraction, power[2], trial_power;
+    double * data_re, * data_im, * window_re, * window_im;
+    float values[LS_CHUNK_STEPS], best_period_days = 0;
+
+    *max_power = 0;
+    if ((series_length < 3) || (steps < 1)) return 0;
+    if (steps > MAX_SEARCH_STEPS) {
+        printf("Maximum number of time steps exceeded\n");
+        return 0;
+    }
+
+    start = end = timestamp[0];
+    for (i = 0; i < series_length; i++) {
+        av += series[i];
+        if (timestamp[i] < start) start = timestamp[i];
+        if (timestamp[i] > end) end = timestamp[i];
+    }
+    av /= series_length;
+    for (i = 0; i < series_length; i++)
+        variance += (series[i] - av)*(series[i] - av);
+    variance /= (series_length - 1);
+    span_days = (end - start) / (60*60*24);
+    if ((variance <= 0) || (span_days <= 0)) return 0;
+
+    /* the transform needs enough points for the highest frequency,
+       with each frequency doubled for the window transform and
+       spread over the extirpolation points */
+    df = 1.0 / (span_days * LS_OVERSAMPLE);
+    length = 64;
+    while ((length < LS_MAX_POINTS) &&
+           (length < 4 * LS_EXTIRPOLATION_POINTS *
+            (1.0 / (min_period_days * df) + 2)))
+        length *= 2;
+    if (length < 4 * LS_EXTIRPOLATION_POINTS *
+        (1.0 / (min_period_days * df) + 2)) {
+        printf("Time series is too long for the Lomb-Scargle engine\n");
+        return 0;
+    }
+    fac = length * df;
+
+    data_re = (double*)calloc(length, sizeof(double));
+    data_im = (double*)calloc(length, sizeof(double));
+    window_re = (double*)calloc(length, sizeof(double));
+    window_im = (double*)calloc(length, sizeof(double));
+    if ((data_re == NULL) || (data_im == NULL) ||
+        (window_re == NULL) || (window_im == NULL)) {
+        free(data_re);
+        free(data_im);
+        free(window_re);
+        free(window_im);
+        return 0;
+    }
+
+    for (i = 0; i < series_length; i++) {
+        position = fmod((timestamp[i] - start) / (60*60*24) * fac, length);
+        lomb_scargle_extirpolate(series[i] - av, data_re, length, position);
+        lomb_scargle_extirpolate(1, window_re, length,
+                                 fmod(2*position, length));
+    }
+    fft_radix2(data_re, data_im, length);
+    fft_radix2(window_re, window_im, length);
+
+    for (i = 0; i < steps; i++) {
+        position = 1.0 / ((min_period_days + (i*increment_days)) * df);
+        k = (int)position;
+        fraction = position - k;
+        power[0] = lomb_scargle_power(data_re[k], data_im[k],
+                                      window_re[k], window_im[k],
+                                      series_length, variance);
+        power[1] = lomb_scargle_power(data_re[k+1], data_im[k+1],
+                                      window_re[k+1], window_im[k+1],
+                                      series_length, variance);
+        trial_power = power[0] + (power[1] - power[0])*fraction;
+        values[i % LS_CHUNK_STEPS] = (float)trial_power;
+
+        /* later trial periods win ties, as with transits */
+        if ((trial_power > 0) && (trial_power >= *max_power)) {
+            *max_power = (float)trial_power;
+            best_period_days = min_period_days + (i*increment_days);
+        }
+
+        /* trial periods are found in order, so each chunk is written
+           as soon as it is full */
+        if (((i + 1) % LS_CHUNK_STEPS == 0) || (i == steps - 1))
+            periodogram_add(i - (i % LS_CHUNK_STEPS), values,
+                            (i % LS_CHUNK_STEPS) + 1);
+    }
+
+    free(data_re);
+    free(data_im);
+    free(window_re);
+    free(window_im);
+    return best_period_days;
+}
@@ -38,10 +38,68 @@ void show_help()
     printf("     --dip                   Dip threshold (0.0 -> 1.0)\n");
     printf(" -r  --diprad                Expected dip radius as a percent of orbital period\n");
     printf("     --vscale                Vertical scaling factor\n");
+    printf("     --profile               Report stage timings and rejections\n");
+    printf("     --trace                 Save a per-thread timeline as JSON\n");
+    printf("     --perf                  Report hardware performance counters\n");
+    printf("     --foldstore             Directory in which to keep folded light curves\n");
+    printf("     --accumulate            Directory in which to keep sums, so only new samples are folded\n");
+    printf("     --periodogram           Save the response for every trial period\n");
+    printf("     --periodogram-plot      Plot the periodogram to an image file\n");
+    printf("     --bin                   Merge samples within this fraction of a bucket\n");
+    printf("     --prescreen             Fold only this fraction of the strongest frequencies\n");
+    printf("     --compact               Fold 16 bit magnitudes and 32 bit times\n");
+    printf("     --bins                  Buckets within each light curve, a power of two\n");
+    printf("     --triage                Stars without a transit-like signal: skip or coarse\n");
+    printf("     --triage-low            Fewest fraction of samples far below the median\n");
+    printf("     --triage-skew           Greatest upwards skew of the flux\n");
+    printf("     --triage-dips           Fewest nights on which the flux dips\n");
+    printf("     --triage-coarse         Search increment multiplier for a coarse search\n");
+    printf("     --fap                   Most searches made to find the false alarm probability\n");
+    printf("     --fap-alpha             False alarm probability below which a transit is significant\n");
+    printf("     --fap-null              How magnitudes are rearranged: permute or nights\n");
+    printf("     --fap-seed              Seed for rearranging the magnitudes\n");
+    printf("     --engine                Period search engine: transit, ls or pdm\n");
+    printf("     --pdmbins               Comma separated numbers of PDM phase bins, also for transit\n");
+    printf("     --batch                 File listing log files to search together\n");
+    printf("     --sysrem                Number of trends common to a batch to remove\n");
+    printf("     --ingest                Reading of batch log files: uring or pread\n");
+    printf("     --manifest              File recording results, so unchanged stars are skipped\n");
+    printf("     --time-budget           Seconds within which to search for the period\n");
+    printf("     --serve                 Hand out the stars of a manifest to workers\n");
+    printf("     --worker                Search work units from this coordinator\n");
+    printf("     --port                  Port on which the coordinator listens\n");
+    printf("     --ranges                Ranges of the orbital period per work unit\n");
+    printf("     --lease                 Seconds a worker may hold a unit without a heartbeat\n");
     printf(" -h  --help                  Show help\n");
     printf(" -v  --version               Show version number\n");
 }
 
+/**
+ * @brief Reports any profiling and saves any trace before exiting
+ * @param retval The value to be returned from main
+ * @returns The given return value
+ */
+static int scan_close(int retval)
+{
+    trace_close();
+    profile_report(stderr);
+    return retval;
+}
+
+/**
+ * @brief Ends the span of the star, then reports any profiling and
+ *        saves any trace before exiting
+ * @param retval The value to be returned from main
+ * @param star_start Time at which the star began to be scanned
+ * @param name Name of the star
+ * @returns The given return value
+ */
+static int scan_finish(int retval, double star_start, char * name)
+{
+    trace_end("star", "scan", star_start, 0, name);
+    return scan_close(retval);
+}
+
 int main(int argc, char* argv[])
 {
     int i, series_length;
@@ -51,6 +109,7 @@ int main(int argc, char* argv[])
     int no_of_sections;
     char log_filename[256];
     char name[256], title[256*2];
+    char triage_reason[256];
     float orbital_period_days;
     int minimum_data_samples = 1000;
     float minimum_period_days = 0;
@@ -59,9 +118,36 @@ int main(int argc, char* argv[])
     char light_curve_filename[256*2];
     char light_curve_distribution_filename[256*2];
     int table_type = TABLE_TYPE_WASP;
+    int engine = ENGINE_TRANSIT;
+    float ls_power = 0, pdm_theta = 1;
+    float time_budget_seconds = 0, max_response = 0, grid_coverage = 1;
+    int pdm_bin_counts[PDM_MAX_BIN_COUNTS] = { 8, 16, 32 };
+    int no_of_pdm_bin_counts = 3, pdm_bins_given = 0;
+    struct detect_dispersion dispersion;
+    char * bin_count_str;
     int time_field_index=0, flux_field_index=3;
     float vertical_scale = 1.0f;
     float search_increment_seconds = 0.864f;
+    char trace_filename[256];
+    char foldstore_directory[256];
+    char accumulate_directory[256];
+    char periodogram_filename[256];
+    char periodogram_image_filename[256];
+    char batch_filename[256];
+    char manifest_filename[256];
+    char results_manifest[256];
+    unsigned int manifest_hash;
+    unsigned long long content_hash = 0;
+    long content_length = 0;
+    char coordinator_host[256];
+    int port = DISTRIBUTE_PORT, ranges = 1;
+    int lease_seconds = DISTRIBUTE_LEASE;
+    float increment_days;
+    struct fold_store store, * fold_store = NULL;
+    struct bootstrap_result fap;
+    struct accumulator_store accumulators, * accumulator_store = NULL;
+    struct fold_pyramid pyramid, * fold_pyramid = NULL;
+    double star_start, stage_start;
 
     /* maximum density within the area of the dip expected to be vacant */
     float max_vacancy_density = 0.008f;
@@ -88,6 +174,8 @@ int main(int argc, char* argv[])
     /* Threshold above which the profile will be considered to be dipped */
     float dip_threshold = 0.2f;
 
+    struct detect_params params;
+
     /* if no options given then show help */
     if (argc <= 1) {
         show_help();
@@ -96,6 +184,15 @@ int main(int argc, char* argv[])
 
     /* no filename specified */
     log_filename[0]=0;
+    trace_filename[0]=0;
+    foldstore_directory[0]=0;
+    accumulate_directory[0]=0;
+    periodogram_filename[0]=0;
+    periodogram_image_filename[0]=0;
+    batch_filename[0]=0;
+    manifest_filename[0]=0;
+    results_manifest[0]=0;
+    coordinator_host[0]=0;
 
     /* parse the options */
     for (i = 1; i < argc; i++) {
@@ -204,6 +301,287 @@ int main(int argc, char* argv[])
                 dip_threshold = atof(argv[i]);
             }
         }
+        /* stage timings and rejection counts */
+        if (strcmp(argv[i],"--profile")==0) {
+            profile_enabled = 1;
+        }
+        /* hardware performance counters */
+        if (strcmp(argv[i],"--perf")==0) {
+            perf_enabled = 1;
+        }
+        /* per-thread timeline */
+        if (strcmp(argv[i],"--trace")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(trace_filename,"%s",argv[i]);
+            }
+        }
+        /* directory in which folded light curves are kept */
+        if (strcmp(argv[i],"--foldstore")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(foldstore_directory,"%s",argv[i]);
+            }
+        }
+        /* directory in which the sums within each bucket are kept */
+        if (strcmp(argv[i],"--accumulate")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(accumulate_directory,"%s",argv[i]);
+            }
+        }
+        /* response for every trial period */
+        if (strcmp(argv[i],"--periodogram")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(periodogram_filename,"%s",argv[i]);
+            }
+        }
+        /* plot of the periodogram */
+        if (strcmp(argv[i],"--periodogram-plot")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(periodogram_image_filename,"%s",argv[i]);
+            }
+        }
+        /* merge samples which are close together in time */
+        if (strcmp(argv[i],"--bin")==0) {
+            i++;
+            if (i < argc) {
+                detect_bin_fraction = atof(argv[i]);
+            }
+        }
+        /* how the log files of a batch are read */
+        if (strcmp(argv[i],"--ingest")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"uring")==0) {
+                    ingest_uring = 1;
+                }
+                else if (strcmp(argv[i],"pread")==0) {
+                    ingest_uring = 0;
+                }
+                else {
+                    printf("Unknown ingest method %s\n", argv[i]);
+                    return -15;
+                }
+            }
+        }
+        /* fold samples held as 16 bit magnitudes and 32 bit times */
+        if (strcmp(argv[i],"--compact")==0) {
+            detect_compact = 1;
+        }
+        /* buckets within the light curve of each trial period */
+        if (strcmp(argv[i],"--bins")==0) {
+            i++;
+            if (i < argc) {
+                detect_curve_length = atoi(argv[i]);
+                if ((detect_curve_length < DETECT_MIN_CURVE_LENGTH) ||
+                    (detect_curve_length > DETECT_MAX_CURVE_LENGTH) ||
+                    ((detect_curve_length & (detect_curve_length-1)) != 0)) {
+                    printf("Buckets must be a power of two from %d to %d\n",
+                           DETECT_MIN_CURVE_LENGTH, DETECT_MAX_CURVE_LENGTH);
+                    return -18;
+                }
+            }
+        }
+        /* what is done with stars having no transit-like signal */
+        if (strcmp(argv[i],"--triage")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"skip")==0) {
+                    triage_mode = TRIAGE_SKIP;
+                }
+                else if (strcmp(argv[i],"coarse")==0) {
+                    triage_mode = TRIAGE_COARSE;
+                }
+                else {
+                    printf("Unknown triage %s\n", argv[i]);
+                    return -16;
+                }
+            }
+        }
+        /* fewest fraction of samples far below the median */
+        if (strcmp(argv[i],"--triage-low")==0) {
+            i++;
+            if (i < argc) {
+                triage_min_low_fraction = atof(argv[i]);
+            }
+        }
+        /* greatest upwards skew of the flux */
+        if (strcmp(argv[i],"--triage-skew")==0) {
+            i++;
+            if (i < argc) {
+                triage_max_skew = atof(argv[i]);
+            }
+        }
+        /* fewest nights on which the flux dips */
+        if (strcmp(argv[i],"--triage-dips")==0) {
+            i++;
+            if (i < argc) {
+                triage_min_dip_nights = atoi(argv[i]);
+            }
+        }
+        /* search increment multiplier for stars searched coarsely */
+        if (strcmp(argv[i],"--triage-coarse")==0) {
+            i++;
+            if (i < argc) {
+                triage_coarse_factor = atof(argv[i]);
+                if (triage_coarse_factor < 1) triage_coarse_factor = 1;
+            }
+        }
+        /* most searches made to find the false alarm probability */
+        if (strcmp(argv[i],"--fap")==0) {
+            i++;
+            if (i < argc) {
+                bootstrap_iterations = atoi(argv[i]);
+                if (bootstrap_iterations < 0) bootstrap_iterations = 0;
+            }
+        }
+        /* false alarm probability below which a transit is significant */
+        if (strcmp(argv[i],"--fap-alpha")==0) {
+            i++;
+            if (i < argc) {
+                bootstrap_alpha = atof(argv[i]);
+            }
+        }
+        /* how magnitudes are rearranged for the false alarm probability */
+        if (strcmp(argv[i],"--fap-null")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"permute")==0) {
+                    bootstrap_null = BOOTSTRAP_PERMUTE;
+                }
+                else if (strcmp(argv[i],"nights")==0) {
+                    bootstrap_null = BOOTSTRAP_NIGHTS;
+                }
+                else {
+                    printf("Unknown rearrangement %s\n", argv[i]);
+                    return -19;
+                }
+            }
+        }
+        /* seed for rearranging the magnitudes */
+        if (strcmp(argv[i],"--fap-seed")==0) {
+            i++;
+            if (i < argc) {
+                bootstrap_seed = (unsigned int)atol(argv[i]);
+            }
+        }
+        /* fold only periods within the strongest frequency bands */
+        if (strcmp(argv[i],"--prescreen")==0) {
+            i++;
+            if (i < argc) {
+                detect_prescreen_fraction = atof(argv[i]);
+            }
+        }
+        /* period search engine */
+        if (strcmp(argv[i],"--engine")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"transit")==0) {
+                    engine = ENGINE_TRANSIT;
+                }
+                else if (strcmp(argv[i],"ls")==0) {
+                    engine = ENGINE_LS;
+                }
+                else if (strcmp(argv[i],"pdm")==0) {
+                    engine = ENGINE_PDM;
+                }
+                else {
+                    printf("Unknown engine %s\n", argv[i]);
+                    return -8;
+                }
+            }
+        }
+        /* numbers of phase bins averaged by the PDM engine */
+        if (strcmp(argv[i],"--pdmbins")==0) {
+            i++;
+            if (i < argc) {
+                no_of_pdm_bin_counts = 0;
+                bin_count_str = strtok(argv[i], ",");
+                while ((bin_count_str != NULL) &&
+                       (no_of_pdm_bin_counts < PDM_MAX_BIN_COUNTS)) {
+                    pdm_bin_counts[no_of_pdm_bin_counts] = atoi(bin_count_str);
+                    if (pdm_bin_counts[no_of_pdm_bin_counts] < 2) {
+                        printf("Numbers of PDM bins must be at least 2\n");
+                        return -9;
+                    }
+                    no_of_pdm_bin_counts++;
+                    bin_count_str = strtok(NULL, ",");
+                }
+                if (no_of_pdm_bin_counts == 0) {
+                    printf("No numbers of PDM bins given\n");
+                    return -9;
+                }
+                pdm_bins_given = 1;
+            }
+        }
+        /* list of log files to be searched together */
+        if (strcmp(argv[i],"--batch")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(batch_filename,"%s",argv[i]);
+            }
+        }
+        /* results of earlier searches */
+        if (strcmp(argv[i],"--manifest")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(results_manifest,"%s",argv[i]);
+            }
+        }
+        /* seconds within which to search for the period */
+        if (strcmp(argv[i],"--time-budget")==0) {
+            i++;
+            if (i < argc) {
+                time_budget_seconds = atof(argv[i]);
+            }
+        }
+        /* manifest of stars to hand out to workers */
+        if (strcmp(argv[i],"--serve")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(manifest_filename,"%s",argv[i]);
+            }
+        }
+        /* coordinator from which to take work units */
+        if (strcmp(argv[i],"--worker")==0) {
+            i++;
+            if (i < argc) {
+                sprintf(coordinator_host,"%s",argv[i]);
+            }
+        }
+        /* port on which the coordinator listens */
+        if (strcmp(argv[i],"--port")==0) {
+            i++;
+            if (i < argc) {
+                port = atoi(argv[i]);
+            }
+        }
+        /* number of ranges of the orbital period for each star */
+        if (strcmp(argv[i],"--ranges")==0) {
+            i++;
+            if (i < argc) {
+                ranges = atoi(argv[i]);
+                if (ranges < 1) ranges = 1;
+            }
+        }
+        /* seconds a work unit is leased to a worker for */
+        if (strcmp(argv[i],"--lease")==0) {
+            i++;
+            if (i < argc) {
+                lease_seconds = atoi(argv[i]);
+                if (lease_seconds < 1) lease_seconds = 1;
+            }
+        }
+        /* number of trends common to a batch group to be removed */
+        if (strcmp(argv[i],"--sysrem")==0) {
+            i++;
+            if (i < argc) {
+                sysrem_trends = atoi(argv[i]);
+            }
+        }
         /* table type */
         if ((strcmp(argv[i],"-t")==0) ||
             (strcmp(argv[i],"--type")==0)) {
@@ -233,11 +611,98 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (log_filename[0]==0) {
+    /* the thresholds, and how the search is made, are given to a
+       worker by the coordinator */
+    if (coordinator_host[0] != 0) {
+        return distribute_work(coordinator_host, port);
+    }
+
+    if ((log_filename[0]==0) && (batch_filename[0]==0) &&
+        (manifest_filename[0]==0)) {
         printf("No log file specified\n");
         return -1;
     }
 
+    if ((time_budget_seconds > 0) && (periodogram_filename[0] != 0)) {
+        printf("A periodogram cannot be saved with --time-budget\n");
+        return -12;
+    }
+
+    if ((accumulate_directory[0] != 0) &&
+        ((foldstore_directory[0] != 0) || (detect_bin_fraction > 0) ||
+         (time_budget_seconds > 0) || (batch_filename[0] != 0) ||
+         (manifest_filename[0] != 0) ||
+         (detect_curve_length != DETECT_CURVE_LENGTH))) {
+        printf("--accumulate cannot be combined with --foldstore, --bin, ");
+        printf("--bins, --time-budget, --batch or --serve\n");
+        return -14;
+    }
+
+    /* phase bins are made by merging adjacent buckets, of which there
+       are --bins except when accumulating */
+    if ((engine == ENGINE_PDM) ||
+        ((engine == ENGINE_TRANSIT) && pdm_bins_given)) {
+        for (i = 0; i < no_of_pdm_bin_counts; i++) {
+            if (detect_curve_length % pdm_bin_counts[i] == 0) continue;
+            printf("Numbers of PDM bins must divide %d\n",
+                   detect_curve_length);
+            return -9;
+        }
+    }
+
+    /* the phase dispersion is found within the fold of the full
+       transit search */
+    if ((engine == ENGINE_TRANSIT) && pdm_bins_given &&
+        ((time_budget_seconds > 0) || (accumulate_directory[0] != 0) ||
+         (foldstore_directory[0] != 0) || (batch_filename[0] != 0) ||
+         (manifest_filename[0] != 0))) {
+        printf("--pdmbins with the transit engine cannot be combined ");
+        printf("with --time-budget, --accumulate, --foldstore or --batch\n");
+        return -21;
+    }
+
+    /* workers only make the transit search */
+    if ((manifest_filename[0] != 0) && (batch_filename[0] == 0) &&
+        ((engine != ENGINE_TRANSIT) || (triage_mode != TRIAGE_OFF) ||
+         (time_budget_seconds > 0))) {
+        printf("--serve cannot be combined with --engine, --triage ");
+        printf("or --time-budget\n");
+        return -22;
+    }
+
+    /* stars within a batch are folded together by their own transit
+       search, which has none of these */
+    if ((batch_filename[0] != 0) &&
+        ((engine != ENGINE_TRANSIT) || (detect_bin_fraction > 0) ||
+         (detect_prescreen_fraction > 0) || detect_compact ||
+         (time_budget_seconds > 0) || (foldstore_directory[0] != 0) ||
+         (periodogram_filename[0] != 0))) {
+        printf("--batch cannot be combined with --engine, --bin, ");
+        printf("--prescreen, --compact, --time-budget, --foldstore ");
+        printf("or --periodogram\n");
+        return -23;
+    }
+
+    if ((triage_mode == TRIAGE_COARSE) && (batch_filename[0] != 0)) {
+        printf("Stars within a batch are folded together, so ");
+        printf("--triage coarse cannot be combined with --batch\n");
+        return -17;
+    }
+
+    if ((bootstrap_iterations > 0) &&
+        ((engine != ENGINE_TRANSIT) || (time_budget_seconds > 0) ||
+         (accumulate_directory[0] != 0) || (batch_filename[0] != 0) ||
+         (manifest_filename[0] != 0))) {
+        printf("--fap can only be used with the transit search of a ");
+        printf("single star, without --time-budget or --accumulate\n");
+        return -20;
+    }
+
+    if ((sysrem_trends != 0) && (batch_filename[0]==0)) {
+        printf("Trends can only be removed with --batch\n");
+        return -11;
+    }
+
     if (known_period_days == 0) {
         if (maximum_period_days == 0) {
             printf("No maximum orbital period specified\n");
@@ -251,9 +716,6 @@ int main(int argc, char* argv[])
         }
     }
 
-    /* get the name of the scan from the log filename */
-    scan_name(log_filename, name);
-
     /* change the table columns based upon the format type */
     switch(table_type) {
     case TABLE_TYPE_WASP: {
@@ -268,55 +730,383 @@ int main(int argc, char* argv[])
     }
     }
 
+    params.min_dipped_density = min_dipped_density;
+    params.max_dipped_percent = max_dipped_percent;
+    params.min_intermediate_percent = min_intermediate_percent;
+    params.max_intermediate_percent = max_intermediate_percent;
+    params.expected_dip_radius_percent = expected_dip_radius_percent;
+    params.peak_threshold = peak_threshold;
+    params.max_vacancy_density = max_vacancy_density;
+    params.dip_threshold = dip_threshold;
+
+    /* results of earlier searches which need not be repeated */
+    if ((results_manifest[0] != 0) && (known_period_days == 0)) {
+        manifest_hash =
+            manifest_params_hash(&params,
+                                 minimum_period_days, maximum_period_days,
+                                 search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                 minimum_data_samples,
+                                 time_field_index, flux_field_index,
+                                 engine, time_budget_seconds);
+        if (engine == ENGINE_PDM)
+            manifest_hash =
+                fnv1a_hash(pdm_bin_counts,
+                           no_of_pdm_bin_counts*sizeof(int), manifest_hash);
+        if (manifest_open(results_manifest, manifest_hash) != 0) {
+            printf("Unable to open the manifest %s\n", results_manifest);
+            return -13;
+        }
+    }
+
+    if (trace_filename[0] != 0) {
+        if (trace_open(trace_filename) != 0) {
+            printf("Unable to trace to %s\n", trace_filename);
+            return -6;
+        }
+    }
+
+    /* search many stars, folding those imaged together at once */
+    if (batch_filename[0] != 0) {
+        if (known_period_days != 0) {
+            printf("A known period cannot be given with --batch\n");
+            return scan_close(-10);
+        }
+        return scan_close(batch_search(batch_filename,
+                                       time_field_index, flux_field_index,
+                                       minimum_data_samples,
+                                       minimum_period_days,
+                                       maximum_period_days,
+                                       search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                       &params));
+    }
+
+    /* hand out the stars of a manifest to workers */
+    if (manifest_filename[0] != 0) {
+        if (known_period_days != 0) {
+            printf("A known period cannot be given with --serve\n");
+            return scan_close(-10);
+        }
+        return scan_close(distribute_serve(manifest_filename, port, ranges,
+                                           lease_seconds,
+                                           time_field_index,
+                                           flux_field_index,
+                                           minimum_data_samples,
+                                           minimum_period_days,
+                                           maximum_period_days,
+                                           search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                           &params));
+    }
+
+    /* get the name of the scan from the log filename */
+    scan_name(log_filename, name);
+
+    star_start = trace_begin();
+
+    /* a star which has not changed since it was last searched with
+       the same parameters has the same result */
+    if (manifest_enabled) {
+        if ((manifest_content(log_filename, &content_hash,
+                              &content_length) == 0) &&
+            (manifest_lookup(content_hash, content_length,
+                             &orbital_period_days))) {
+            manifest_close();
+            printf("Unchanged since the last search\n");
+            if (orbital_period_days == 0) {
+                if (engine != ENGINE_TRANSIT)
+                    printf("No period detected\n");
+                else
+                    printf("No transits detected\n");
+                return scan_finish(-5, star_start, name);
+            }
+            printf("orbital_period_days %.6f\n",orbital_period_days);
+
+            /* the plots are made again at the recorded period, since
+               their presence is what marks a candidate */
+            known_period_days = orbital_period_days;
+        }
+    }
+
     /* read the data */
+    stage_start = trace_begin();
+    profile_start(PROFILE_STAGE_LOAD);
     series_length = logfile_load(log_filename,
                                  timestamp,
                                  series,
                                  MAX_SERIES_LENGTH,
                                  time_field_index, flux_field_index);
+    profile_stop(PROFILE_STAGE_LOAD);
+    trace_end("logfile_load", "io", stage_start, series_length, name);
     if (series_length < minimum_data_samples) {
         printf("Number of data samples too small: %d\n", series_length);
-        return 1;
+        return scan_finish(1, star_start, name);
     }
     printf("%d values loaded\n", series_length);
 
+    stage_start = trace_begin();
+    profile_start(PROFILE_STAGE_ENDPOINTS);
     no_of_sections = detect_endpoints(timestamp, series_length,
                                       endpoints);
+    profile_stop(PROFILE_STAGE_ENDPOINTS);
+    trace_end("detect_endpoints", "scan", stage_start, no_of_sections, name);
     if (no_of_sections == 0) {
         printf("No sections detected in the time series\n");
-        return 2;
+        return scan_finish(2, star_start, name);
     }
 
     /*orbital_period_days = 1.3382282f;*/
 
+    /* stars with no plausible transit are skipped, or searched over
+       a coarser grid */
+    if ((triage_mode != TRIAGE_OFF) && (known_period_days == 0)) {
+        stage_start = trace_begin();
+        profile_start(PROFILE_STAGE_TRIAGE);
+        i = triage_star(timestamp, series, series_length,
+                        endpoints, no_of_sections, triage_reason);
+        profile_stop(PROFILE_STAGE_TRIAGE);
+        trace_end("triage", "scan", stage_start, i, name);
+        if (i) {
+            printf("Triage: %s\n", triage_reason);
+            if (triage_mode == TRIAGE_SKIP) {
+                if (manifest_enabled) {
+                    manifest_record(log_filename, content_hash,
+                                    content_length, 0);
+                    manifest_close();
+                }
+                if (engine != ENGINE_TRANSIT)
+                    printf("No period detected\n");
+                else
+                    printf("No transits detected\n");
+                return scan_finish(-5, star_start, name);
+            }
+            search_increment_seconds *= triage_coarse_factor;
+        }
+    }
+
     if (known_period_days == 0) {
-        orbital_period_days =
-            detect_orbital_period(timestamp,
-                                  series, series_length,
+        /* a previous search over the same grid may be rescored
+           without folding the series again */
+        if ((foldstore_directory[0] != 0) && (engine == ENGINE_TRANSIT)) {
+            if (foldstore_open(foldstore_directory, name,
+                               timestamp, series, series_length,
+                               minimum_period_days,
+                               maximum_period_days,
+                               search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                               &store) == 0) {
+                fold_store = &store;
+            }
+            else {
+                printf("Unable to open a fold store within %s\n",
+                       foldstore_directory);
+            }
+        }
+
+        /* sums from a previous search over the same grid, to which
+           only the samples since appended need to be added */
+        if ((accumulate_directory[0] != 0) && (engine != ENGINE_LS)) {
+            if (accumulate_open(accumulate_directory, name,
+                                timestamp, series, series_length,
+                                minimum_period_days,
+                                maximum_period_days,
+                                search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                &accumulators) == 0) {
+                accumulator_store = &accumulators;
+                printf("%d new values to accumulate\n",
+                       series_length - accumulators.folded);
+            }
+            else {
+                printf("Unable to open accumulators within %s\n",
+                       accumulate_directory);
+            }
+        }
+
+        if (periodogram_filename[0] != 0) {
+            increment_days = search_increment_seconds / (60.0f * 60.0f * 24.0f);
+            if (periodogram_open(periodogram_filename, minimum_period_days,
+                                 increment_days,
+                                 (int)((maximum_period_days -
+                                        minimum_period_days) /
+                                       increment_days)) != 0) {
+                printf("Unable to save the periodogram to %s\n",
+                       periodogram_filename);
+                return scan_finish(-7, star_start, name);
+            }
+        }
+
+        stage_start = trace_begin();
+        profile_start(PROFILE_STAGE_SEARCH);
+        perf_reset();
+        switch(engine) {
+        case ENGINE_LS: {
+            orbital_period_days =
+                lomb_scargle_period(timestamp, series, series_length,
+                                    minimum_period_days,
+                                    maximum_period_days,
+                                    search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                    &ls_power);
+            break;
+        }
+        case ENGINE_PDM: {
+            if (accumulator_store != NULL) {
+                orbital_period_days =
+                    detect_pdm_period_incremental(timestamp,
+                                                  series, series_length,
+                                                  minimum_period_days,
+                                                  maximum_period_days,
+                                                  search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                                  pdm_bin_counts,
+                                                  no_of_pdm_bin_counts,
+                                                  accumulator_store,
+                                                  &pdm_theta);
+                break;
+            }
+            orbital_period_days =
+                detect_pdm_period(timestamp, series, series_length,
                                   minimum_period_days,
                                   maximum_period_days,
                                   search_increment_seconds / (60.0f * 60.0f * 24.0f),
-                                  min_dipped_density,
-                                  max_dipped_percent,
-                                  min_intermediate_percent,
-                                  max_intermediate_percent,
-                                  expected_dip_radius_percent,
-                                  peak_threshold,
-                                  max_vacancy_density,
-                                  dip_threshold);
+                                  pdm_bin_counts, no_of_pdm_bin_counts,
+                                  &pdm_theta);
+            break;
+        }
+        default: {
+            if (time_budget_seconds > 0) {
+                orbital_period_days =
+                    detect_orbital_period_anytime(timestamp,
+                                                  series, series_length,
+                                                  minimum_period_days,
+                                                  maximum_period_days,
+                                                  search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                                  &params, fold_store,
+                                                  time_budget_seconds,
+                                                  &max_response,
+                                                  &grid_coverage);
+                break;
+            }
+            if (accumulator_store != NULL) {
+                orbital_period_days =
+                    detect_orbital_period_incremental(timestamp,
+                                                      series, series_length,
+                                                      minimum_period_days,
+                                                      maximum_period_days,
+                                                      search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                                      &params,
+                                                      accumulator_store);
+                break;
+            }
+            if (pdm_bins_given) {
+                /* the phase dispersion is also found from each fold */
+                memcpy(dispersion.bin_counts, pdm_bin_counts,
+                       no_of_pdm_bin_counts*sizeof(int));
+                dispersion.no_of_bin_counts = no_of_pdm_bin_counts;
+                orbital_period_days =
+                    detect_orbital_period_dispersion(timestamp,
+                                                     series, series_length,
+                                                     minimum_period_days,
+                                                     maximum_period_days,
+                                                     search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                                     &params, fold_store,
+                                                     &max_response,
+                                                     &dispersion);
+                break;
+            }
+            orbital_period_days =
+                detect_orbital_period_response(timestamp,
+                                               series, series_length,
+                                               minimum_period_days,
+                                               maximum_period_days,
+                                               search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                                               &params, fold_store,
+                                               &max_response);
+            break;
+        }
+        }
+        profile_stop(PROFILE_STAGE_SEARCH);
+        if (fold_store != NULL) {
+            if (foldstore_close(fold_store) != 0)
+                printf("Unable to save the fold store %s\n",
+                       fold_store->filename);
+        }
+        if (accumulator_store != NULL) {
+            if (accumulate_close(accumulator_store, timestamp, series,
+                                 series_length) != 0)
+                printf("Unable to save the accumulators %s\n",
+                       accumulator_store->filename);
+        }
+        if (periodogram_filename[0] != 0) {
+            if (periodogram_close() != 0)
+                printf("The periodogram %s is incomplete\n",
+                       periodogram_filename);
+            if (periodogram_image_filename[0] != 0) {
+                sprintf(title,"Periodogram for %s",name);
+                periodogram_plot(title, periodogram_image_filename);
+            }
+        }
+        trace_end("period search", "search", stage_start, 0, name);
+        perf_report(stderr, name);
+        if ((time_budget_seconds > 0) && (engine == ENGINE_TRANSIT))
+            printf("grid_coverage %.6f\n", grid_coverage);
+        if (manifest_enabled) {
+            manifest_record(log_filename, content_hash, content_length,
+                            orbital_period_days);
+            manifest_close();
+        }
         if (orbital_period_days == 0) {
-            printf("No transits detected\n");
-            return -5;
+            if (engine != ENGINE_TRANSIT)
+                printf("No period detected\n");
+            else
+                printf("No transits detected\n");
+            return scan_finish(-5, star_start, name);
         }
         printf("orbital_period_days %.6f\n",orbital_period_days);
+        if (engine == ENGINE_LS)
+            printf("ls_power %.6f\n",ls_power);
+        if (engine == ENGINE_PDM)
+            printf("pdm_theta %.6f\n",pdm_theta);
+        if ((engine == ENGINE_TRANSIT) && pdm_bins_given) {
+            printf("response %.6f\n",max_response);
+            printf("pdm_theta %.6f\n",dispersion.theta);
+            printf("pdm_period_days %.6f\n",dispersion.period_days);
+        }
+
+        /* how often the same grid would give as strong a response
+           with the magnitudes rearranged */
+        if (bootstrap_iterations > 0) {
+            stage_start = trace_begin();
+            profile_start(PROFILE_STAGE_BOOTSTRAP);
+            i = bootstrap_fap(timestamp, series, series_length,
+                              minimum_period_days, maximum_period_days,
+                              search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                              &params, max_response, &fap);
+            profile_stop(PROFILE_STAGE_BOOTSTRAP);
+            trace_end("bootstrap", "search", stage_start, fap.iterations,
+                      name);
+            if (i == 0) {
+                printf("false_alarm_probability %.6f\n", fap.probability);
+                printf("false_alarm_iterations %d\n", fap.iterations);
+                if (fap.verdict == BOOTSTRAP_SIGNIFICANT)
+                    printf("Significant\n");
+                if (fap.verdict == BOOTSTRAP_NOT_SIGNIFICANT)
+                    printf("Not significant\n");
+            }
+        }
     }
     else {
         orbital_period_days = known_period_days;
     }
 
+    /* both plots are made from one fold */
+    if (fold_pyramid_create(timestamp, series, series_length,
+                            orbital_period_days,
+                            (detect_curve_length > LIGHT_CURVE_LENGTH) ?
+                            detect_curve_length : LIGHT_CURVE_LENGTH,
+                            &pyramid) == 0)
+        fold_pyramid = &pyramid;
+
     sprintf(light_curve_filename,"%s.png",name);
     sprintf(light_curve_distribution_filename,"%s_distr.png",name);
     sprintf(title,"SuperWASP Light Curve for %s",name);
+    stage_start = trace_begin();
+    profile_start(PROFILE_STAGE_PLOT_DISTRIBUTION);
     gnuplot_light_curve_distribution(title,
                                      timestamp, series, series_length,
                                      light_curve_distribution_filename,
@@ -324,7 +1114,11 @@ int main(int argc, char* argv[])
                                      0.44,0.93,
                                      "TAMUZ corrected processed flux (micro Vega)",
                                      orbital_period_days,
-                                     vertical_scale);
+                                     vertical_scale, fold_pyramid);
+    profile_stop(PROFILE_STAGE_PLOT_DISTRIBUTION);
+    trace_end("plot distribution", "plot", stage_start, 0, name);
+    stage_start = trace_begin();
+    profile_start(PROFILE_STAGE_PLOT_LIGHT_CURVE);
     gnuplot_light_curve(title,
                         timestamp, series, series_length,
                         light_curve_filename,
@@ -332,8 +1126,11 @@ int main(int argc, char* argv[])
                         0.44,0.93,
                         "TAMUZ corrected processed flux (micro Vega)",
                         orbital_period_days,
-                        vertical_scale);
+                        vertical_scale, fold_pyramid);
+    profile_stop(PROFILE_STAGE_PLOT_LIGHT_CURVE);
+    trace_end("plot light curve", "plot", stage_start, 0, name);
 
+    if (fold_pyramid != NULL) fold_pyramid_free(fold_pyramid);
     gnuplot_tidy();
-    return 0;
+    return scan_finish(0, star_start, name);
 }
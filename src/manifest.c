@@ -0,0 +1,268 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Remembers the result of every search, so that a star which has not
+   changed need not be searched again with the same parameters. Each
+   result is keyed by a hash of the contents of the log file, its
+   length, and a hash of the search parameters together with the
+   version and build of this program, so renaming or moving a file
+   does not cause it to be searched again but any change to the file
+   or to the search does.
+
+   The manifest is a text file with one line per search:
+
+       <content hash> <length> <parameters hash> <period days> <filename>
+
+   Lines are only ever appended, so that several searches may record
+   into the same manifest, and where the same key appears more than
+   once the last line is used. */
+
+#include "waspscan.h"
+
+/* first line of a manifest */
+#define MANIFEST_HEADER  "# waspscan manifest 1"
+
+/* size of the blocks in which log files are read when hashing */
+#define MANIFEST_BLOCK   65536
+
+struct manifest_entry {
+    unsigned long long content_hash;
+    long length;
+    unsigned int params_hash;
+    float period_days;
+};
+
+/* whether a manifest is being used */
+int manifest_enabled = 0;
+
+static char manifest_filename[MAX_FILENAME_LENGTH];
+static unsigned int manifest_params = 0;
+static struct manifest_entry * manifest_entries = NULL;
+static int manifest_length = 0;
+static int manifest_max_length = 0;
+
+/**
+ * @brief Adds an entry to those held in memory
+ * @param entry The entry
+ * @returns zero on success
+ */
+static int manifest_add(struct manifest_entry * entry)
+{
+    struct manifest_entry * grown;
+
+    if (manifest_length >= manifest_max_length) {
+        manifest_max_length =
+            (manifest_max_length == 0) ? 1024 : manifest_max_length*2;
+        grown = (struct manifest_entry*)
+            realloc(manifest_entries,
+                    manifest_max_length*sizeof(struct manifest_entry));
+        if (grown == NULL) return -1;
+        manifest_entries = grown;
+    }
+    manifest_entries[manifest_length++] = *entry;
+    return 0;
+}
+
+/**
+ * @brief Returns a hash of everything which affects the result of a
+ *        search, other than the log file itself
+ * @param params Detection thresholds
+ * @param min_period_days The minimum orbital period in days
+ * @param max_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param minimum_data_samples Stars with fewer samples are not searched
+ * @param time_field_index Field containing the time
+ * @param flux_field_index Field containing the magnitude
+ * @param engine The period search engine
+ * @param time_budget_seconds Time within which to search, or zero
+ * @returns The hash
+ */
+unsigned int manifest_params_hash(struct detect_params * params,
+                                  float min_period_days,
+                                  float max_period_days,
+                                  float increment_days,
+                                  int minimum_data_samples,
+                                  int time_field_index, int flux_field_index,
+                                  int engine, float time_budget_seconds)
+{
+    char linestr[512];
+
+    /* a new build may search differently */
+    snprintf(linestr, sizeof(linestr),
+             "%.2f %s %s|%.9g %.9g %.9g %d %d %d %d %.9g|"
+             "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g|%.9g %.9g %d %d|"
+             "%d %.9g %.9g %d %.9g|%d",
+             VERSION, __DATE__, __TIME__,
+             min_period_days, max_period_days, increment_days,
+             minimum_data_samples, time_field_index, flux_field_index,
+             engine, time_budget_seconds,
+             params->min_dipped_density, params->max_dipped_percent,
+             params->min_intermediate_percent,
+             params->max_intermediate_percent,
+             params->expected_dip_radius_percent, params->peak_threshold,
+             params->max_vacancy_density, params->dip_threshold,
+             detect_bin_fraction, detect_prescreen_fraction, sysrem_trends,
+             detect_compact, triage_mode, triage_min_low_fraction,
+             triage_max_skew, triage_min_dip_nights, triage_coarse_factor,
+             detect_curve_length);
+    return fnv1a_hash(linestr, strlen(linestr), FNV1A_OFFSET);
+}
+
+/**
+ * @brief Hashes the contents of a log file
+ * @param filename The log file
+ * @param content_hash Returned hash of its contents
+ * @param length Returned length in bytes
+ * @returns zero on success
+ */
+int manifest_content(char * filename,
+                     unsigned long long * content_hash, long * length)
+{
+    FILE * fp;
+    unsigned char * block;
+    size_t n;
+
+    *content_hash = FNV1A64_OFFSET;
+    *length = 0;
+    fp = fopen(filename, "rb");
+    if (!fp) return -1;
+    block = (unsigned char*)malloc(MANIFEST_BLOCK);
+    if (block == NULL) {
+        fclose(fp);
+        return -2;
+    }
+    while ((n = fread(block, 1, MANIFEST_BLOCK, fp)) > 0) {
+        *content_hash = fnv1a_hash64(block, n, *content_hash);
+        *length += (long)n;
+    }
+    free(block);
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @brief Loads a manifest, creating it if it does not yet exist
+ * @param filename The manifest file
+ * @param params_hash Hash of the parameters of the searches to be made
+ * @returns zero on success
+ */
+int manifest_open(char * filename, unsigned int params_hash)
+{
+    FILE * fp;
+    char linestr[MAX_FILENAME_LENGTH + 128];
+    struct manifest_entry entry;
+
+    sprintf(manifest_filename, "%s", filename);
+    manifest_params = params_hash;
+    manifest_length = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fp = fopen(filename, "w");
+        if (!fp) return -1;
+        fprintf(fp, "%s\n", MANIFEST_HEADER);
+        fclose(fp);
+        manifest_enabled = 1;
+        return 0;
+    }
+
+    while (fgets(linestr, sizeof(linestr)-1, fp) != NULL) {
+        if (linestr[0] == '#') continue;
+        if (sscanf(linestr, "%llx %ld %x %f",
+                   &entry.content_hash, &entry.length,
+                   &entry.params_hash, &entry.period_days) != 4)
+            continue;
+        if (entry.params_hash != params_hash) continue;
+        if (manifest_add(&entry) != 0) break;
+    }
+    fclose(fp);
+    manifest_enabled = 1;
+    return 0;
+}
+
+/**
+ * @brief Finds the result of an earlier search of the same log file
+ *        with the same parameters
+ * @param content_hash Hash of the contents of the log file
+ * @param length Length of the log file in bytes
+ * @param period_days Returned orbital period, or zero if none was found
+ * @returns Non-zero if there was an earlier search
+ */
+int manifest_lookup(unsigned long long content_hash, long length,
+                    float * period_days)
+{
+    int i;
+
+    if (!manifest_enabled) return 0;
+
+    /* later results replace earlier ones */
+    for (i = manifest_length-1; i >= 0; i--) {
+        if ((manifest_entries[i].content_hash != content_hash) ||
+            (manifest_entries[i].length != length))
+            continue;
+        *period_days = manifest_entries[i].period_days;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Records the result of a search
+ * @param log_filename The log file searched
+ * @param content_hash Hash of the contents of the log file
+ * @param length Length of the log file in bytes
+ * @param period_days Orbital period found, or zero if none
+ * @returns zero on success
+ */
+int manifest_record(char * log_filename,
+                    unsigned long long content_hash, long length,
+                    float period_days)
+{
+    FILE * fp;
+    struct manifest_entry entry;
+
+    if (!manifest_enabled) return 0;
+
+    entry.content_hash = content_hash;
+    entry.length = length;
+    entry.params_hash = manifest_params;
+    entry.period_days = period_days;
+    manifest_add(&entry);
+
+    /* a single short append, so that concurrent searches recording
+       into the same manifest do not interleave their lines */
+    fp = fopen(manifest_filename, "a");
+    if (!fp) return -1;
+    fprintf(fp, "%016llx %ld %08x %.6f %s\n", content_hash, length,
+            manifest_params, period_days, log_filename);
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @brief Frees the manifest held in memory
+ */
+void manifest_close()
+{
+    free(manifest_entries);
+    manifest_entries = NULL;
+    manifest_length = 0;
+    manifest_max_length = 0;
+    manifest_enabled = 0;
+}
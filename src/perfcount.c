@@ -0,0 +1,294 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "waspscan.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* counters within each group */
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_L1D_MISSES     2
+#define PERF_LLC_MISSES     3
+#define PERF_BRANCH_MISSES  4
+#define PERF_COUNTERS       5
+
+/* whether hardware counters are being sampled */
+int perf_enabled = 0;
+
+/* set when the counters could not be opened on this host */
+static int perf_unavailable = 0;
+
+static const char * section_names[PERF_SECTIONS] = {
+    "fold",
+    "resample",
+    "score"
+};
+
+static const char * counter_names[PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "L1D misses",
+    "LLC misses",
+    "branch misses"
+};
+
+/* totals for each section and counter, summed over all threads */
+static unsigned long long perf_totals[PERF_SECTIONS][PERF_COUNTERS];
+static long perf_trials = 0;
+
+/* counter group for each thread, opened on first use */
+static _Thread_local int perf_group_fd = -1;
+static _Thread_local int perf_group_opened = 0;
+static _Thread_local int perf_counter_slot[PERF_COUNTERS];
+static _Thread_local int perf_group_size = 0;
+static _Thread_local int perf_have_baseline = 0;
+static _Thread_local unsigned long long perf_baseline[PERF_COUNTERS];
+
+#ifdef __linux__
+/**
+ * @brief Opens a single counter for the calling thread
+ * @param type Type of the event
+ * @param config Configuration of the event
+ * @param group_fd Leader of the group, or -1 for a new group
+ * @returns File descriptor, or -1 if unavailable
+ */
+static int perf_open_counter(unsigned int type, unsigned long long config,
+                             int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+/**
+ * @brief Opens the counter group for the calling thread.
+ *        Counters which the host does not support are left out.
+ * @returns zero on success
+ */
+static int perf_thread_open()
+{
+#ifdef __linux__
+    unsigned int type[PERF_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    unsigned long long config[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int i, fd;
+
+    perf_group_opened = 1;
+    perf_group_size = 0;
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        perf_counter_slot[i] = -1;
+        fd = perf_open_counter(type[i], config[i], perf_group_fd);
+        if (fd < 0) {
+            /* without cycles there is no group to add to */
+            if (i == PERF_CYCLES) return -1;
+            continue;
+        }
+        if (perf_group_fd == -1) perf_group_fd = fd;
+        perf_counter_slot[i] = perf_group_size++;
+    }
+    ioctl(perf_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+#else
+    perf_group_opened = 1;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Reads the counter group for the calling thread
+ * @param values Returned counter values
+ * @returns zero on success
+ */
+static int perf_read(unsigned long long values[])
+{
+#ifdef __linux__
+    unsigned long long buffer[1 + PERF_COUNTERS];
+    int i;
+
+    if (read(perf_group_fd, buffer, sizeof(buffer)) <
+        (ssize_t)((1 + perf_group_size) * sizeof(unsigned long long)))
+        return -1;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        values[i] = 0;
+        if (perf_counter_slot[i] >= 0)
+            values[i] = buffer[1 + perf_counter_slot[i]];
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Clears the totals, for example before searching another star
+ */
+void perf_reset()
+{
+    memset(perf_totals, 0, sizeof(perf_totals));
+    perf_trials = 0;
+}
+
+/**
+ * @brief Takes a baseline reading for the calling thread, from which
+ *        subsequent marks are measured
+ */
+void perf_begin()
+{
+    if ((!perf_enabled) || perf_unavailable) return;
+
+    if (!perf_group_opened) {
+        if (perf_thread_open() != 0) {
+            perf_unavailable = 1;
+            return;
+        }
+    }
+    if (perf_group_fd < 0) return;
+    perf_have_baseline = (perf_read(perf_baseline) == 0);
+}
+
+/**
+ * @brief Attributes the counts since the previous mark to a section
+ * @param section Index of the section, one of the PERF_SECTION_ values
+ */
+void perf_mark(int section)
+{
+    unsigned long long values[PERF_COUNTERS];
+    int i;
+
+    if ((!perf_enabled) || (!perf_have_baseline)) return;
+    if (perf_read(values) != 0) return;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+#pragma omp atomic
+        perf_totals[section][i] += values[i] - perf_baseline[i];
+        perf_baseline[i] = values[i];
+    }
+    if (section == PERF_SECTION_FOLD) {
+#pragma omp atomic
+        perf_trials++;
+    }
+}
+
+/**
+ * @brief Attributes the counts since the previous mark to a section
+ *        and stops measuring on the calling thread
+ * @param section Index of the section, one of the PERF_SECTION_ values
+ */
+void perf_end(int section)
+{
+    perf_mark(section);
+    perf_have_baseline = 0;
+}
+
+/**
+ * @brief Prints a row of counter values
+ * @param fp File to print to
+ * @param name Name of the row
+ * @param values Counter values
+ * @param trials Number of trial periods to divide by
+ */
+static void perf_report_row(FILE * fp, const char * name,
+                            unsigned long long values[], long trials)
+{
+    int i;
+    double ipc = 0;
+
+    fprintf(fp,"%-10s", name);
+    for (i = 0; i < PERF_COUNTERS; i++)
+        fprintf(fp," %14.1f", values[i]/(double)trials);
+    if (values[PERF_CYCLES] > 0)
+        ipc = values[PERF_INSTRUCTIONS]/(double)values[PERF_CYCLES];
+    fprintf(fp," %6.2f\n", ipc);
+}
+
+/**
+ * @brief Prints counts per trial period for each section, and for the
+ *        whole star
+ * @param fp File to print to
+ * @param name Name of the star
+ */
+void perf_report(FILE * fp, char * name)
+{
+    int s, i;
+    unsigned long long total[PERF_COUNTERS];
+    double mpki = 0, ipc = 0;
+
+    if (!perf_enabled) return;
+
+    if (perf_unavailable) {
+        fprintf(fp,"Hardware counters are unavailable on this host\n");
+        return;
+    }
+    if (perf_trials == 0) return;
+
+    fprintf(fp,"Hardware counters for %s over %ld trial periods\n",
+            name, perf_trials);
+    fprintf(fp,"%-10s", "per period");
+    for (i = 0; i < PERF_COUNTERS; i++)
+        fprintf(fp," %14s", counter_names[i]);
+    fprintf(fp," %6s\n", "IPC");
+
+    memset(total, 0, sizeof(total));
+    for (s = 0; s < PERF_SECTIONS; s++) {
+        perf_report_row(fp, section_names[s], perf_totals[s], perf_trials);
+        for (i = 0; i < PERF_COUNTERS; i++) total[i] += perf_totals[s][i];
+    }
+    perf_report_row(fp, "total", total, perf_trials);
+
+    fprintf(fp,"Star totals:");
+    for (i = 0; i < PERF_COUNTERS; i++)
+        fprintf(fp," %s %llu", counter_names[i], total[i]);
+    fprintf(fp,"\n");
+
+    /* LLC misses per thousand instructions together with IPC give
+       a rough indication of what limits throughput on this host */
+    if (total[PERF_INSTRUCTIONS] > 0)
+        mpki = total[PERF_LLC_MISSES]*1000.0/(double)total[PERF_INSTRUCTIONS];
+    if (total[PERF_CYCLES] > 0)
+        ipc = total[PERF_INSTRUCTIONS]/(double)total[PERF_CYCLES];
+    fprintf(fp,"LLC MPKI %.3f IPC %.2f: likely %s bound\n", mpki, ipc,
+            ((mpki > 1.0) && (ipc < 1.0)) ? "memory" : "compute");
+}
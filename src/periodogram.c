@@ -0,0 +1,252 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Streams the response for every trial period of a search to file.
+   Chunks of trial periods complete out of order, so any which arrive
+   early are held until the chunks before them have been written.
+   Chunks are handed out in order, so usually only a few are held, but
+   one slow chunk can hold back every chunk finished while it is being
+   searched. Searches which find their trial periods in order, such as
+   Lomb-Scargle, never have any held.
+
+   The binary format is a header followed by one little endian 32 bit
+   float for each trial period. Scored periods have their response,
+   which is never negative. Rejected periods have -(gate+1), where gate
+   is the PROFILE_GATE_ value at which they were rejected. */
+
+#include "waspscan.h"
+
+/* identifies a periodogram file */
+#define PERIODOGRAM_MAGIC    "WASPPGRM"
+#define PERIODOGRAM_VERSION  1
+
+/* number of points within the decimated plot */
+#define PERIODOGRAM_PLOT_POINTS 2048
+
+struct periodogram_chunk {
+    int first_step;
+    int count;
+    float * values;
+    struct periodogram_chunk * next;
+};
+
+/* whether the periodogram is being saved */
+int periodogram_enabled = 0;
+
+static FILE * periodogram_file = NULL;
+static int periodogram_csv = 0;
+static int periodogram_steps = 0;
+static int periodogram_next_step = 0;
+static float periodogram_min_period_days = 0;
+static float periodogram_increment_days = 0;
+static int periodogram_plot_points = 0;
+
+/* chunks which arrived before the chunks preceding them, in order */
+static struct periodogram_chunk * periodogram_pending = NULL;
+
+/* maximum response within each point of the decimated plot */
+static float periodogram_plot_response[PERIODOGRAM_PLOT_POINTS];
+
+/**
+ * @brief Begins saving a periodogram. If the filename ends with .csv
+ *        then it is saved as text, otherwise in binary form.
+ * @param filename The file to be written
+ * @param min_period_days The minimum orbital period in days
+ * @param increment_days The time increment used within the search
+ * @param steps The number of trial periods
+ * @returns zero on success
+ */
+int periodogram_open(char * filename, float min_period_days,
+                     float increment_days, int steps)
+{
+    int version = PERIODOGRAM_VERSION;
+    int len = strlen(filename);
+
+    periodogram_file = fopen(filename, "wb");
+    if (!periodogram_file) return -1;
+
+    periodogram_csv =
+        ((len > 4) && (strcmp(&filename[len-4], ".csv") == 0));
+    periodogram_steps = steps;
+    periodogram_next_step = 0;
+    periodogram_min_period_days = min_period_days;
+    periodogram_increment_days = increment_days;
+    memset(periodogram_plot_response, 0, sizeof(periodogram_plot_response));
+    periodogram_plot_points = PERIODOGRAM_PLOT_POINTS;
+    if (steps < periodogram_plot_points) periodogram_plot_points = steps;
+
+    if (periodogram_csv) {
+        fprintf(periodogram_file, "period_days,response,gate\n");
+    }
+    else {
+        fwrite(PERIODOGRAM_MAGIC, 1, 8, periodogram_file);
+        fwrite(&version, sizeof(int), 1, periodogram_file);
+        fwrite(&steps, sizeof(int), 1, periodogram_file);
+        fwrite(&min_period_days, sizeof(float), 1, periodogram_file);
+        fwrite(&increment_days, sizeof(float), 1, periodogram_file);
+    }
+    periodogram_enabled = 1;
+    return 0;
+}
+
+/**
+ * @brief Writes the values for a chunk of consecutive trial periods
+ * @param first_step Index of the first trial period within the chunk
+ * @param values Value for each trial period
+ * @param count Number of trial periods
+ */
+static void periodogram_write(int first_step, float values[], int count)
+{
+    int i, point;
+    float period_days;
+
+    if (periodogram_csv) {
+        for (i = 0; i < count; i++) {
+            period_days = periodogram_min_period_days +
+                ((first_step + i) * periodogram_increment_days);
+            if (values[i] >= 0)
+                fprintf(periodogram_file, "%.8f,%.8f,%s\n",
+                        period_days, values[i],
+                        profile_gate_name(PROFILE_GATE_SCORED));
+            else
+                fprintf(periodogram_file, "%.8f,0,%s\n", period_days,
+                        profile_gate_name((int)(-values[i]) - 1));
+        }
+    }
+    else {
+        fwrite(values, sizeof(float), count, periodogram_file);
+    }
+
+    for (i = 0; i < count; i++) {
+        point = (int)((first_step + i) * (long)periodogram_plot_points /
+                      periodogram_steps);
+        if (values[i] > periodogram_plot_response[point])
+            periodogram_plot_response[point] = values[i];
+    }
+    periodogram_next_step = first_step + count;
+}
+
+/**
+ * @brief Adds the values for a chunk of consecutive trial periods.
+ *        This may be called from within parallel loops, with chunks
+ *        in any order.
+ * @param first_step Index of the first trial period within the chunk
+ * @param values Response for each scored trial period, or -(gate+1)
+ *        for each rejected trial period
+ * @param count Number of trial periods
+ */
+void periodogram_add(int first_step, float values[], int count)
+{
+    struct periodogram_chunk * chunk, ** prev;
+
+    if (!periodogram_enabled) return;
+
+#pragma omp critical (periodogram)
+    {
+        if (first_step != periodogram_next_step) {
+            /* hold this chunk until the ones before it arrive */
+            chunk = (struct periodogram_chunk*)
+                malloc(sizeof(struct periodogram_chunk));
+            if (chunk != NULL) {
+                chunk->values = (float*)malloc(count*sizeof(float));
+                if (chunk->values == NULL) {
+                    free(chunk);
+                    chunk = NULL;
+                }
+            }
+            if (chunk != NULL) {
+                chunk->first_step = first_step;
+                chunk->count = count;
+                memcpy(chunk->values, values, count*sizeof(float));
+                prev = &periodogram_pending;
+                while ((*prev != NULL) && ((*prev)->first_step < first_step))
+                    prev = &(*prev)->next;
+                chunk->next = *prev;
+                *prev = chunk;
+            }
+        }
+        else {
+            periodogram_write(first_step, values, count);
+
+            /* write any held chunks which now follow on */
+            while ((periodogram_pending != NULL) &&
+                   (periodogram_pending->first_step ==
+                    periodogram_next_step)) {
+                chunk = periodogram_pending;
+                periodogram_pending = chunk->next;
+                periodogram_write(chunk->first_step, chunk->values,
+                                  chunk->count);
+                free(chunk->values);
+                free(chunk);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finishes saving the periodogram
+ * @returns zero on success, or -1 if any trial periods were missing
+ */
+int periodogram_close()
+{
+    struct periodogram_chunk * chunk;
+    int retval = 0;
+
+    if (!periodogram_enabled) return 0;
+    periodogram_enabled = 0;
+
+    /* only possible if memory ran out while holding a chunk */
+    while (periodogram_pending != NULL) {
+        chunk = periodogram_pending;
+        periodogram_pending = chunk->next;
+        free(chunk->values);
+        free(chunk);
+        retval = -1;
+    }
+    if (periodogram_next_step != periodogram_steps) retval = -1;
+
+    fclose(periodogram_file);
+    periodogram_file = NULL;
+    return retval;
+}
+
+/**
+ * @brief Plots the periodogram, showing the maximum response within
+ *        each of a fixed number of ranges of the orbital period
+ * @param title Title for the plot
+ * @param image_filename Filename for the image to save as
+ * @returns result of the call to system()
+ */
+int periodogram_plot(char * title, char * image_filename)
+{
+    float period_days[PERIODOGRAM_PLOT_POINTS];
+    int i;
+
+    if (periodogram_plot_points < 2) return -1;
+
+    for (i = 0; i < periodogram_plot_points; i++) {
+        period_days[i] = periodogram_min_period_days +
+            ((float)i * periodogram_steps / (float)periodogram_plot_points *
+             periodogram_increment_days);
+    }
+    return gnuplot_periodogram(title, period_days,
+                               periodogram_plot_response,
+                               periodogram_plot_points,
+                               image_filename, 1024, 640);
+}
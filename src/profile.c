@@ -0,0 +1,148 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include "waspscan.h"
+
+/* whether stage timings and rejection counts are being collected */
+int profile_enabled = 0;
+
+static const char * stage_names[PROFILE_STAGES] = {
+    "logfile_load",
+    "detect_endpoints",
+    "triage",
+    "period search",
+    "bootstrap",
+    "plot distribution",
+    "plot light curve"
+};
+
+static const char * gate_names[PROFILE_GATES] = {
+    "missing data",
+    "gaps",
+    "no dip",
+    "dip too wide",
+    "too many dipped",
+    "dipped density",
+    "peak",
+    "intermediates",
+    "flat curve",
+    "vacancy",
+    "scored",
+    "prescreen"
+};
+
+static double stage_start_wall[PROFILE_STAGES];
+static double stage_start_cpu[PROFILE_STAGES];
+static double stage_wall[PROFILE_STAGES];
+static double stage_cpu[PROFILE_STAGES];
+static int stage_calls[PROFILE_STAGES];
+static long gate_count[PROFILE_GATES];
+
+/**
+ * @brief Returns the time in seconds for the given clock
+ * @param clock_id The clock to be read
+ * @returns Time in seconds
+ */
+static double profile_clock(clockid_t clock_id)
+{
+    struct timespec ts;
+
+    clock_gettime(clock_id, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1.0e-9);
+}
+
+/**
+ * @brief Starts timing a stage
+ * @param stage Index of the stage, one of the PROFILE_STAGE_ values
+ */
+void profile_start(int stage)
+{
+    if (!profile_enabled) return;
+    stage_start_wall[stage] = profile_clock(CLOCK_MONOTONIC);
+    stage_start_cpu[stage] = profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * @brief Stops timing a stage and adds the elapsed time to its total.
+ *        CPU time is for the whole process, so within parallel stages
+ *        it will exceed the wall time.
+ * @param stage Index of the stage, one of the PROFILE_STAGE_ values
+ */
+void profile_stop(int stage)
+{
+    if (!profile_enabled) return;
+    stage_wall[stage] +=
+        profile_clock(CLOCK_MONOTONIC) - stage_start_wall[stage];
+    stage_cpu[stage] +=
+        profile_clock(CLOCK_PROCESS_CPUTIME_ID) - stage_start_cpu[stage];
+    stage_calls[stage]++;
+}
+
+/**
+ * @brief Records the gate which a trial period stopped at.
+ *        This may be called from within parallel loops.
+ * @param gate Index of the gate, one of the PROFILE_GATE_ values
+ */
+void profile_gate(int gate)
+{
+    if (!profile_enabled) return;
+#pragma omp atomic
+    gate_count[gate]++;
+}
+
+/**
+ * @brief Returns the name of a gate
+ * @param gate Index of the gate, one of the PROFILE_GATE_ values
+ * @returns Name of the gate
+ */
+const char * profile_gate_name(int gate)
+{
+    if ((gate < 0) || (gate >= PROFILE_GATES)) return "unknown";
+    return gate_names[gate];
+}
+
+/**
+ * @brief Prints stage timings and trial period rejection counts
+ * @param fp File to print to
+ */
+void profile_report(FILE * fp)
+{
+    int i;
+    long trials = 0;
+
+    if (!profile_enabled) return;
+
+    fprintf(fp,"%-20s %6s %12s %12s\n","stage","calls","wall (s)","cpu (s)");
+    for (i = 0; i < PROFILE_STAGES; i++) {
+        if (stage_calls[i] == 0) continue;
+        fprintf(fp,"%-20s %6d %12.4f %12.4f\n", stage_names[i],
+                stage_calls[i], stage_wall[i], stage_cpu[i]);
+    }
+
+    for (i = 0; i < PROFILE_GATES; i++) trials += gate_count[i];
+    if (trials == 0) return;
+
+    fprintf(fp,"\n%-20s %12s %8s\n","gate","periods","percent");
+    for (i = 0; i < PROFILE_GATES; i++) {
+        fprintf(fp,"%-20s %12ld %7.2f%%\n", gate_names[i],
+                gate_count[i], gate_count[i]*100.0/(double)trials);
+    }
+    fprintf(fp,"%-20s %12ld\n","trial periods",trials);
+}
@@ -0,0 +1,156 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Removal of systematic trends which are common to the stars of one
+   field, such as from airmass, cloud or the detector, using the SysRem
+   method of Tamuz, Mazeh and Zucker (2005). The residual of star i at
+   exposure j is modelled as c[i]*a[j], where a[j] is shared by every
+   star and c[i] is the response of each star to it. Each is found in
+   turn by weighted least squares with the other held fixed, and once
+   they converge the product is subtracted. Further trends are then
+   found from what remains. */
+
+#include "waspscan.h"
+
+/* iterations of the alternating fit for each trend */
+#define SYSREM_MAX_ITERATIONS  50
+
+/* change in the summed squared residual at which the fit has converged */
+#define SYSREM_CONVERGENCE     1.0e-6
+
+/* number of trends to be removed from each field, or zero for none */
+int sysrem_trends = 0;
+
+/**
+ * @brief Removes the strongest trends common to a field of stars
+ * @param series Magnitudes, star-minor, so that the value for star s
+ *        at exposure i is series[i*stars + s]. Returned with the
+ *        trends removed.
+ * @param weight One where a star has a sample at an exposure and zero
+ *        otherwise, star-minor
+ * @param series_length Number of exposures
+ * @param stars Number of stars
+ * @param trends Number of trends to remove
+ * @returns zero on success
+ */
+int sysrem_detrend(float series[], float weight[],
+                   int series_length, int stars, int trends)
+{
+    int t, iteration, s;
+    double * residual, * w, * c, * a, * star_mean;
+    double chi2, prev_chi2 = -1;
+
+    if ((stars < SYSREM_MIN_STARS) || (series_length < 2) || (trends < 1))
+        return -1;
+
+    residual = (double*)malloc((size_t)series_length*stars*sizeof(double));
+    w = (double*)malloc((size_t)series_length*stars*sizeof(double));
+    c = (double*)malloc(stars*sizeof(double));
+    a = (double*)malloc(series_length*sizeof(double));
+    star_mean = (double*)calloc(stars, sizeof(double));
+    if ((residual == NULL) || (w == NULL) || (c == NULL) || (a == NULL) ||
+        (star_mean == NULL)) {
+        free(residual);
+        free(w);
+        free(c);
+        free(a);
+        free(star_mean);
+        return -2;
+    }
+
+    /* residuals from the average of each star, weighted by the
+       inverse of its variance so that noisy stars count for less */
+#pragma omp parallel for
+    for (s = 0; s < stars; s++) {
+        double total = 0, variance = 0;
+        for (int i = 0; i < series_length; i++) {
+            star_mean[s] += series[i*stars + s]*weight[i*stars + s];
+            total += weight[i*stars + s];
+        }
+        if (total > 0) star_mean[s] /= total;
+        for (int i = 0; i < series_length; i++) {
+            residual[i*stars + s] =
+                (series[i*stars + s] - star_mean[s])*weight[i*stars + s];
+            variance += residual[i*stars + s]*residual[i*stars + s];
+        }
+        if (variance > 0) variance /= total;
+        for (int i = 0; i < series_length; i++)
+            w[i*stars + s] = (variance > 0) ?
+                weight[i*stars + s] / variance : 0;
+    }
+
+    for (t = 0; t < trends; t++) {
+        for (int i = 0; i < series_length; i++) a[i] = 1;
+
+        for (iteration = 0; iteration < SYSREM_MAX_ITERATIONS; iteration++) {
+            /* response of each star to the trend */
+#pragma omp parallel for
+            for (s = 0; s < stars; s++) {
+                double num = 0, den = 0;
+                for (int i = 0; i < series_length; i++) {
+                    num += residual[i*stars + s]*a[i]*w[i*stars + s];
+                    den += a[i]*a[i]*w[i*stars + s];
+                }
+                c[s] = (den > 0) ? num / den : 0;
+            }
+
+            /* the trend at each exposure */
+            chi2 = 0;
+#pragma omp parallel for reduction(+:chi2)
+            for (int i = 0; i < series_length; i++) {
+                double num = 0, den = 0, r;
+                for (int j = 0; j < stars; j++) {
+                    num += residual[i*stars + j]*c[j]*w[i*stars + j];
+                    den += c[j]*c[j]*w[i*stars + j];
+                }
+                a[i] = (den > 0) ? num / den : 0;
+                for (int j = 0; j < stars; j++) {
+                    r = residual[i*stars + j] - c[j]*a[i];
+                    chi2 += r*r*w[i*stars + j];
+                }
+            }
+
+            if ((prev_chi2 >= 0) &&
+                (fabs(prev_chi2 - chi2) <= SYSREM_CONVERGENCE*prev_chi2))
+                break;
+            prev_chi2 = chi2;
+        }
+        prev_chi2 = -1;
+
+#pragma omp parallel for
+        for (int i = 0; i < series_length; i++)
+            for (int j = 0; j < stars; j++)
+                if (weight[i*stars + j] != 0)
+                    residual[i*stars + j] -= c[j]*a[i];
+    }
+
+#pragma omp parallel for
+    for (s = 0; s < stars; s++)
+        for (int i = 0; i < series_length; i++)
+            if (weight[i*stars + s] != 0)
+                series[i*stars + s] =
+                    (float)(star_mean[s] + residual[i*stars + s]);
+
+    free(residual);
+    free(w);
+    free(c);
+    free(a);
+    free(star_mean);
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include "waspscan.h"
+
+/* maximum number of threads which may record spans */
+#define TRACE_MAX_THREADS 256
+
+/* maximum number of spans recorded by each thread */
+#define TRACE_MAX_SPANS   65536
+
+/* length of the optional detail text attached to a span */
+#define TRACE_DETAIL_LENGTH 64
+
+struct trace_span {
+    const char * name;
+    const char * category;
+    double start;
+    double duration;
+    int arg;
+    char detail[TRACE_DETAIL_LENGTH];
+};
+
+struct trace_buffer {
+    struct trace_span * spans;
+    int count;
+    int dropped;
+};
+
+/* whether spans are being recorded */
+int trace_enabled = 0;
+
+static char trace_filename[256];
+static double trace_origin = 0;
+
+/* each thread only ever writes to its own buffer, so recording a span
+   needs no locking. Threads claim a buffer the first time they record. */
+static struct trace_buffer trace_buffers[TRACE_MAX_THREADS];
+static int trace_threads = 0;
+static _Thread_local int trace_thread_index = -1;
+
+/**
+ * @brief Returns the monotonic time in microseconds
+ * @returns Time in microseconds
+ */
+static double trace_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double)ts.tv_sec * 1.0e6) + ((double)ts.tv_nsec * 1.0e-3);
+}
+
+/**
+ * @brief Begins recording spans, which are saved by trace_close
+ * @param filename The trace-event JSON file to be written
+ * @returns zero on success
+ */
+int trace_open(char * filename)
+{
+    if (strlen(filename) >= sizeof(trace_filename)) return -1;
+    sprintf(trace_filename,"%s",filename);
+    trace_origin = trace_clock();
+    trace_enabled = 1;
+    return 0;
+}
+
+/**
+ * @brief Returns the starting time for a span
+ * @returns Time in microseconds, or zero if tracing is disabled
+ */
+double trace_begin()
+{
+    if (!trace_enabled) return 0;
+    return trace_clock();
+}
+
+/**
+ * @brief Records a completed span for the calling thread
+ * @param name Name of the span. This must be a string constant.
+ * @param category Category of the span. This must be a string constant.
+ * @param start Starting time returned by trace_begin
+ * @param arg Numeric argument, such as a chunk or star index
+ * @param detail Optional text such as the star name, or NULL
+ */
+void trace_end(const char * name, const char * category,
+               double start, int arg, char * detail)
+{
+    struct trace_buffer * buffer;
+    struct trace_span * span;
+
+    if (!trace_enabled) return;
+
+    if (trace_thread_index == -1) {
+        trace_thread_index = __atomic_fetch_add(&trace_threads, 1,
+                                                __ATOMIC_RELAXED);
+    }
+    if (trace_thread_index >= TRACE_MAX_THREADS) return;
+
+    buffer = &trace_buffers[trace_thread_index];
+    if (buffer->spans == NULL) {
+        buffer->spans =
+            (struct trace_span*)malloc(TRACE_MAX_SPANS *
+                                       sizeof(struct trace_span));
+        if (buffer->spans == NULL) return;
+    }
+    if (buffer->count >= TRACE_MAX_SPANS) {
+        buffer->dropped++;
+        return;
+    }
+
+    span = &buffer->spans[buffer->count++];
+    span->name = name;
+    span->category = category;
+    span->start = start - trace_origin;
+    span->duration = trace_clock() - start;
+    span->arg = arg;
+    span->detail[0] = 0;
+    if (detail != NULL) {
+        strncpy(span->detail, detail, TRACE_DETAIL_LENGTH-1);
+        span->detail[TRACE_DETAIL_LENGTH-1] = 0;
+    }
+}
+
+/**
+ * @brief Writes a string with JSON escaping
+ * @param fp File to write to
+ * @param str The string to be written
+ */
+static void trace_write_string(FILE * fp, const char * str)
+{
+    fputc('"', fp);
+    for (; *str != 0; str++) {
+        if ((*str == '"') || (*str == '\\')) fputc('\\', fp);
+        if ((unsigned char)*str < 32) continue;
+        fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/**
+ * @brief Saves all recorded spans in trace-event JSON format, which
+ *        can be viewed with Perfetto or chrome://tracing
+ * @returns zero on success
+ */
+int trace_close()
+{
+    FILE * fp;
+    int t, i, threads, first = 1, dropped = 0;
+    struct trace_span * span;
+
+    if (!trace_enabled) return 0;
+    trace_enabled = 0;
+
+    fp = fopen(trace_filename,"w");
+    if (!fp) return -1;
+
+    threads = trace_threads;
+    if (threads > TRACE_MAX_THREADS) threads = TRACE_MAX_THREADS;
+
+    fprintf(fp,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (t = 0; t < threads; t++) {
+        if (!first) fprintf(fp,",\n");
+        first = 0;
+        fprintf(fp,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", t, t);
+        dropped += trace_buffers[t].dropped;
+        for (i = 0; i < trace_buffers[t].count; i++) {
+            span = &trace_buffers[t].spans[i];
+            fprintf(fp,",\n{\"name\":");
+            trace_write_string(fp, span->name);
+            fprintf(fp,",\"cat\":");
+            trace_write_string(fp, span->category);
+            fprintf(fp,",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"index\":%d",
+                    span->start, span->duration, t, span->arg);
+            if (span->detail[0] != 0) {
+                fprintf(fp,",\"detail\":");
+                trace_write_string(fp, span->detail);
+            }
+            fprintf(fp,"}}");
+        }
+        free(trace_buffers[t].spans);
+        trace_buffers[t].spans = NULL;
+        trace_buffers[t].count = 0;
+        trace_buffers[t].dropped = 0;
+    }
+    fprintf(fp,"\n],\"otherData\":{\"dropped_spans\":%d}}\n", dropped);
+    fclose(fp);
+    return 0;
+}
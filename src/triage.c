@@ -0,0 +1,267 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Most stars are flat or noisy and have no transit within them, yet
+   each would be given the whole period search. Triage finds a few
+   statistics of each star's flux, in time proportional to the number
+   of samples, from which a star with no plausible transit-like signal
+   may be skipped or given only a coarse search.
+
+   A transit lowers the flux, so it leaves more samples far below the
+   median than above it, skews the distribution of samples near the
+   median downwards, and repeats as a dip lasting several samples on
+   many nights. Flux is measured against the median and the median
+   absolute deviation, so that the occasional wild sample which is
+   common within the log files does not hide these. */
+
+#include "waspscan.h"
+
+/* samples further than this many deviations from the median are
+   outliers */
+#define TRIAGE_OUTLIER_SIGMA   3.0f
+
+/* samples further than this many deviations from the median are left
+   out of the skew */
+#define TRIAGE_SKEW_CLIP       5.0f
+
+/* number of consecutive samples averaged when looking for a dip */
+#define TRIAGE_DIP_SAMPLES     5
+
+/* deviations from the median by which the average of consecutive
+   samples must fall for a night to contain a dip */
+#define TRIAGE_DIP_SIGMA       2.0f
+
+/* a gap in seconds longer than this begins another night */
+#define TRIAGE_NIGHT_GAP       (60*60*4)
+
+/* scales the median absolute deviation to a standard deviation */
+#define TRIAGE_MAD_SCALE       1.4826f
+
+/* what is done with stars having no transit-like signal */
+int triage_mode = TRIAGE_OFF;
+
+/* stars with fewer samples far below the median are rejected */
+float triage_min_low_fraction = 0.005f;
+
+/* stars whose flux is skewed upwards by more than this are rejected */
+float triage_max_skew = 0.0f;
+
+/* stars with dips on fewer nights than this are rejected */
+int triage_min_dip_nights = 2;
+
+/* the search increment is multiplied by this for a coarse search */
+float triage_coarse_factor = 8.0f;
+
+/**
+ * @brief Returns the k-th smallest value, partially reordering the
+ *        array. Takes time proportional to its length on average.
+ * @param values Array of values
+ * @param length Length of the array
+ * @param k Index of the value within the sorted array
+ * @returns The k-th smallest value
+ */
+static float triage_select(float values[], int length, int k)
+{
+    int left = 0, right = length-1, i, j;
+    float pivot, temp;
+
+    while (left < right) {
+        pivot = values[left + (right - left)/2];
+        i = left;
+        j = right;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                temp = values[i];
+                values[i] = values[j];
+                values[j] = temp;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            right = j;
+        else if (k >= i)
+            left = i;
+        else
+            break;
+    }
+    return values[k];
+}
+
+/**
+ * @brief Counts whether the flux dips or rises within one night, by the
+ *        running average of consecutive samples
+ * @param series Magnitude observations
+ * @param start_index First sample of the night
+ * @param end_index Last sample of the night
+ * @param median Median of the series
+ * @param sigma Deviation of the series
+ * @param stats Statistics to which the night is added
+ */
+static void triage_night(float series[], int start_index, int end_index,
+                         float median, float sigma,
+                         struct triage_stats * stats)
+{
+    int i;
+    float sum = 0, av, lowest = 0, highest = 0;
+
+    if (end_index - start_index + 1 < TRIAGE_DIP_SAMPLES) return;
+
+    stats->nights++;
+    for (i = start_index; i <= end_index; i++) {
+        sum += series[i];
+        if (i - start_index >= TRIAGE_DIP_SAMPLES)
+            sum -= series[i - TRIAGE_DIP_SAMPLES];
+        if (i - start_index < TRIAGE_DIP_SAMPLES-1) continue;
+
+        av = (sum / TRIAGE_DIP_SAMPLES - median) / sigma;
+        if (av < lowest) lowest = av;
+        if (av > highest) highest = av;
+    }
+    if (lowest < -TRIAGE_DIP_SIGMA) stats->dip_nights++;
+    if (highest > TRIAGE_DIP_SIGMA) stats->rise_nights++;
+}
+
+/**
+ * @brief Finds the statistics from which triage decides whether a star
+ *        could contain a transit. Each data section is split into
+ *        nights at any gap longer than a few hours, and as with the
+ *        phase coverage the sections run from one gap to the next so
+ *        that every sample is included.
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param endpoints Data sections from detect_endpoints
+ * @param sections Number of data sections
+ * @param stats Returned statistics
+ * @returns zero on success
+ */
+int triage_stats(float timestamp[], float series[], int series_length,
+                 int endpoints[], int sections,
+                 struct triage_stats * stats)
+{
+    float * values, median, sigma, deviation;
+    double skew = 0;
+    int i, j, s, start_index = 0, end_index, low = 0, high = 0;
+
+    memset(stats, 0, sizeof(struct triage_stats));
+    if (series_length < TRIAGE_DIP_SAMPLES) return -1;
+
+    values = (float*)malloc(series_length*sizeof(float));
+    if (values == NULL) return -2;
+
+    memcpy(values, series, series_length*sizeof(float));
+    median = triage_select(values, series_length, series_length/2);
+    for (i = 0; i < series_length; i++)
+        values[i] = (float)fabs(series[i] - median);
+    sigma = TRIAGE_MAD_SCALE *
+        triage_select(values, series_length, series_length/2);
+    free(values);
+    if (sigma <= 0) return -3;
+
+    for (i = 0; i < series_length; i++) {
+        deviation = (series[i] - median) / sigma;
+        if (deviation < -TRIAGE_OUTLIER_SIGMA) low++;
+        if (deviation > TRIAGE_OUTLIER_SIGMA) high++;
+        if (fabs(deviation) < TRIAGE_SKEW_CLIP)
+            skew += deviation*deviation*deviation;
+    }
+    stats->low_fraction = low / (float)series_length;
+    stats->high_fraction = high / (float)series_length;
+    stats->skew = (float)(skew / series_length);
+
+    for (s = 0; s <= sections; s++) {
+        end_index = series_length-1;
+        if (s < sections) end_index = endpoints[s*2+1];
+
+        j = start_index;
+        for (i = start_index+1; i <= end_index; i++) {
+            if (timestamp[i] - timestamp[i-1] <= TRIAGE_NIGHT_GAP) continue;
+            triage_night(series, j, i-1, median, sigma, stats);
+            j = i;
+        }
+        triage_night(series, j, end_index, median, sigma, stats);
+        start_index = end_index + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decides from its statistics whether a star has no plausible
+ *        transit-like signal
+ * @param stats Statistics from triage_stats
+ * @param reason Returned reason for rejecting the star
+ * @returns Non-zero if the star is rejected
+ */
+int triage_reject(struct triage_stats * stats, char * reason)
+{
+    reason[0] = 0;
+    if (stats->low_fraction < triage_min_low_fraction) {
+        sprintf(reason, "only %.4f of samples far below the median",
+                stats->low_fraction);
+        return 1;
+    }
+    if (stats->skew > triage_max_skew) {
+        sprintf(reason, "flux is skewed upwards by %.4f", stats->skew);
+        return 1;
+    }
+    if (stats->dip_nights < triage_min_dip_nights) {
+        sprintf(reason, "dips on only %d of %d nights",
+                stats->dip_nights, stats->nights);
+        return 1;
+    }
+    if (stats->dip_nights <= stats->rise_nights) {
+        sprintf(reason, "dips on %d nights but rises on %d",
+                stats->dip_nights, stats->rise_nights);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decides whether a star has no plausible transit-like signal
+ * @param timestamp Times for observations
+ * @param series Magnitude observations
+ * @param series_length Length of the Array
+ * @param endpoints Data sections from detect_endpoints
+ * @param sections Number of data sections
+ * @param reason Returned reason for rejecting the star
+ * @returns Non-zero if the star is rejected
+ */
+int triage_star(float timestamp[], float series[], int series_length,
+                int endpoints[], int sections, char * reason)
+{
+    struct triage_stats stats;
+    int retval;
+
+    retval = triage_stats(timestamp, series, series_length,
+                          endpoints, sections, &stats);
+    if (retval == -3) {
+        sprintf(reason, "flux does not vary");
+        return 1;
+    }
+    /* without statistics the star is searched as usual */
+    if (retval != 0) {
+        reason[0] = 0;
+        return 0;
+    }
+    return triage_reject(&stats, reason);
+}
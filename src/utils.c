@@ -19,6 +19,7 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <dirent.h>
 #include "waspscan.h"
 
 /**
@@ -58,3 +59,89 @@ void scan_name(char * filename, char * result)
     }
     result[ctr]=0;
 }
+
+/**
+ * @brief Compares two filenames, used to sort directory listings
+ * @param a First filename
+ * @param b Second filename
+ * @returns Result of strcmp
+ */
+static int compare_filenames(const void * a, const void * b)
+{
+    return strcmp((const char*)a, (const char*)b);
+}
+
+/**
+ * @brief Lists the files within a directory having a given extension,
+ *        sorted by name
+ * @param directory The directory to be listed
+ * @param extension Filename extension, such as ".tbl"
+ * @param filenames Returned paths of the files
+ * @param max_files Maximum number of files to be returned
+ * @returns The number of files found, or -1 if the directory
+ *          could not be opened
+ */
+int scan_directory(char * directory, char * extension,
+                   char filenames[][MAX_FILENAME_LENGTH], int max_files)
+{
+    DIR * dir;
+    struct dirent * entry;
+    int ctr = 0, len, ext_len = strlen(extension);
+
+    dir = opendir(directory);
+    if (!dir) return -1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        len = strlen(entry->d_name);
+        if (len <= ext_len) continue;
+        if (strcmp(&entry->d_name[len - ext_len], extension) != 0)
+            continue;
+        if (strlen(directory) + len + 2 > MAX_FILENAME_LENGTH) continue;
+        sprintf(filenames[ctr++], "%s/%s", directory, entry->d_name);
+        if (ctr >= max_files) break;
+    }
+    closedir(dir);
+
+    qsort(filenames, ctr, MAX_FILENAME_LENGTH, compare_filenames);
+    return ctr;
+}
+
+/**
+ * @brief Updates an FNV-1a hash with a block of bytes
+ * @param data The bytes to be hashed
+ * @param length Number of bytes
+ * @param hash Hash of any preceding bytes, or FNV1A_OFFSET
+ * @returns The updated hash
+ */
+unsigned int fnv1a_hash(const void * data, size_t length, unsigned int hash)
+{
+    const unsigned char * bytes = (const unsigned char*)data;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV1A_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Updates a 64 bit FNV-1a hash with a block of bytes, for where
+ *        so many things are hashed that 32 bits could collide
+ * @param data The bytes to be hashed
+ * @param length Number of bytes
+ * @param hash Hash of any preceding bytes, or FNV1A64_OFFSET
+ * @returns The updated hash
+ */
+unsigned long long fnv1a_hash64(const void * data, size_t length,
+                                unsigned long long hash)
+{
+    const unsigned char * bytes = (const unsigned char*)data;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV1A64_PRIME;
+    }
+    return hash;
+}
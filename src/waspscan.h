@@ -34,15 +34,326 @@
 /* Maximum length of a series of values loaded from a log file */
 #define MAX_SERIES_LENGTH     100000
 
+/* Maximum length of a path to a table file */
+#define MAX_FILENAME_LENGTH   256
+
+/* default length of the light curve used for transit detection */
+#define DETECT_CURVE_LENGTH   128
+
+/* range of lengths of the light curve which may be chosen with --bins,
+   each of which is a power of two */
+#define DETECT_MIN_CURVE_LENGTH  16
+#define DETECT_MAX_CURVE_LENGTH  1024
+
+/* length of the light curve which is plotted */
+#define LIGHT_CURVE_LENGTH    256
+
+/* 32 bit FNV-1a hash parameters */
+#define FNV1A_OFFSET          2166136261U
+#define FNV1A_PRIME           16777619U
+
+/* 64 bit FNV-1a hash parameters */
+#define FNV1A64_OFFSET        14695981039346656037ULL
+#define FNV1A64_PRIME         1099511628211ULL
+
+/* engines which may search for a period */
+#define ENGINE_TRANSIT  0
+#define ENGINE_LS       1
+#define ENGINE_PDM      2
+
+/* maximum number of stars folded together by --batch */
+#define BATCH_MAX_STARS    16
+
+/* fewest stars from which common trends are found by --sysrem */
+#define SYSREM_MIN_STARS   4
+
+/* port on which the coordinator of a distributed search listens */
+#define DISTRIBUTE_PORT    5817
+
+/* seconds a worker may hold a work unit without a heartbeat */
+#define DISTRIBUTE_LEASE   60
+
+/* maximum number of phase bin counts averaged by the PDM engine */
+#define PDM_MAX_BIN_COUNTS 8
+
+/* what is done with a star which --triage finds no transit-like signal in */
+#define TRIAGE_OFF      0
+#define TRIAGE_SKIP     1
+#define TRIAGE_COARSE   2
+
+/* how --fap rearranges the magnitudes of a star */
+#define BOOTSTRAP_PERMUTE   0
+#define BOOTSTRAP_NIGHTS    1
+
+/* whether the false alarm probability is clearly below --fap-alpha */
+#define BOOTSTRAP_UNDECIDED         0
+#define BOOTSTRAP_SIGNIFICANT       1
+#define BOOTSTRAP_NOT_SIGNIFICANT   2
+
 /* the type of table */
 #define TABLE_TYPE_WASP 0
 #define TABLE_TYPE_K2   1
 
+/* stages which may be timed with --profile */
+#define PROFILE_STAGE_LOAD              0
+#define PROFILE_STAGE_ENDPOINTS         1
+#define PROFILE_STAGE_TRIAGE            2
+#define PROFILE_STAGE_SEARCH            3
+#define PROFILE_STAGE_BOOTSTRAP         4
+#define PROFILE_STAGE_PLOT_DISTRIBUTION 5
+#define PROFILE_STAGE_PLOT_LIGHT_CURVE  6
+#define PROFILE_STAGES                  7
+
+/* gates within detect_orbital_period at which a trial period may stop */
+#define PROFILE_GATE_MISSING_DATA       0
+#define PROFILE_GATE_GAPS               1
+#define PROFILE_GATE_NO_DIP             2
+#define PROFILE_GATE_DIP_WIDTH          3
+#define PROFILE_GATE_MAX_DIPPED         4
+#define PROFILE_GATE_DIPPED_DENSITY     5
+#define PROFILE_GATE_PEAK               6
+#define PROFILE_GATE_INTERMEDIATES      7
+#define PROFILE_GATE_FLAT               8
+#define PROFILE_GATE_VACANCY            9
+#define PROFILE_GATE_SCORED             10
+#define PROFILE_GATE_PRESCREEN          11
+#define PROFILE_GATES                   12
+
+/* sections of the period search measured with --perf */
+#define PERF_SECTION_FOLD               0
+#define PERF_SECTION_RESAMPLE           1
+#define PERF_SECTION_SCORE              2
+#define PERF_SECTIONS                   3
+
+/* called with the contents of each file read by ingest_files */
+typedef void (*ingest_callback)(int file, char * contents, long length,
+                                void * context);
+
+/* thresholds used to decide whether a light curve contains a transit */
+struct detect_params {
+    /* fraction of the maximum point density below which a dip
+       will be considered to be anomalous */
+    float min_dipped_density;
+
+    /* maximum percentage of samples in the dipped position */
+    float max_dipped_percent;
+
+    /* minimum percentage of samples which are neither dipped
+       nor non-dipped */
+    float min_intermediate_percent;
+
+    /* maximum percentage of samples which are neither dipped
+       nor non-dipped */
+    float max_intermediate_percent;
+
+    /* expected dip radius as a percentage of the orbital period */
+    float expected_dip_radius_percent;
+
+    /* threshold above the average beyond which to disguard the curve */
+    float peak_threshold;
+
+    /* maximum density within the area of the dip expected to be vacant */
+    float max_vacancy_density;
+
+    /* threshold above which the profile will be considered to be dipped */
+    float dip_threshold;
+};
+
+/* folded light curve for one trial period, held within a fold store */
+struct fold_record {
+    /* PROFILE_GATE_SCORED if the curve may be scored, otherwise the
+       gate at which the trial period was rejected */
+    int gate;
+
+    /* maximum number of samples within any bucket */
+    float max_samples;
+
+    /* light curve and density of samples returned by light_curve */
+    float curve[DETECT_MAX_CURVE_LENGTH];
+    float density[DETECT_MAX_CURVE_LENGTH];
+
+    /* samples within each bucket above the lower bound of the curve */
+    float above[DETECT_MAX_CURVE_LENGTH];
+
+    /* phase dispersion of the fold, or one if it was not found.
+       This is not kept within fold stores */
+    float theta;
+};
+
+/* phase dispersion found within the fold of the transit search */
+struct detect_dispersion {
+    /* numbers of phase bins, each dividing detect_curve_length,
+       over which theta is averaged */
+    int bin_counts[PDM_MAX_BIN_COUNTS];
+    int no_of_bin_counts;
+
+    /* variance of the whole series */
+    double total_variance;
+
+    /* period with the smallest theta, and that theta */
+    float period_days;
+    float min_theta;
+
+    /* theta at the best period of the transit search */
+    float theta;
+};
+
+/* memory-mapped fold store for one star and search grid */
+struct fold_store {
+    int fd;
+
+    /* non-zero if the store is being filled in by the current search */
+    int writing;
+
+    /* number of trial periods within the search grid */
+    int steps;
+
+    /* buckets within each light curve, and the bytes of each record,
+       which holds only that many buckets */
+    int curve_length;
+    size_t record_bytes;
+
+    size_t length;
+    unsigned char * map;
+    unsigned char * records;
+    char filename[MAX_FILENAME_LENGTH*2];
+    char temp_filename[MAX_FILENAME_LENGTH*2+16];
+};
+
+/* sums of the samples within each bucket for one trial period, to which
+   samples appended to the log file are added by later searches. These
+   always have DETECT_CURVE_LENGTH buckets, so --accumulate cannot be
+   combined with --bins. */
+struct accumulator_record {
+    int count[DETECT_CURVE_LENGTH];
+
+    /* samples within the range of magnitudes used when resampling */
+    int clipped_count[DETECT_CURVE_LENGTH];
+
+    double sum[DETECT_CURVE_LENGTH];
+    double sum_squared[DETECT_CURVE_LENGTH];
+    double clipped_sum[DETECT_CURVE_LENGTH];
+};
+
+/* memory-mapped accumulators for one star and search grid */
+struct accumulator_store {
+    int fd;
+
+    /* number of trial periods within the search grid */
+    int steps;
+
+    /* number of samples, from the start of the series, already added */
+    int folded;
+
+    /* range of magnitudes within which samples were added to the
+       clipped sums */
+    float clip_min;
+    float clip_max;
+
+    size_t length;
+    unsigned char * map;
+    struct accumulator_record * records;
+    char filename[MAX_FILENAME_LENGTH*2];
+};
+
+/* sums of the samples within each bucket of the light curve for one
+   period, folded once at the finest resolution, with each coarser level
+   made by adding pairs of buckets from the level above */
+struct fold_pyramid {
+    int levels;
+
+    /* number of buckets at the finest level */
+    int curve_length;
+
+    /* levels one after another, finest first */
+    int * count;
+    int * clipped_count;
+    double * clipped_sum;
+};
+
+/* spans of time without large gaps, used to find which phases of a
+   trial period contain samples without visiting every sample */
+struct phase_coverage {
+    int intervals;
+    float * start_days;
+    float * end_days;
+};
+
+/* what is kept between searches of the same timestamps and grid with
+   different magnitudes, as when finding the false alarm probability */
+struct detect_context {
+    float * timestamp;
+    int series_length;
+    float min_period_days;
+    float increment_days;
+    int steps;
+
+    /* spans of time from which phase coverage is found, which depend
+       only upon the timestamps */
+    struct phase_coverage coverage;
+};
+
+/* cheap statistics of a star's flux, from which --triage decides whether
+   a transit is plausible before the period search */
+struct triage_stats {
+    /* fractions of samples far below and far above the median */
+    float low_fraction;
+    float high_fraction;
+
+    /* skew of the samples near the median, which is negative when
+       there are dips */
+    float skew;
+
+    /* nights observed, and those within which the flux dips or rises
+       for several samples at once */
+    int nights;
+    int dip_nights;
+    int rise_nights;
+};
+
+/* false alarm probability of a detection, found by --fap */
+struct bootstrap_result {
+    /* searches made with the magnitudes rearranged */
+    int iterations;
+
+    /* searches whose best response was at least that of the star */
+    int exceeded;
+
+    float probability;
+
+    /* one of the BOOTSTRAP_ verdicts */
+    int verdict;
+};
+
+extern int profile_enabled;
+extern int trace_enabled;
+extern int perf_enabled;
+extern int periodogram_enabled;
+extern float detect_bin_fraction;
+extern float detect_prescreen_fraction;
+extern int detect_compact;
+extern int detect_curve_length;
+extern int sysrem_trends;
+extern int manifest_enabled;
+extern int ingest_uring;
+extern int triage_mode;
+extern float triage_min_low_fraction;
+extern float triage_max_skew;
+extern int triage_min_dip_nights;
+extern float triage_coarse_factor;
+extern int bootstrap_iterations;
+extern float bootstrap_alpha;
+extern int bootstrap_null;
+extern unsigned int bootstrap_seed;
+
 float detect_av(float series[], int series_length);
 float detect_variance(float series[], int series_length, float av);
 int logfile_load(char * filename, float timestamp[],
                  float series[], int max_series_length,
                  int time_field_index, int flux_field_index);
+int logfile_parse(char * contents, long length, float timestamp[],
+                  float series[], int max_series_length,
+                  int time_field_index, int flux_field_index);
 int gnuplot_tidy();
 int gnuplot_distribution(char * title,
                          float timestamp[],
@@ -61,7 +372,8 @@ int gnuplot_light_curve(char * title,
                         float subtitle_indent_vertical,
                         char * axis_label,
                         float period_days,
-                        float vertical_scale);
+                        float vertical_scale,
+                        struct fold_pyramid * pyramid);
 int gnuplot_light_curve_distribution(char * title,
                                      float timestamp[],
                                      float series[], int series_length,
@@ -71,29 +383,207 @@ int gnuplot_light_curve_distribution(char * title,
                                      float subtitle_indent_vertical,
                                      char * axis_label,
                                      float period_days,
-                                     float vertical_scale);
+                                     float vertical_scale,
+                                     struct fold_pyramid * pyramid);
+void fft_radix2(double re[], double im[], int n);
 void fft1D(float series[], int series_length, float freq[]);
+float lomb_scargle_period(float timestamp[], float series[],
+                          int series_length,
+                          float min_period_days, float max_period_days,
+                          float increment_days, float * max_power);
+int prescreen_periods(float timestamp[], float series[], int series_length,
+                      float min_period_days, float increment_days,
+                      int steps, float fraction, unsigned char keep[]);
 int detect_endpoints(float timestamp[], int series_length,
                      int endpoints[]);
 int light_curve(float timestamp[],
                 float series[], int series_length,
                 float period_days,
                 float curve[], float density[], int curve_length);
+int fold_pyramid_create(float timestamp[],
+                        float series[], int series_length,
+                        float period_days, int curve_length,
+                        struct fold_pyramid * pyramid);
+int fold_pyramid_curve(struct fold_pyramid * pyramid, int curve_length,
+                       float curve[], float density[]);
+void fold_pyramid_free(struct fold_pyramid * pyramid);
 void scan_name(char * filename, char * result);
+int scan_directory(char * directory, char * extension,
+                   char filenames[][MAX_FILENAME_LENGTH], int max_files);
 float detect_orbital_period(float timestamp[],
                             float series[], int series_length,
                             float min_period_days,
                             float max_period_days,
                             float increment_days,
-                            float min_dipped_density,
-                            float max_dipped_percent,
-                            float min_intermediate_percent,
-                            float max_intermediate_percent,
-                            float expected_dip_radius_percent,
-                            float peak_threshold,
-                            float max_vacancy_density,
-                            float dip_threshold);
+                            struct detect_params * params,
+                            struct fold_store * store);
+float detect_orbital_period_response(float timestamp[],
+                                     float series[], int series_length,
+                                     float min_period_days,
+                                     float max_period_days,
+                                     float increment_days,
+                                     struct detect_params * params,
+                                     struct fold_store * store,
+                                     float * max_response);
+float detect_orbital_period_dispersion(float timestamp[],
+                                       float series[], int series_length,
+                                       float min_period_days,
+                                       float max_period_days,
+                                       float increment_days,
+                                       struct detect_params * params,
+                                       struct fold_store * store,
+                                       float * max_response,
+                                       struct detect_dispersion * dispersion);
+int detect_context_create(float timestamp[], int series_length,
+                          float min_period_days,
+                          float max_period_days,
+                          float increment_days,
+                          struct detect_context * context);
+float detect_orbital_period_context(struct detect_context * context,
+                                    float series[],
+                                    struct detect_params * params,
+                                    struct fold_store * store,
+                                    float * max_response,
+                                    struct detect_dispersion * dispersion);
+void detect_context_free(struct detect_context * context);
+float detect_orbital_period_anytime(float timestamp[],
+                                    float series[], int series_length,
+                                    float min_period_days,
+                                    float max_period_days,
+                                    float increment_days,
+                                    struct detect_params * params,
+                                    struct fold_store * store,
+                                    float budget_seconds,
+                                    float * max_response,
+                                    float * grid_coverage);
+int detect_orbital_period_sweep(float timestamp[],
+                                float series[], int series_length,
+                                float min_period_days,
+                                float max_period_days,
+                                float increment_days,
+                                struct detect_params sets[], int no_of_sets,
+                                float period_days[],
+                                struct fold_store * store);
+float detect_orbital_period_incremental(float timestamp[],
+                                        float series[], int series_length,
+                                        float min_period_days,
+                                        float max_period_days,
+                                        float increment_days,
+                                        struct detect_params * params,
+                                        struct accumulator_store * store);
+float detect_pdm_period_incremental(float timestamp[],
+                                    float series[], int series_length,
+                                    float min_period_days,
+                                    float max_period_days,
+                                    float increment_days,
+                                    int bin_counts[], int no_of_bin_counts,
+                                    struct accumulator_store * store,
+                                    float * min_theta);
+float detect_pdm_period(float timestamp[],
+                        float series[], int series_length,
+                        float min_period_days,
+                        float max_period_days,
+                        float increment_days,
+                        int bin_counts[], int no_of_bin_counts,
+                        float * min_theta);
+int detect_orbital_period_batch(float timestamp[],
+                                float series[], float weight[],
+                                int series_length, int stars,
+                                float min_period_days,
+                                float max_period_days,
+                                float increment_days,
+                                struct detect_params * params,
+                                float period_days[]);
+int batch_search(char * list_filename,
+                 int time_field_index, int flux_field_index,
+                 int minimum_data_samples,
+                 float min_period_days, float max_period_days,
+                 float increment_days,
+                 struct detect_params * params);
+int sysrem_detrend(float series[], float weight[],
+                   int series_length, int stars, int trends);
+int distribute_serve(char * manifest_filename, int port,
+                     int ranges, int lease_seconds,
+                     int time_field_index, int flux_field_index,
+                     int minimum_data_samples,
+                     float min_period_days, float max_period_days,
+                     float increment_days,
+                     struct detect_params * params);
+int distribute_work(char * host, int port);
 int detect_phase_offset(float curve[], int curve_length);
 void adjust_curve(float curve[], int curve_length, int offset);
+void profile_start(int stage);
+void profile_stop(int stage);
+void profile_gate(int gate);
+void profile_report(FILE * fp);
+const char * profile_gate_name(int gate);
+int trace_open(char * filename);
+double trace_begin();
+void trace_end(const char * name, const char * category,
+               double start, int arg, char * detail);
+int trace_close();
+void perf_reset();
+void perf_begin();
+void perf_mark(int section);
+void perf_end(int section);
+void perf_report(FILE * fp, char * name);
+unsigned int fnv1a_hash(const void * data, size_t length, unsigned int hash);
+unsigned long long fnv1a_hash64(const void * data, size_t length,
+                                unsigned long long hash);
+unsigned int manifest_params_hash(struct detect_params * params,
+                                  float min_period_days,
+                                  float max_period_days,
+                                  float increment_days,
+                                  int minimum_data_samples,
+                                  int time_field_index, int flux_field_index,
+                                  int engine, float time_budget_seconds);
+int manifest_content(char * filename,
+                     unsigned long long * content_hash, long * length);
+int manifest_open(char * filename, unsigned int params_hash);
+int manifest_lookup(unsigned long long content_hash, long length,
+                    float * period_days);
+int manifest_record(char * log_filename,
+                    unsigned long long content_hash, long length,
+                    float period_days);
+void manifest_close();
+int ingest_files(char ** filenames, int no_of_files,
+                 ingest_callback callback, void * context);
+int foldstore_open(char * directory, char * name,
+                   float timestamp[], float series[], int series_length,
+                   float min_period_days, float max_period_days,
+                   float increment_days,
+                   struct fold_store * store);
+int foldstore_read(struct fold_store * store, int step,
+                   struct fold_record * fold);
+void foldstore_write(struct fold_store * store, int step,
+                     struct fold_record * fold);
+int foldstore_close(struct fold_store * store);
+int accumulate_open(char * directory, char * name,
+                    float timestamp[], float series[], int series_length,
+                    float min_period_days, float max_period_days,
+                    float increment_days,
+                    struct accumulator_store * store);
+int accumulate_close(struct accumulator_store * store,
+                     float timestamp[], float series[], int series_length);
+int triage_stats(float timestamp[], float series[], int series_length,
+                 int endpoints[], int sections,
+                 struct triage_stats * stats);
+int triage_reject(struct triage_stats * stats, char * reason);
+int triage_star(float timestamp[], float series[], int series_length,
+                int endpoints[], int sections, char * reason);
+int bootstrap_fap(float timestamp[], float series[], int series_length,
+                  float min_period_days, float max_period_days,
+                  float increment_days,
+                  struct detect_params * params, float response,
+                  struct bootstrap_result * result);
+int periodogram_open(char * filename, float min_period_days,
+                     float increment_days, int steps);
+void periodogram_add(int first_step, float values[], int count);
+int periodogram_close();
+int periodogram_plot(char * title, char * image_filename);
+int gnuplot_periodogram(char * title,
+                        float period_days[], float response[], int length,
+                        char * image_filename,
+                        int image_width, int image_height);
 
 #endif
@@ -0,0 +1,1120 @@
+/*
+  WASPscan: Detection of exoplanet transits
+  Copyright (C) 2015-2016 Bob Mottram
+  bob@libreserver.org
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Runs detection over the positive and negative fixtures in parallel,
+   reporting accuracy and throughput. Synthetic transits may also be
+   injected into the negative fixtures, to find how the fraction
+   recovered depends upon their depth and period. */
+
+#include <time.h>
+#include <omp.h>
+#include "waspscan.h"
+
+/* maximum number of fixtures within each directory */
+#define CHECK_MAX_FILES   256
+
+/* maximum number of known periods */
+#define CHECK_MAX_PERIODS 256
+
+/* maximum number of threshold sets within a sweep */
+#define CHECK_MAX_SETS    4096
+
+/* number of depth and period ranges over which recovery is reported */
+#define INJECT_DEPTH_BINS  5
+#define INJECT_PERIOD_BINS 5
+
+/* quadratic limb darkening coefficients, roughly those of the Sun */
+#define INJECT_LIMB_U1     0.40
+#define INJECT_LIMB_U2     0.26
+
+/* shapes of injected transits */
+#define INJECT_SHAPE_BOX   0
+#define INJECT_SHAPE_LIMB  1
+
+struct check_fixture {
+    char filename[MAX_FILENAME_LENGTH];
+    int positive;
+    float expected_period_days;
+    float detected_period_days;
+    float * sweep_period_days;
+    int series_length;
+    int correct;
+    int triaged;
+    struct bootstrap_result fap;
+    double seconds;
+};
+
+struct known_period {
+    char ref[64];
+    float period_days;
+};
+
+struct check_injection {
+    int fixture;
+    float period_days;
+    float depth;
+    float duration_hours;
+    float epoch_days;
+    float detected_period_days;
+    int recovered;
+};
+
+struct check_light_curve {
+    char filename[MAX_FILENAME_LENGTH];
+    float * timestamp;
+    float * series;
+    int series_length;
+};
+
+/**
+ * @brief Returns the monotonic time in seconds
+ * @returns Time in seconds
+ */
+static double check_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1.0e-9);
+}
+
+/**
+ * @brief Loads the known periods for positive fixtures. Each line
+ *        contains a reference, such as J191412.95+382646.8, and a period
+ * @param filename The periods file
+ * @param periods Returned known periods
+ * @param max_periods Maximum number of periods
+ * @returns The number of periods loaded, or -1 on failure
+ */
+static int check_load_periods(char * filename,
+                              struct known_period periods[],
+                              int max_periods)
+{
+    FILE * fp;
+    char linestr[256];
+    int ctr = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    while ((ctr < max_periods) && (fgets(linestr, 255, fp) != NULL)) {
+        if (sscanf(linestr, "%63s %f", periods[ctr].ref,
+                   &periods[ctr].period_days) == 2)
+            ctr++;
+    }
+    fclose(fp);
+    return ctr;
+}
+
+/**
+ * @brief Returns a pointer to the threshold having the given name
+ * @param params Detection thresholds
+ * @param name Name of the threshold, as used on the command line
+ * @returns Pointer to the threshold, or NULL if not recognised
+ */
+static float * check_param(struct detect_params * params, char * name)
+{
+    if (strcmp(name, "mindd") == 0) return &params->min_dipped_density;
+    if (strcmp(name, "maxd") == 0) return &params->max_dipped_percent;
+    if (strcmp(name, "minint") == 0) return &params->min_intermediate_percent;
+    if (strcmp(name, "maxint") == 0) return &params->max_intermediate_percent;
+    if (strcmp(name, "diprad") == 0)
+        return &params->expected_dip_radius_percent;
+    if (strcmp(name, "peak") == 0) return &params->peak_threshold;
+    if (strcmp(name, "maxvac") == 0) return &params->max_vacancy_density;
+    if (strcmp(name, "dip") == 0) return &params->dip_threshold;
+    return NULL;
+}
+
+/**
+ * @brief Loads a sweep grid and expands it into sets of thresholds.
+ *        Each line of the grid contains a threshold name followed by
+ *        its minimum, maximum and step, for example "peak 0.4 0.8 0.1".
+ *        Thresholds which are not swept keep their values from params.
+ * @param filename The grid file
+ * @param params Default detection thresholds
+ * @param sets Returned sets of thresholds, one for every combination
+ * @param max_sets Maximum number of sets
+ * @returns The number of sets, or -1 on failure
+ */
+static int check_load_sweep(char * filename, struct detect_params * params,
+                            struct detect_params sets[], int max_sets)
+{
+    FILE * fp;
+    char linestr[256], name[32];
+    float value_min, value_max, value_step;
+    int i, s, v, values, no_of_sets = 1;
+
+    fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    sets[0] = *params;
+    while (fgets(linestr, 255, fp) != NULL) {
+        if ((linestr[0] == '#') ||
+            (sscanf(linestr, "%31s %f %f %f", name,
+                    &value_min, &value_max, &value_step) != 4))
+            continue;
+        if ((check_param(params, name) == NULL) ||
+            (value_step <= 0) || (value_max < value_min)) {
+            printf("Invalid sweep: %s", linestr);
+            fclose(fp);
+            return -1;
+        }
+
+        /* each existing set is repeated for every value */
+        values = (int)(((value_max - value_min) / value_step) + 1.001f);
+        if (no_of_sets * values > max_sets) {
+            printf("Too many threshold sets, the maximum is %d\n", max_sets);
+            fclose(fp);
+            return -1;
+        }
+        for (v = values-1; v >= 0; v--) {
+            for (s = 0; s < no_of_sets; s++) {
+                i = (v * no_of_sets) + s;
+                sets[i] = sets[s];
+                *check_param(&sets[i], name) = value_min + (v * value_step);
+            }
+        }
+        no_of_sets *= values;
+    }
+    fclose(fp);
+    return no_of_sets;
+}
+
+/**
+ * @brief Counts correct detections for one set of thresholds
+ * @param fixtures Array of fixtures
+ * @param no_of_fixtures Number of fixtures
+ * @param set Index of the threshold set, or -1 for the detected periods
+ * @param tolerance_days Period tolerance in days
+ * @param recalled Returned number of positives detected
+ * @param false_positives Returned number of negatives detected
+ */
+static void check_evaluate(struct check_fixture fixtures[],
+                           int no_of_fixtures, int set,
+                           float tolerance_days,
+                           int * recalled, int * false_positives)
+{
+    int i;
+    float period_days;
+
+    *recalled = 0;
+    *false_positives = 0;
+    for (i = 0; i < no_of_fixtures; i++) {
+        period_days = fixtures[i].detected_period_days;
+        if (set >= 0) period_days = fixtures[i].sweep_period_days[set];
+
+        if (fixtures[i].positive) {
+            if (fabs(period_days - fixtures[i].expected_period_days) <=
+                tolerance_days)
+                (*recalled)++;
+        }
+        else {
+            if (period_days != 0) (*false_positives)++;
+        }
+    }
+}
+
+/**
+ * @brief Saves the recall and false positive rate for every set of
+ *        thresholds within a sweep
+ * @param filename The CSV file to save as
+ * @param fixtures Array of fixtures
+ * @param no_of_fixtures Number of fixtures
+ * @param sets Sets of thresholds
+ * @param no_of_sets Number of sets
+ * @param tolerance_days Period tolerance in days
+ * @returns Index of the set with the best recall less false
+ *          positive rate, or -1 on failure
+ */
+static int check_save_surface(char * filename,
+                              struct check_fixture fixtures[],
+                              int no_of_fixtures,
+                              struct detect_params sets[], int no_of_sets,
+                              float tolerance_days)
+{
+    FILE * fp;
+    int i, s, positives = 0, negatives = 0, best = -1;
+    int recalled, false_positives;
+    float recall, false_positive_rate, score, best_score = 0;
+
+    fp = fopen(filename, "w");
+    if (!fp) return -1;
+
+    for (i = 0; i < no_of_fixtures; i++) {
+        if (fixtures[i].positive)
+            positives++;
+        else
+            negatives++;
+    }
+
+    fprintf(fp, "peak,dip,mindd,minint,maxint,maxd,maxvac,diprad,"
+            "recalled,false_positives,recall,false_positive_rate\n");
+    for (s = 0; s < no_of_sets; s++) {
+        check_evaluate(fixtures, no_of_fixtures, s, tolerance_days,
+                       &recalled, &false_positives);
+        recall = (positives > 0) ? recalled / (float)positives : 0;
+        false_positive_rate =
+            (negatives > 0) ? false_positives / (float)negatives : 0;
+        fprintf(fp, "%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,"
+                "%d,%d,%.4f,%.4f\n",
+                sets[s].peak_threshold, sets[s].dip_threshold,
+                sets[s].min_dipped_density,
+                sets[s].min_intermediate_percent,
+                sets[s].max_intermediate_percent,
+                sets[s].max_dipped_percent,
+                sets[s].max_vacancy_density,
+                sets[s].expected_dip_radius_percent,
+                recalled, false_positives, recall, false_positive_rate);
+        score = recall - false_positive_rate;
+        if ((best == -1) || (score > best_score)) {
+            best = s;
+            best_score = score;
+        }
+    }
+    fclose(fp);
+    return best;
+}
+
+/**
+ * @brief Returns a pseudo-random number between zero and one. Each
+ *        injection has its own state so that the injections do not
+ *        depend upon the order in which threads run them.
+ * @param state The generator state, which must not be zero
+ * @returns Random number
+ */
+static double check_random(unsigned long long * state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Dims a light curve by a transit repeating at a given period.
+ *        The planet is assumed small compared with the star and to
+ *        cross its centre, so the dimming follows the brightness of
+ *        the disc beneath it.
+ * @param timestamp Times for observations in seconds
+ * @param series Fluxes, which are returned dimmed
+ * @param series_length Length of the Array
+ * @param injection The period, depth, duration and epoch of the transit
+ * @param shape INJECT_SHAPE_BOX or INJECT_SHAPE_LIMB
+ */
+static void check_inject_transit(float timestamp[], float series[],
+                                 int series_length,
+                                 struct check_injection * injection,
+                                 int shape)
+{
+    int i;
+    double phase, x, mu, brightness, mean_brightness;
+    double period_seconds = injection->period_days * 60*60*24;
+    double half_duration_seconds = injection->duration_hours * 60*60 / 2;
+    double epoch_seconds = injection->epoch_days * 60*60*24;
+
+    mean_brightness = 1 - (INJECT_LIMB_U1/3) - (INJECT_LIMB_U2/6);
+    for (i = 0; i < series_length; i++) {
+        /* time from the middle of the nearest transit */
+        phase = fmod(timestamp[i] - epoch_seconds, period_seconds);
+        if (phase < 0) phase += period_seconds;
+        if (phase > period_seconds/2) phase -= period_seconds;
+        if (fabs(phase) >= half_duration_seconds) continue;
+
+        brightness = 1;
+        if (shape == INJECT_SHAPE_LIMB) {
+            x = phase / half_duration_seconds;
+            mu = sqrt(1 - x*x);
+            brightness = (1 - INJECT_LIMB_U1*(1 - mu) -
+                          INJECT_LIMB_U2*(1 - mu)*(1 - mu)) / mean_brightness;
+        }
+        series[i] *= (float)(1 - injection->depth*brightness);
+    }
+}
+
+/**
+ * @brief Returns the range within which a value lies, when the ranges
+ *        are evenly spaced in the logarithm of the value
+ * @param value The value
+ * @param minimum Start of the first range
+ * @param maximum End of the last range
+ * @param bins Number of ranges
+ * @returns Index of the range
+ */
+static int check_log_bin(float value, float minimum, float maximum, int bins)
+{
+    int bin;
+
+    if (maximum <= minimum) return 0;
+    bin = (int)(log(value/minimum) / log(maximum/minimum) * bins);
+    if (bin < 0) bin = 0;
+    if (bin >= bins) bin = bins-1;
+    return bin;
+}
+
+/**
+ * @brief Injects synthetic transits into the negative fixtures, at their
+ *        real times and noise, and reports the fraction recovered for
+ *        ranges of depth and period, along with throughput. Periods and
+ *        depths are drawn evenly in their logarithms.
+ * @param fixtures_dir Directory containing the negative fixtures
+ * @param no_of_injections Number of transits to inject
+ * @param min_depth The smallest fractional depth
+ * @param max_depth The largest fractional depth
+ * @param duration_hours Duration of each transit, or zero for that of
+ *        a planet in a circular orbit about a star like the Sun
+ * @param shape INJECT_SHAPE_BOX or INJECT_SHAPE_LIMB
+ * @param seed Seed for the random choice of transits
+ * @param minimum_period_days The minimum orbital period in days
+ * @param maximum_period_days The maximum orbital period in days
+ * @param increment_days The time increment used within the min/max range
+ * @param minimum_data_samples Fixtures with fewer samples are not used
+ * @param params Detection thresholds
+ * @param tolerance_days Period tolerance in days
+ * @param csv_filename File to save each injection to, or empty
+ * @returns zero on success
+ */
+static int check_inject(char * fixtures_dir, int no_of_injections,
+                        float min_depth, float max_depth,
+                        float duration_hours, int shape,
+                        unsigned int seed,
+                        float minimum_period_days, float maximum_period_days,
+                        float increment_days, int minimum_data_samples,
+                        struct detect_params * params,
+                        float tolerance_days, char * csv_filename)
+{
+    char subdir[256*2];
+    char (*filenames)[MAX_FILENAME_LENGTH];
+    struct check_light_curve * curves;
+    struct check_injection * injections;
+    int i, d, p, n, no_of_curves = 0, recovered = 0;
+    int found[INJECT_DEPTH_BINS][INJECT_PERIOD_BINS];
+    int total[INJECT_DEPTH_BINS][INJECT_PERIOD_BINS];
+    double start, seconds;
+    FILE * fp;
+
+    filenames = malloc(CHECK_MAX_FILES * MAX_FILENAME_LENGTH);
+    curves = (struct check_light_curve*)
+        calloc(CHECK_MAX_FILES, sizeof(struct check_light_curve));
+    injections = (struct check_injection*)
+        calloc(no_of_injections, sizeof(struct check_injection));
+    if ((filenames == NULL) || (curves == NULL) || (injections == NULL)) {
+        printf("Unable to allocate memory\n");
+        free(filenames);
+        free(curves);
+        free(injections);
+        return 2;
+    }
+
+    /* the negative fixtures are loaded once and copied for each
+       injection */
+    sprintf(subdir, "%s/negative", fixtures_dir);
+    n = scan_directory(subdir, ".tbl", filenames, CHECK_MAX_FILES);
+    for (i = 0; i < n; i++) {
+        struct check_light_curve * curve = &curves[no_of_curves];
+        curve->timestamp = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+        curve->series = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+        if ((curve->timestamp == NULL) || (curve->series == NULL)) {
+            free(curve->timestamp);
+            free(curve->series);
+            continue;
+        }
+        curve->series_length =
+            logfile_load(filenames[i], curve->timestamp, curve->series,
+                         MAX_SERIES_LENGTH, 0, 3);
+        if (curve->series_length < minimum_data_samples) {
+            free(curve->timestamp);
+            free(curve->series);
+            continue;
+        }
+        sprintf(curve->filename, "%s", filenames[i]);
+        no_of_curves++;
+    }
+    free(filenames);
+    if (no_of_curves == 0) {
+        printf("No negative fixtures found within %s\n", subdir);
+        free(curves);
+        free(injections);
+        return 3;
+    }
+
+    for (i = 0; i < no_of_injections; i++) {
+        struct check_injection * injection = &injections[i];
+        unsigned long long state =
+            ((unsigned long long)seed << 32) + i + 1;
+
+        check_random(&state);
+        injection->fixture = i % no_of_curves;
+        injection->period_days = minimum_period_days *
+            pow(maximum_period_days / minimum_period_days,
+                check_random(&state));
+        injection->depth = min_depth *
+            pow(max_depth / min_depth, check_random(&state));
+        injection->duration_hours = duration_hours;
+        if (duration_hours <= 0)
+            injection->duration_hours =
+                13 * pow(injection->period_days / 365.25, 1.0/3.0);
+        injection->epoch_days =
+            injection->period_days * check_random(&state);
+    }
+    printf("Injecting %d transits into %d negative fixtures, %d threads\n",
+           no_of_injections, no_of_curves, omp_get_max_threads());
+
+    start = check_clock();
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < no_of_injections; i++) {
+        struct check_injection * injection = &injections[i];
+        struct check_light_curve * curve = &curves[injection->fixture];
+        float * series = (float*)malloc(curve->series_length*sizeof(float));
+
+        if (series == NULL) continue;
+        memcpy(series, curve->series, curve->series_length*sizeof(float));
+        check_inject_transit(curve->timestamp, series, curve->series_length,
+                             injection, shape);
+        injection->detected_period_days =
+            detect_orbital_period(curve->timestamp, series,
+                                  curve->series_length,
+                                  minimum_period_days, maximum_period_days,
+                                  increment_days, params, NULL);
+        injection->recovered =
+            (fabs(injection->detected_period_days -
+                  injection->period_days) <= tolerance_days);
+        free(series);
+    }
+    seconds = check_clock() - start;
+
+    memset(found, 0, sizeof(found));
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < no_of_injections; i++) {
+        d = check_log_bin(injections[i].depth, min_depth, max_depth,
+                          INJECT_DEPTH_BINS);
+        p = check_log_bin(injections[i].period_days,
+                          minimum_period_days, maximum_period_days,
+                          INJECT_PERIOD_BINS);
+        total[d][p]++;
+        if (injections[i].recovered) {
+            found[d][p]++;
+            recovered++;
+        }
+    }
+
+    /* fraction recovered, with depth down and period across */
+    printf("\n%-17s", "depth \\ period");
+    for (p = 0; p < INJECT_PERIOD_BINS; p++)
+        printf(" %5.2f-%-5.2f",
+               minimum_period_days *
+               pow(maximum_period_days/minimum_period_days,
+                   p/(double)INJECT_PERIOD_BINS),
+               minimum_period_days *
+               pow(maximum_period_days/minimum_period_days,
+                   (p+1)/(double)INJECT_PERIOD_BINS));
+    printf("\n");
+    for (d = 0; d < INJECT_DEPTH_BINS; d++) {
+        printf("%.5f-%.5f ",
+               min_depth * pow(max_depth/min_depth,
+                               d/(double)INJECT_DEPTH_BINS),
+               min_depth * pow(max_depth/min_depth,
+                               (d+1)/(double)INJECT_DEPTH_BINS));
+        for (p = 0; p < INJECT_PERIOD_BINS; p++) {
+            if (total[d][p] == 0)
+                printf(" %11s", "-");
+            else
+                printf(" %5.3f (%3d)",
+                       found[d][p] / (float)total[d][p], total[d][p]);
+        }
+        printf("\n");
+    }
+
+    printf("\nRecovered %d/%d (%.3f)\n", recovered, no_of_injections,
+           recovered / (float)no_of_injections);
+    printf("Elapsed %.2fs, %.2f injections/s\n",
+           seconds, no_of_injections / seconds);
+
+    if (csv_filename[0] != 0) {
+        fp = fopen(csv_filename, "w");
+        if (fp) {
+            fprintf(fp, "fixture,period_days,depth,duration_hours,"
+                    "epoch_days,detected_period_days,recovered\n");
+            for (i = 0; i < no_of_injections; i++)
+                fprintf(fp, "%s,%.6f,%.6f,%.4f,%.6f,%.6f,%d\n",
+                        curves[injections[i].fixture].filename,
+                        injections[i].period_days, injections[i].depth,
+                        injections[i].duration_hours,
+                        injections[i].epoch_days,
+                        injections[i].detected_period_days,
+                        injections[i].recovered);
+            fclose(fp);
+        }
+    }
+
+    for (i = 0; i < no_of_curves; i++) {
+        free(curves[i].timestamp);
+        free(curves[i].series);
+    }
+    free(curves);
+    free(injections);
+    return 0;
+}
+
+void show_help()
+{
+    printf("WASPscan accuracy and throughput check\n\n");
+    printf(" -d  --dir                   Fixtures directory\n");
+    printf("     --tolerance             Period tolerance in days\n");
+    printf(" -i  --incr                  Search increment in seconds\n");
+    printf(" -0  --min                   Minimum orbital period in days\n");
+    printf(" -1  --max                   Maximum orbital period in days\n");
+    printf(" -m  --minsamples            Minimum number of data samples\n");
+    printf("     --maxvac                Maximum density within vacancy region\n");
+    printf("     --mindd                 Minimum dipped density (0.0 -> 1.0)\n");
+    printf("     --minint                Minimum intermediate samples percent\n");
+    printf("     --maxint                Maximum intermediate samples percent\n");
+    printf("     --maxd                  Maximum dipped samples percentage\n");
+    printf("     --peak                  Peak threshold (0.0 -> 1.0)\n");
+    printf("     --dip                   Dip threshold (0.0 -> 1.0)\n");
+    printf(" -r  --diprad                Expected dip radius as a percent of orbital period\n");
+    printf("     --minrecall             Fail if recall is below this (0.0 -> 1.0)\n");
+    printf("     --maxfpr                Fail if the false positive rate is above this\n");
+    printf("     --csv                   Append a row of results to a CSV file\n");
+    printf("     --sweep                 Grid of thresholds to sweep\n");
+    printf("     --surface               Filename for the sweep results (CSV)\n");
+    printf("     --foldstore             Directory in which to keep folded light curves\n");
+    printf("     --bin                   Merge samples within this fraction of a bucket\n");
+    printf("     --prescreen             Fold only this fraction of the strongest frequencies\n");
+    printf("     --compact               Fold 16 bit magnitudes and 32 bit times\n");
+    printf("     --triage                Stars without a transit-like signal: skip or coarse\n");
+    printf("     --bins                  Buckets within each light curve, a power of two\n");
+    printf("     --fap                   Most searches made to find the false alarm probability\n");
+    printf("     --fap-alpha             False alarm probability below which a transit is significant\n");
+    printf("     --inject                Number of transits to inject into the negatives\n");
+    printf("     --depth                 Range of injected depths, such as 0.005,0.2\n");
+    printf("     --duration              Injected transit duration in hours\n");
+    printf("     --shape                 Injected transit shape: box or limb\n");
+    printf("     --seed                  Seed for the injected transits\n");
+    printf("     --injectcsv             Save every injected transit to a CSV file\n");
+    printf(" -h  --help                  Show help\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int i, j, k, m, n, no_of_fixtures = 0, no_of_periods;
+    int positives = 0, negatives = 0, recalled = 0, false_positives = 0;
+    char fixtures_dir[256], subdir[256*2], periods_filename[256*2];
+    char csv_filename[256], sweep_filename[256], surface_filename[256];
+    char foldstore_directory[256], inject_filename[256];
+    char (*filenames)[MAX_FILENAME_LENGTH];
+    struct check_fixture * fixtures;
+    struct known_period periods[CHECK_MAX_PERIODS];
+    double start, seconds, samples = 0;
+    float recall, false_positive_rate;
+    long trials;
+    FILE * fp;
+    struct detect_params * sets = NULL;
+    int no_of_sets = 0, best;
+    int no_of_injections = 0, shape = INJECT_SHAPE_LIMB;
+    float min_depth = 0.005f, max_depth = 0.2f, duration_hours = 0;
+    unsigned int seed = 1;
+
+    /* the same parameters as test/test */
+    float tolerance_days = 0.01f;
+    float minimum_period_days = 0.8f;
+    float maximum_period_days = 4.2f;
+    float search_increment_seconds = 0.864f;
+    int minimum_data_samples = 1000;
+    struct detect_params params = {
+        .min_dipped_density = 0.38f,
+        .max_dipped_percent = 20.0f,
+        .min_intermediate_percent = 5.0f,
+        .max_intermediate_percent = 30.0f,
+        .expected_dip_radius_percent = 2.0f,
+        .peak_threshold = 0.6f,
+        .max_vacancy_density = 0.008f,
+        .dip_threshold = 0.2f
+    };
+    float min_recall = 0;
+    float max_false_positive_rate = 1;
+
+    sprintf(fixtures_dir, "%s", "test");
+    csv_filename[0] = 0;
+    foldstore_directory[0] = 0;
+    inject_filename[0] = 0;
+    sweep_filename[0] = 0;
+    sprintf(surface_filename, "%s", "sweep.csv");
+
+    for (i = 1; i < argc; i++) {
+        if ((strcmp(argv[i],"-d")==0) ||
+            (strcmp(argv[i],"--dir")==0)) {
+            i++;
+            if (i < argc) sprintf(fixtures_dir, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--tolerance")==0) {
+            i++;
+            if (i < argc) tolerance_days = atof(argv[i]);
+        }
+        if ((strcmp(argv[i],"-i")==0) ||
+            (strcmp(argv[i],"--incr")==0)) {
+            i++;
+            if (i < argc) search_increment_seconds = atof(argv[i]);
+        }
+        if ((strcmp(argv[i],"-0")==0) ||
+            (strcmp(argv[i],"--min")==0)) {
+            i++;
+            if (i < argc) minimum_period_days = atof(argv[i]);
+        }
+        if ((strcmp(argv[i],"-1")==0) ||
+            (strcmp(argv[i],"--max")==0)) {
+            i++;
+            if (i < argc) maximum_period_days = atof(argv[i]);
+        }
+        if ((strcmp(argv[i],"-m")==0) ||
+            (strcmp(argv[i],"--minsamples")==0)) {
+            i++;
+            if (i < argc) minimum_data_samples = atoi(argv[i]);
+        }
+        if (strcmp(argv[i],"--maxvac")==0) {
+            i++;
+            if (i < argc) params.max_vacancy_density = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--mindd")==0) {
+            i++;
+            if (i < argc) params.min_dipped_density = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--maxd")==0) {
+            i++;
+            if (i < argc) params.max_dipped_percent = atof(argv[i]);
+        }
+        if ((strcmp(argv[i],"-r")==0) ||
+            (strcmp(argv[i],"--diprad")==0)) {
+            i++;
+            if (i < argc) params.expected_dip_radius_percent = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--minint")==0) {
+            i++;
+            if (i < argc) params.min_intermediate_percent = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--maxint")==0) {
+            i++;
+            if (i < argc) params.max_intermediate_percent = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--peak")==0) {
+            i++;
+            if (i < argc) params.peak_threshold = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--dip")==0) {
+            i++;
+            if (i < argc) params.dip_threshold = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--minrecall")==0) {
+            i++;
+            if (i < argc) min_recall = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--maxfpr")==0) {
+            i++;
+            if (i < argc) max_false_positive_rate = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--sweep")==0) {
+            i++;
+            if (i < argc) sprintf(sweep_filename, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--surface")==0) {
+            i++;
+            if (i < argc) sprintf(surface_filename, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--foldstore")==0) {
+            i++;
+            if (i < argc) sprintf(foldstore_directory, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--bin")==0) {
+            i++;
+            if (i < argc) detect_bin_fraction = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--compact")==0) {
+            detect_compact = 1;
+        }
+        if (strcmp(argv[i],"--bins")==0) {
+            i++;
+            if (i < argc) detect_curve_length = atoi(argv[i]);
+            if ((detect_curve_length < DETECT_MIN_CURVE_LENGTH) ||
+                (detect_curve_length > DETECT_MAX_CURVE_LENGTH) ||
+                ((detect_curve_length & (detect_curve_length-1)) != 0)) {
+                printf("Buckets must be a power of two from %d to %d\n",
+                       DETECT_MIN_CURVE_LENGTH, DETECT_MAX_CURVE_LENGTH);
+                return 1;
+            }
+        }
+        if (strcmp(argv[i],"--triage")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"skip")==0)
+                    triage_mode = TRIAGE_SKIP;
+                else if (strcmp(argv[i],"coarse")==0)
+                    triage_mode = TRIAGE_COARSE;
+                else {
+                    printf("Unknown triage %s\n", argv[i]);
+                    return 1;
+                }
+            }
+        }
+        if (strcmp(argv[i],"--fap")==0) {
+            i++;
+            if (i < argc) bootstrap_iterations = atoi(argv[i]);
+        }
+        if (strcmp(argv[i],"--fap-alpha")==0) {
+            i++;
+            if (i < argc) bootstrap_alpha = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--prescreen")==0) {
+            i++;
+            if (i < argc) detect_prescreen_fraction = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--inject")==0) {
+            i++;
+            if (i < argc) no_of_injections = atoi(argv[i]);
+        }
+        if (strcmp(argv[i],"--depth")==0) {
+            i++;
+            if ((i < argc) &&
+                (sscanf(argv[i], "%f,%f", &min_depth, &max_depth) != 2)) {
+                printf("Depths should be given as minimum,maximum\n");
+                return 1;
+            }
+        }
+        if (strcmp(argv[i],"--duration")==0) {
+            i++;
+            if (i < argc) duration_hours = atof(argv[i]);
+        }
+        if (strcmp(argv[i],"--shape")==0) {
+            i++;
+            if (i < argc) {
+                if (strcmp(argv[i],"box")==0)
+                    shape = INJECT_SHAPE_BOX;
+                else if (strcmp(argv[i],"limb")==0)
+                    shape = INJECT_SHAPE_LIMB;
+                else {
+                    printf("Unknown transit shape %s\n", argv[i]);
+                    return 1;
+                }
+            }
+        }
+        if (strcmp(argv[i],"--seed")==0) {
+            i++;
+            if (i < argc) seed = (unsigned int)atol(argv[i]);
+        }
+        if (strcmp(argv[i],"--injectcsv")==0) {
+            i++;
+            if (i < argc) sprintf(inject_filename, "%s", argv[i]);
+        }
+        if (strcmp(argv[i],"--csv")==0) {
+            i++;
+            if (i < argc) sprintf(csv_filename, "%s", argv[i]);
+        }
+        if ((strcmp(argv[i],"-h")==0) ||
+            (strcmp(argv[i],"--help")==0)) {
+            show_help();
+            return 0;
+        }
+    }
+
+    if (no_of_injections > 0) {
+        if ((min_depth <= 0) || (max_depth < min_depth) || (max_depth >= 1)) {
+            printf("Injected depths must be between zero and one\n");
+            return 1;
+        }
+        return check_inject(fixtures_dir, no_of_injections,
+                            min_depth, max_depth, duration_hours, shape,
+                            seed, minimum_period_days, maximum_period_days,
+                            search_increment_seconds / (60.0f * 60.0f * 24.0f),
+                            minimum_data_samples, &params, tolerance_days,
+                            inject_filename);
+    }
+
+    if (sweep_filename[0] != 0) {
+        sets = (struct detect_params*)malloc(CHECK_MAX_SETS *
+                                             sizeof(struct detect_params));
+        if (sets == NULL) return 2;
+        no_of_sets = check_load_sweep(sweep_filename, &params,
+                                      sets, CHECK_MAX_SETS);
+        if (no_of_sets < 1) {
+            printf("Unable to load sweep %s\n", sweep_filename);
+            return 1;
+        }
+        printf("Sweeping %d sets of thresholds\n", no_of_sets);
+    }
+
+    sprintf(periods_filename, "%s/positive/periods.txt", fixtures_dir);
+    no_of_periods = check_load_periods(periods_filename, periods,
+                                       CHECK_MAX_PERIODS);
+    if (no_of_periods < 0) {
+        printf("Unable to load %s\n", periods_filename);
+        return 1;
+    }
+
+    filenames = malloc(CHECK_MAX_FILES * 2 * MAX_FILENAME_LENGTH);
+    fixtures = (struct check_fixture*)calloc(CHECK_MAX_FILES * 2,
+                                             sizeof(struct check_fixture));
+    if ((filenames == NULL) || (fixtures == NULL)) {
+        printf("Unable to allocate memory\n");
+        return 2;
+    }
+
+    for (j = 0; j < 2; j++) {
+        sprintf(subdir, "%s/%s", fixtures_dir,
+                (j == 0) ? "positive" : "negative");
+        n = scan_directory(subdir, ".tbl", filenames, CHECK_MAX_FILES);
+        for (i = 0; i < n; i++) {
+            struct check_fixture * fixture = &fixtures[no_of_fixtures];
+            sprintf(fixture->filename, "%s", filenames[i]);
+            fixture->positive = (j == 0);
+            if (fixture->positive) {
+                for (int k = 0; k < no_of_periods; k++) {
+                    if (strstr(fixture->filename, periods[k].ref) == NULL)
+                        continue;
+                    fixture->expected_period_days = periods[k].period_days;
+                    break;
+                }
+                if (fixture->expected_period_days == 0) {
+                    printf("No known period for %s\n", fixture->filename);
+                    continue;
+                }
+            }
+            no_of_fixtures++;
+        }
+    }
+    if (no_of_fixtures == 0) {
+        printf("No fixtures found within %s\n", fixtures_dir);
+        return 3;
+    }
+    printf("%d fixtures, %d threads\n", no_of_fixtures, omp_get_max_threads());
+
+    /* each thread scans a whole star, so the period search
+       within detect_orbital_period runs serially */
+    start = check_clock();
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < no_of_fixtures; i++) {
+        struct check_fixture * fixture = &fixtures[i];
+        float * timestamp = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+        float * series = (float*)malloc(MAX_SERIES_LENGTH*sizeof(float));
+        int * endpoints = (int*)malloc(MAX_SERIES_LENGTH*sizeof(int));
+        double fixture_start = check_clock();
+        struct fold_store store, * fold_store = NULL;
+        char name[MAX_FILENAME_LENGTH], reason[256];
+        int sections = 0;
+        float increment_days =
+            search_increment_seconds / (60.0f * 60.0f * 24.0f);
+        float max_response = 0;
+
+        if ((timestamp == NULL) || (series == NULL) || (endpoints == NULL)) {
+            free(timestamp);
+            free(series);
+            free(endpoints);
+            continue;
+        }
+
+        fixture->series_length =
+            logfile_load(fixture->filename, timestamp, series,
+                         MAX_SERIES_LENGTH, 0, 3);
+        if (no_of_sets > 0)
+            fixture->sweep_period_days =
+                (float*)calloc(no_of_sets, sizeof(float));
+
+        if (fixture->series_length >= minimum_data_samples)
+            sections = detect_endpoints(timestamp, fixture->series_length,
+                                        endpoints);
+
+        /* stars with no plausible transit are skipped or searched
+           over a coarser grid */
+        if ((sections > 0) && (triage_mode != TRIAGE_OFF) &&
+            triage_star(timestamp, series, fixture->series_length,
+                        endpoints, sections, reason)) {
+            fixture->triaged = 1;
+            if (triage_mode == TRIAGE_SKIP) sections = 0;
+            increment_days *= triage_coarse_factor;
+        }
+
+        if (sections > 0) {
+            if (foldstore_directory[0] != 0) {
+                scan_name(fixture->filename, name);
+                if (foldstore_open(foldstore_directory, name, timestamp,
+                                   series, fixture->series_length,
+                                   minimum_period_days, maximum_period_days,
+                                   increment_days, &store) == 0)
+                    fold_store = &store;
+            }
+            if (no_of_sets > 0) {
+                /* fold each trial period once and score every set */
+                detect_orbital_period_sweep(timestamp, series,
+                                            fixture->series_length,
+                                            minimum_period_days,
+                                            maximum_period_days,
+                                            increment_days,
+                                            sets, no_of_sets,
+                                            fixture->sweep_period_days,
+                                            fold_store);
+            }
+            else {
+                fixture->detected_period_days =
+                    detect_orbital_period_response(timestamp, series,
+                                                   fixture->series_length,
+                                                   minimum_period_days,
+                                                   maximum_period_days,
+                                                   increment_days,
+                                                   &params, fold_store,
+                                                   &max_response);
+            }
+            if (fold_store != NULL) foldstore_close(fold_store);
+
+            /* false alarm probability of each detection */
+            if ((bootstrap_iterations > 0) &&
+                (fixture->detected_period_days > 0))
+                bootstrap_fap(timestamp, series, fixture->series_length,
+                              minimum_period_days, maximum_period_days,
+                              increment_days, &params, max_response,
+                              &fixture->fap);
+        }
+
+        fixture->seconds = check_clock() - fixture_start;
+
+        free(timestamp);
+        free(series);
+        free(endpoints);
+    }
+    seconds = check_clock() - start;
+
+    if (no_of_sets > 0) {
+        best = check_save_surface(surface_filename, fixtures,
+                                  no_of_fixtures, sets, no_of_sets,
+                                  tolerance_days);
+        if (best < 0) {
+            printf("Unable to save %s\n", surface_filename);
+            return 6;
+        }
+        printf("Sweep results saved to %s\n", surface_filename);
+
+        /* report the fixtures for the best set */
+        params = sets[best];
+        printf("Best thresholds: --peak %.4f --dip %.4f --mindd %.4f "
+               "--minint %.4f --maxint %.4f --maxd %.4f --maxvac %.4f "
+               "--diprad %.4f\n",
+               params.peak_threshold, params.dip_threshold,
+               params.min_dipped_density, params.min_intermediate_percent,
+               params.max_intermediate_percent, params.max_dipped_percent,
+               params.max_vacancy_density,
+               params.expected_dip_radius_percent);
+        for (i = 0; i < no_of_fixtures; i++) {
+            fixtures[i].detected_period_days =
+                fixtures[i].sweep_period_days[best];
+            free(fixtures[i].sweep_period_days);
+        }
+        free(sets);
+    }
+
+    for (i = 0; i < no_of_fixtures; i++) {
+        struct check_fixture * fixture = &fixtures[i];
+        if (fixture->positive) {
+            fixture->correct =
+                (fabs(fixture->detected_period_days -
+                      fixture->expected_period_days) <= tolerance_days);
+        }
+        else {
+            fixture->correct = (fixture->detected_period_days == 0);
+        }
+        if (fixture->positive) {
+            positives++;
+            if (fixture->correct) recalled++;
+        }
+        else {
+            negatives++;
+            if (!fixture->correct) false_positives++;
+        }
+        if (fixture->series_length > 0) samples += fixture->series_length;
+        printf("%-4s %-8s expected %.6f detected %.6f %8.2fs  %s\n",
+               fixture->positive ? "pos" : "neg",
+               fixture->correct ? "ok" : "FAIL",
+               fixture->expected_period_days,
+               fixture->detected_period_days,
+               fixture->seconds, fixture->filename);
+    }
+
+    recall = (positives > 0) ? recalled / (float)positives : 0;
+    false_positive_rate =
+        (negatives > 0) ? false_positives / (float)negatives : 0;
+    trials = (long)((maximum_period_days - minimum_period_days) /
+                    (search_increment_seconds / (60.0f * 60.0f * 24.0f)));
+
+    printf("\nRecall %d/%d (%.3f)\n", recalled, positives, recall);
+    if (triage_mode != TRIAGE_OFF) {
+        for (i = 0, j = 0, n = 0; i < no_of_fixtures; i++) {
+            if (!fixtures[i].triaged) continue;
+            n++;
+            if (fixtures[i].positive) j++;
+        }
+        printf("Triaged %d/%d (%d positive)\n", n, no_of_fixtures, j);
+    }
+    printf("False positives %d/%d (%.3f)\n", false_positives, negatives,
+           false_positive_rate);
+    if ((bootstrap_iterations > 0) && (no_of_sets == 0)) {
+        /* detections, those found significant and those of them with
+           the expected period, together with the searches made */
+        for (i = 0, j = 0, n = 0, k = 0, m = 0; i < no_of_fixtures; i++) {
+            if (fixtures[i].detected_period_days == 0) continue;
+            n++;
+            m += fixtures[i].fap.iterations;
+            if (fixtures[i].fap.verdict != BOOTSTRAP_SIGNIFICANT) continue;
+            j++;
+            if (fixtures[i].positive && fixtures[i].correct) k++;
+        }
+        printf("Significant %d/%d detections (%d correct), "
+               "%d null searches\n", j, n, k, m);
+    }
+    printf("Elapsed %.2fs, %.2f stars/s, %.0f trial periods/s, "
+           "%.0f samples folded/s\n",
+           seconds, no_of_fixtures / seconds,
+           no_of_fixtures * (double)trials / seconds,
+           samples * (double)trials / seconds);
+
+    if (csv_filename[0] != 0) {
+        fp = fopen(csv_filename, "a");
+        if (fp) {
+            fprintf(fp, "%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f,%.2f\n",
+                    recalled + (negatives - false_positives),
+                    params.peak_threshold, params.min_dipped_density,
+                    params.min_intermediate_percent,
+                    params.max_intermediate_percent,
+                    params.max_dipped_percent,
+                    params.expected_dip_radius_percent,
+                    recall, false_positive_rate, seconds);
+            fclose(fp);
+        }
+    }
+
+    free(filenames);
+    free(fixtures);
+
+    if (recall < min_recall) {
+        printf("Recall is below %.3f\n", min_recall);
+        return 4;
+    }
+    if (false_positive_rate > max_false_positive_rate) {
+        printf("False positive rate is above %.3f\n",
+               max_false_positive_rate);
+        return 5;
+    }
+    return 0;
+}